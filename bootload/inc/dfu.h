@@ -22,11 +22,21 @@
 
 #define DFU_CMD_RESTART     0x1     // reset DFU system - resets data counts etc.
 #define DFU_CMD_DATA        0x2     // data coming on the data channel
-#define DFU_CMD_IV          0x3     // Initialization vector coming on data channel
+#define DFU_CMD_IV          0x3     // Initialization vector coming on data channel. Address is the cipher mode
 #define DFU_CMD_DONE        0x4     // Download done, send status
 #define DFU_CMD_RESET       0x5     // reset device
 #define DFU_CMD_DIGEST      0x6     // Digest coming
 #define DFU_CMD_PING        0x7     // Check progress
+#define DFU_CMD_ERASE       0x8     // Erase pages without sending data. Length is the number of pages
+#define DFU_CMD_ZDATA       0x9     // compressed data coming on the data channel. Length is in cipher blocks
+#define DFU_CMD_PATCH       0xA     // patch against the current firmware coming on the data channel. Length is in cipher blocks
+#define DFU_CMD_PAGEHASH    0xB     // send the digest of each page from the address. Length is the number of pages
+#define DFU_CMD_TAG         0xC     // page tags for the next DATA command coming on the data channel, after its IV. Length is the number of tags
+
+// cipher modes, given with the IV
+
+#define DFU_CIPHER_CBC      0       // AES-256-CBC, chained through the block from the IV
+#define DFU_CIPHER_CTR      1       // AES-256-CTR, the IV being the counter for the start of the data
 
 #define IV_LEN              16      // length of initialization vector
 #define KEY_LEN             (256/8) // length of key
@@ -43,10 +53,13 @@ extern blat_t __UserStart;
 #define USER_BLAT    (&__UserStart)
 extern bool processCtrlPacket(uint8 * packet);      // process a control packet. Return true if accepted
 extern bool processDataPacket(uint8 * packet, uint8 len);    // process a data packet.
+extern bool pagePending(void);                      // true if a page received is waiting to be written
+extern void writePendingPage(void);                 // start writing the oldest page waiting, or finish it
 extern bool enterDfu;
 extern bool doReset;
 extern const unsigned char ota_key[KEY_LEN];
 extern unsigned char deKey[KEY_LEN];
+extern void initPageTags(void);                     // derive the page tag keys from ota_key
 extern uint8 currentConnection;
 
 #define DFU_ENTRY_VECTOR    7       // index into vector table for EnterDFU_Handler
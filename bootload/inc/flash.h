@@ -46,14 +46,16 @@
 
 /* Helper functions */
 RAMFUNC void FLASH_writeWord(uint32_t address, uint32_t data);
-RAMFUNC void FLASH_writeBlock(void *block_start,                                
-                                uint32_t count,
-                                uint8_t const *buffer);
 RAMFUNC void FLASH_eraseOneBlock(uint32_t blockStart);
+RAMFUNC void FLASH_checkWrite(void);
+RAMFUNC void FLASH_startWrite(uint32_t address, uint32_t const *data, uint32_t count);
+RAMFUNC void FLASH_finishWrite(void);
+void FLASH_initDma(void);
 void FLASH_init(void);
 void FLASH_CalcPageSize(void);
 
 //#define FLASH_PAGE_SIZE 0x800       // flash page size on EFR32BG
+#define FLASH_DMA_CH    7           // LDMA channel used to write flash
 
 extern uint32_t flashPageSize;
 #endif
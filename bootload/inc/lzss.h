@@ -0,0 +1,49 @@
+//
+// LZSS decompression of firmware blocks. Plain C with no dependencies on the device, so the
+// firmware packager builds the same decoder to check what it compresses.
+//
+
+#ifndef BGBOOTLOAD_LZSS_H
+#define BGBOOTLOAD_LZSS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * The stream starts with the decompressed length, 4 bytes little endian. Then come groups of up
+ * to 8 items, each group led by a flag byte with one bit per item, low bit first: 1 for a literal
+ * byte, 0 for a 2 byte match. A match copies LZSS_MIN_MATCH + (b1 & 0x3F) bytes from
+ * 1 + (b0 | (b1 >> 6) << 8) bytes back. Anything after the decompressed length is reached, such as
+ * cipher padding, is ignored.
+ */
+#define LZSS_WINDOW         1024    // how far back a match can reach
+#define LZSS_MIN_MATCH      3
+#define LZSS_MAX_MATCH      (LZSS_MIN_MATCH + 0x3F)
+#define LZSS_HEADER_LEN     4
+
+typedef struct {
+    uint8_t window[LZSS_WINDOW];    // the most recent output
+    uint32_t remaining;             // output still to come
+    uint16_t pos;                   // where the next output byte goes in the window
+    uint16_t matchDist;             // distance back of the match being copied
+    uint8_t matchLen;               // bytes of that match still to copy
+    uint8_t flags;                  // item types left in the current group, low bit next
+    uint8_t items;                  // items left in the current group
+    uint8_t state;                  // what the next input byte is
+    uint8_t low;                    // first byte of a match
+} lzss_state;
+
+extern void lzss_init(lzss_state *s);
+
+/*
+ * Decompress as much of the input as there is room for in the output, returning the number of
+ * bytes output and setting *used to the number of input bytes consumed. The input may be fed in
+ * pieces of any size; a match that doesn't fit is finished by the next call, even with no input.
+ */
+extern uint32_t lzss_decode(lzss_state *s, const uint8_t *in, uint32_t inLen, uint32_t *used,
+                            uint8_t *out, uint32_t outLen);
+
+// true once all of the decompressed length has been output
+extern bool lzss_done(const lzss_state *s);
+
+#endif //BGBOOTLOAD_LZSS_H
@@ -0,0 +1,21 @@
+//
+// Page tags, which let the bootloader check each page of a block before writing it. Shared with the
+// firmware packager, which computes them.
+//
+
+#ifndef BGBOOTLOAD_PAGETAG_H
+#define BGBOOTLOAD_PAGETAG_H
+
+/*
+ * A tag is an AES-CMAC of one page's worth of a DATA block: a cipher block holding the address the
+ * data is written to and its length, 4 bytes each little endian and the rest zero, followed by the
+ * plaintext, which is always a whole number of cipher blocks. The MAC is truncated to TAG_LEN.
+ * Tagged blocks have a tag for each flash page their data, padding included, is written to.
+ *
+ * The CMAC key is the AES-256 encryption of TAG_KEY_LABEL with the firmware key, so the key used
+ * for encryption is never used for the MAC.
+ */
+#define TAG_LEN         8
+#define TAG_KEY_LABEL   "bgbootload page tag key 00000001"
+
+#endif //BGBOOTLOAD_PAGETAG_H
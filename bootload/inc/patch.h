@@ -0,0 +1,53 @@
+//
+// Applying delta patches to firmware blocks. Plain C with no dependencies on the device, so the
+// firmware packager builds the same code to check the patches it generates.
+//
+
+#ifndef BGBOOTLOAD_PATCH_H
+#define BGBOOTLOAD_PATCH_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * A patch rebuilds a block from the firmware already in flash. It starts with the length of the
+ * new block, 4 bytes little endian, followed by operations:
+ *  0x00-0x7F   literal: the op + 1 bytes that follow are output as they are
+ *  0x80        copy: output length + 1 bytes read from flash at address. The address (4 bytes) and
+ *              length (2 bytes) follow, little endian
+ * Anything after the new length is reached, such as cipher padding, is ignored.
+ */
+#define PATCH_HEADER_LEN    4
+#define PATCH_MAX_LITERAL   0x80
+#define PATCH_OP_COPY       0x80
+#define PATCH_COPY_LEN      7       // length of a copy operation
+#define PATCH_MAX_COPY      0x10000
+
+// read len bytes of the old firmware at addr into buf
+typedef void (*patch_reader)(void *arg, uint32_t addr, uint8_t *buf, uint32_t len);
+
+typedef struct {
+    patch_reader read;
+    void *arg;
+    uint32_t remaining;             // output still to come
+    uint32_t count;                 // bytes left in the current literal or copy
+    uint32_t src;                   // where the current copy reads from
+    uint8_t state;                  // what the next input byte is
+    uint8_t argLen;                 // bytes of the header or copy arguments read so far
+    uint8_t args[PATCH_COPY_LEN - 1];
+} patch_state;
+
+extern void patch_init(patch_state *s, patch_reader read, void *arg);
+
+/*
+ * Apply as much of the patch as there is room for in the output, returning the number of bytes
+ * output and setting *used to the number of patch bytes consumed. The patch may be fed in pieces
+ * of any size; a copy that doesn't fit is finished by the next call, even with no input.
+ */
+extern uint32_t patch_apply(patch_state *s, const uint8_t *in, uint32_t inLen, uint32_t *used,
+                            uint8_t *out, uint32_t outLen);
+
+// true once all of the new block has been output
+extern bool patch_done(const patch_state *s);
+
+#endif //BGBOOTLOAD_PATCH_H
@@ -8,27 +8,72 @@
 #include <em_crypto.h>
 #include <native_gecko.h>
 #include <gatt_db.h>
+#include <lzss.h>
+#include <patch.h>
+#include <pagetag.h>
 
 #define PROG_INCREMENT  25
 #define DFU_RESYNC 1
 #define DIGEST_FAILED 2
+#define PAGE_HASH 3                             // followed by the page address and its digest
+#define MAX_PAGE_HASHES 8                       // most pages hashed by one PAGEHASH command
+#define MAX_TAGS (0x10000 / FLASH_PAGE_SIZE + 1) // most pages a DATA command can write to
+#define MAC_CHUNK 64                            // page tags are computed this much at a time
+#define PAGE_BUFFERS 2                          // pages being received or waiting to be written, at least 2
 
 static uint32 dataAddress, digestSize, digestAddress, baseAddress, dataCount;
 static uint32 ivLen, digestLen;
+static uint32 dataLength;                       // the length of the current DATA block
 static uint8_t iv[IV_LEN];
+static bool ctrMode;                            // the data is encrypted with AES-CTR, not CBC
+static uint8_t ctrBase[IV_LEN];                 // in CTR mode, the counter at baseAddress
 static uint8_t digest[DIGEST_LEN];
 static uint8_t calcDigest[DIGEST_LEN];
 
 bool doReset;
 
-static uint8_t dataBuffer[FLASH_PAGE_SIZE];     // holds data for decryption
-static uint32_t bufferBase;                     // address corresponding to base of buffer
-static uint32_t bufferStart;                    // start of encrypted data in buffer
-static uint32_t bufferEnd;                      // length of encrypted data in buffer
+/*
+ * A page of flash being received, or waiting to be written. The buffer being filled belongs to the
+ * packet handlers; once handed over it belongs to the writer, which decrypts it, checks it and starts
+ * writing it from the main loop between stack events. The LDMA then feeds it to flash, so the next
+ * page can be received meanwhile. Pages are handed over and written in order.
+ */
+typedef struct {
+    uint8_t data[FLASH_PAGE_SIZE];
+    uint32_t base;                              // address corresponding to base of buffer
+    uint32_t start;                             // start of the data received in the buffer
+    uint32_t end;                               // end of the data received in the buffer
+    uint8_t iv[IV_LEN];                         // the IV or counter to decrypt the data with
+    bool plain;                                 // the data is already decrypted and decoded
+} page_buffer;
+
+static page_buffer pages[PAGE_BUFFERS];
+static uint32_t pageHead;                       // the oldest page waiting to be written
+static uint32_t pageQueued;                     // the number of pages waiting to be written
+static page_buffer *fill = pages;               // the page being received, which follows those waiting
+static bool pageWriting;                        // the oldest page waiting is being written by the LDMA
+static volatile bool pageWritten;               // set by the LDMA interrupt when it has loaded the last word
+#if defined(DEBUG)
+static uint32_t eraseCycles, writeCycles;       // to time page writes
+#endif
 static uint32_t startTime;
 static uint32_t bytesRead;
 static uint8_t progressBuf[5];
+static uint8_t pageHashBuf[5 + DIGEST_LEN];
 static bool digestFailed;
+static uint32_t streamCmd;                      // ZDATA or PATCH if the current block is encoded, else 0
+static union {
+    lzss_state lzss;
+    patch_state patch;
+} decoder;                                      // its decoder
+static uint8_t cipherBuf[MAX_MTU + IV_LEN];     // its ciphertext not yet decrypted
+static uint32_t cipherLen;
+static uint8_t tagKey[KEY_LEN];                 // CMAC key for page tags
+static uint8_t tagSubkey[IV_LEN];               // CMAC subkey K1
+static uint8_t tags[MAX_TAGS][TAG_LEN];         // tags for the pages of the current DATA block
+static uint32_t tagCount;                       // the number of tags, 0 if the block has none
+static uint32_t tagLen;                         // bytes of tags still to come
+static uint32_t tagBase;                        // the page the first tag is for
 
 // get a 16 bit word
 
@@ -51,18 +96,286 @@ static uint32 putWord32(uint8 *ptr, uint32_t val) {
     ptr[3] = (uint8) (val >> 24);
 }
 
-static void decode() {
-    if (bufferEnd != bufferStart) {
-        uint8_t newIv[IV_LEN];
-        // save the last block of ciphertext as the new IV
-        memcpy(newIv, dataBuffer + bufferEnd - IV_LEN, IV_LEN);
-        uint8_t *bp = dataBuffer + bufferStart;
-        CRYPTO_AES_CBC256(CRYPTO, bp, bp, bufferEnd - bufferStart, deKey, iv, false);
-        memcpy(iv, newIv, IV_LEN);
-        printf("Flashing block at %X\n", bufferBase);
-        FLASH_eraseOneBlock(bufferBase);
-        FLASH_writeBlock((void *) bufferBase, FLASH_PAGE_SIZE, dataBuffer);
+// true if count whole pages starting at address are all in the application's flash
+static bool userPages(uint32_t address, uint32_t count) {
+    return address >= (uint32) USER_BLAT && (address & (FLASH_PAGE_SIZE - 1)) == 0 &&
+           address < FLASH_BASE + FLASH_SIZE && count <= (FLASH_BASE + FLASH_SIZE - address) / FLASH_PAGE_SIZE;
+}
+
+// decrypt in place, saving the last block of ciphertext as the new IV, or advancing the counter
+static void decrypt(uint8_t *bp, uint32_t len, uint8_t *chain) {
+    uint8_t newIv[IV_LEN];
+
+    if (ctrMode) {
+        CRYPTO_AES_CTR256(CRYPTO, bp, bp, len, ota_key, chain, NULL);
+        return;
     }
+    memcpy(newIv, bp + len - IV_LEN, IV_LEN);
+    CRYPTO_AES_CBC256(CRYPTO, bp, bp, len, deKey, chain, false);
+    memcpy(chain, newIv, IV_LEN);
+}
+
+/**
+ * In CTR mode, set the counter for the data at an address, so it can be decrypted without what
+ * came before it. The hardware increments only the low 32 bits of the counter, and so does this.
+ */
+static void seekCounter(uint8_t *counter, uint32_t address) {
+    uint32_t ctr = (ctrBase[12] << 24 | ctrBase[13] << 16 | ctrBase[14] << 8 | ctrBase[15]) +
+                   (address - baseAddress) / IV_LEN;
+
+    memcpy(counter, ctrBase, IV_LEN - 4);
+    counter[12] = (uint8_t) (ctr >> 24);
+    counter[13] = (uint8_t) (ctr >> 16);
+    counter[14] = (uint8_t) (ctr >> 8);
+    counter[15] = (uint8_t) ctr;
+}
+
+void initPageTags() {
+    uint8_t l[IV_LEN];
+    int i;
+
+    CRYPTO_AES_ECB256(CRYPTO, tagKey, (const uint8_t *) TAG_KEY_LABEL, KEY_LEN, ota_key, true);
+    memset(l, 0, IV_LEN);
+    CRYPTO_AES_ECB256(CRYPTO, l, l, IV_LEN, tagKey, true);
+    // K1 is L shifted left one bit, reduced by the field polynomial
+    for (i = 0; i != IV_LEN; i++)
+        tagSubkey[i] = (uint8_t) (l[i] << 1 | (i != IV_LEN - 1 ? l[i + 1] >> 7 : 0));
+    if (l[0] & 0x80)
+        tagSubkey[IV_LEN - 1] ^= 0x87;
+}
+
+// continue a CBC-MAC over some whole cipher blocks
+static void cbcMac(uint8_t *mac, const uint8_t *data, uint32_t len) {
+    uint8_t out[MAC_CHUNK];
+
+    while (len != 0) {
+        uint32_t n = len > MAC_CHUNK ? MAC_CHUNK : len;
+
+        CRYPTO_AES_CBC256(CRYPTO, out, data, n, tagKey, mac, true);
+        memcpy(mac, out + n - IV_LEN, IV_LEN);
+        data += n;
+        len -= n;
+    }
+}
+
+// check decrypted data against the tag for its page, as described in pagetag.h
+static bool checkTag(uint32_t address, const uint8_t *data, uint32_t len) {
+    uint8_t mac[IV_LEN], block[IV_LEN];
+    uint32_t index = ((address & ~(FLASH_PAGE_SIZE - 1)) - tagBase) / FLASH_PAGE_SIZE;
+    int i;
+
+    if (index >= tagCount || len < IV_LEN)
+        return false;
+    memset(mac, 0, IV_LEN);
+    memset(block, 0, IV_LEN);
+    putWord32(block, address);
+    putWord32(block + 4, len);
+    cbcMac(mac, block, IV_LEN);
+    cbcMac(mac, data, len - IV_LEN);
+    for (i = 0; i != IV_LEN; i++)
+        block[i] = data[len - IV_LEN + i] ^ tagSubkey[i];
+    cbcMac(mac, block, IV_LEN);
+    return memcmp(mac, tags[index], TAG_LEN) == 0;
+}
+
+/**
+ * Start writing out the oldest page waiting, decrypting it first if need be. The page is erased, then
+ * the LDMA programs it while the CPU gets on with other things; it stays queued until finishPageWrite().
+ * If the block has page tags and the data doesn't match its tag, nothing is written. The pages after it
+ * are dropped too, its buffer is refilled from the start of its data, and the loader is asked to send
+ * the data again from there.
+ * @return  false if the page failed its tag
+ */
+static bool startPageWrite() {
+    page_buffer *p = &pages[pageHead];
+    uint8_t chain[IV_LEN];
+    uint32_t address = p->base + p->start;
+
+    if (!p->plain) {
+        memcpy(chain, p->iv, IV_LEN);
+        decrypt(p->data + p->start, p->end - p->start, chain);
+        if (tagCount != 0 && !checkTag(address, p->data + p->start, p->end - p->start)) {
+            printf("Page tag failed at %X\n", address);
+            if (!ctrMode)
+                memcpy(iv, p->iv, IV_LEN);
+            pageQueued = 0;
+            fill = p;
+            fill->end = fill->start;
+            dataAddress = address;
+            dataCount = dataLength;
+            progressBuf[0] = DFU_RESYNC;
+            putWord32(progressBuf + 1, address);
+            gecko_cmd_gatt_server_send_characteristic_notification(currentConnection, GATTDB_ota_progress,
+                                                                   sizeof(progressBuf), progressBuf);
+            return false;
+        }
+    }
+#if defined(DEBUG)
+    eraseCycles = DWT->CYCCNT;
+    FLASH_eraseOneBlock(p->base);
+    writeCycles = DWT->CYCCNT;
+    eraseCycles = writeCycles - eraseCycles;
+#else
+    FLASH_eraseOneBlock(p->base);
+#endif
+    pageWritten = false;
+    pageWriting = true;
+    FLASH_startWrite(p->base, (const uint32_t *) p->data, FLASH_PAGE_SIZE / sizeof(uint32_t));
+    return true;
+}
+
+// the LDMA has loaded the last word of the page being written
+void LDMA_IRQHandler(void) {
+    LDMA->IFC = 1 << FLASH_DMA_CH;
+    pageWritten = true;
+}
+
+// wait for the page being written to finish, and free its buffer
+static void finishPageWrite() {
+    while (!pageWritten)
+        FLASH_checkWrite();
+    FLASH_finishWrite();
+#if defined(DEBUG)
+    printf("Flashed block at %X: erase %u cycles, program %u cycles\n", pages[pageHead].base, eraseCycles,
+           DWT->CYCCNT - writeCycles);
+#endif
+    pageWriting = false;
+    pageHead = (pageHead + 1) % PAGE_BUFFERS;
+    pageQueued--;
+}
+
+/**
+ * Write out the oldest page waiting, and wait for it to be written.
+ * @return  false if the page failed its tag
+ */
+static bool commitPage() {
+    if (!pageWriting && !startPageWrite())
+        return false;
+    finishPageWrite();
+    return true;
+}
+
+// write out all the pages waiting, before anything that reads the flash or changes the cipher
+static bool commitPages() {
+    while (pageQueued != 0)
+        if (!commitPage())
+            return false;
+    return true;
+}
+
+// is a page waiting to be written?
+static bool isQueued(uint32_t base) {
+    uint32_t i;
+
+    for (i = 0; i != pageQueued; i++)
+        if (pages[(pageHead + i) % PAGE_BUFFERS].base == base)
+            return true;
+    return false;
+}
+
+/**
+ * Hand the page being received over to be written, and start receiving into the next buffer. Data
+ * still encrypted takes the IV or counter to decrypt it with, and in CBC mode the next page chains
+ * from its last cipher block. If all the other buffers are waiting, the oldest is written first.
+ * @param plain     the data is already decrypted and decoded
+ * @return  false if the page written failed its tag, so the data is to be sent again from there
+ */
+static bool queuePage(bool plain) {
+    if (pageQueued == PAGE_BUFFERS - 1 && !commitPage())
+        return false;
+    fill->plain = plain;
+    if (!plain) {
+        if (ctrMode)
+            seekCounter(fill->iv, fill->base + fill->start);
+        else {
+            memcpy(fill->iv, iv, IV_LEN);
+            memcpy(iv, fill->data + fill->end - IV_LEN, IV_LEN);
+        }
+    }
+    pageQueued++;
+    fill = &pages[(pageHead + pageQueued) % PAGE_BUFFERS];
+    fill->base = 0;
+    fill->start = 0;
+    fill->end = 0;
+    return true;
+}
+
+// drop the pages waiting and the one being received, once any being written is finished
+static void dropPages() {
+    if (pageWriting)
+        finishPageWrite();
+    pageQueued = 0;
+    fill = &pages[pageHead];
+    fill->base = 0;
+    fill->start = 0;
+    fill->end = 0;
+}
+
+bool pagePending() {
+    return pageQueued != 0;
+}
+
+void writePendingPage() {
+    if (pageWriting) {
+        if (pageWritten)
+            finishPageWrite();
+        else
+            FLASH_checkWrite();
+    } else if (pageQueued != 0)
+        startPageWrite();
+}
+
+/**
+ * Start decompressing into the page holding an address. The data before it in the page is kept; the
+ * rest is filled in when the page is finished, since where the data ends isn't known until then.
+ * @param address   The next address to write to
+ */
+static void startPage(uint32_t address) {
+    fill->base = address & ~(FLASH_PAGE_SIZE - 1);
+    fill->start = address - fill->base;
+    fill->end = fill->start;
+    memcpy(fill->data, (const void *) fill->base, fill->start);
+}
+
+// hand over the last page of a compressed block, keeping whatever follows the data
+static void finishPage() {
+    if (fill->end != fill->start) {
+        memcpy(fill->data + fill->end, (const void *) (fill->base + fill->end), FLASH_PAGE_SIZE - fill->end);
+        queuePage(true);
+    } else {
+        fill->base = 0;
+        fill->start = 0;
+        fill->end = 0;
+    }
+}
+
+// patches copy from the old firmware, straight out of flash
+static void readFlash(void *arg, uint32_t addr, uint8_t *buf, uint32_t len) {
+    memcpy(buf, (const void *) addr, len);
+}
+
+static bool streamDone() {
+    return streamCmd == DFU_CMD_PATCH ? patch_done(&decoder.patch) : lzss_done(&decoder.lzss);
+}
+
+// decode plaintext into the page buffer, handing over each page as it fills
+static void inflate(const uint8_t *data, uint32_t len) {
+    uint32_t used, n, base;
+
+    do {
+        if (streamCmd == DFU_CMD_PATCH)
+            n = patch_apply(&decoder.patch, data, len, &used, fill->data + fill->end, FLASH_PAGE_SIZE - fill->end);
+        else
+            n = lzss_decode(&decoder.lzss, data, len, &used, fill->data + fill->end, FLASH_PAGE_SIZE - fill->end);
+        data += used;
+        len -= used;
+        fill->end += n;
+        if (fill->end == FLASH_PAGE_SIZE) {
+            base = fill->base;
+            queuePage(true);
+            startPage(base + FLASH_PAGE_SIZE);
+        }
+    } while (!streamDone() && (len != 0 || n != 0));
 }
 
 
@@ -80,13 +393,19 @@ static void setAddress(uint32_t address) {
     dataAddress = address;
     //printf("Set address to %X\n", address);
     uint32_t base = address & ~(FLASH_PAGE_SIZE - 1);     // get start of block
-    if (bufferBase != base) {
-        decode();
-        bufferBase = base;
-        // prefill the buffer with whatever data is already there, in case we want to write a partial block
-        memcpy(dataBuffer, (const void *) bufferBase, FLASH_PAGE_SIZE);
-        bufferStart = address - base;
-        bufferEnd = bufferStart;
+    if (fill->base != base) {
+        if (fill->end != fill->start && !queuePage(false))
+            return;
+        // prefill the buffer with whatever data is already there, in case we want to write a partial block.
+        // Not needed if the block covers the whole page, as page aligned firmware files always do.
+        if (address != base || address + FLASH_PAGE_SIZE > baseAddress + dataCount) {
+            if (isQueued(base) && !commitPages())
+                return;
+            memcpy(fill->data, (const void *) base, FLASH_PAGE_SIZE);
+        }
+        fill->base = base;
+        fill->start = address - base;
+        fill->end = fill->start;
     }
 }
 
@@ -110,26 +429,67 @@ bool checkDigest() {
                                                                1, progressBuf);
         return false;
     }
-    digestFailed = false;
     return true;
 }
 
 // copy a block of data into the buffer. Side effects include writing it to memory.
+// Returns false if a page was rejected, so the data is to be sent again from there.
 
-static void copydata(uint8_t *packet, uint32_t len) {
-    uint32_t offs = dataAddress - bufferBase;
-    memcpy(dataBuffer + offs, packet, len);
+static bool copydata(uint8_t *packet, uint32_t len) {
+    uint32_t offs = dataAddress - fill->base;
+    uint32_t next = dataAddress + len;
+    memcpy(fill->data + offs, packet, len);
     dataAddress += len;
-    bufferEnd = offs + len;
+    fill->end = offs + len;
     //printf("Length remaining %d\n", count);
     if (dataAddress == baseAddress + dataCount) {
         uint32_t duration = getTime() - startTime;
         printf("Transferred %u bytes in %d.%1d seconds at %d/sec\n", bytesRead, duration / 1000, (duration % 1000) / 10,
                bytesRead * 1000 / duration);
-        decode();
+        if (!queuePage(false))
+            return false;
         dataCount = 0;
     } else
         setAddress(dataAddress);
+    return dataAddress == next;
+}
+
+/**
+ * Process the data in a packet of a compressed or patch block. Data already received is skipped rather
+ * than rewound, since the decoder can't go back. Ciphertext is decrypted a cipher block at a time,
+ * as packets after a resync may not line up with cipher blocks.
+ */
+static bool processCompressed(uint8_t *packet, uint32_t baddr, uint32_t dlen) {
+    if (baddr < dataAddress) {
+        if (dataAddress - baddr >= dlen)
+            return true;
+        packet += dataAddress - baddr;
+        dlen -= dataAddress - baddr;
+    }
+    if (dlen + dataAddress > baseAddress + dataCount)
+        return false;
+    memcpy(cipherBuf + cipherLen, packet, dlen);
+    cipherLen += dlen;
+    dataAddress += dlen;
+    bytesRead += dlen;
+    uint32_t clen = cipherLen & ~(IV_LEN - 1);
+    if (clen != 0) {
+        decrypt(cipherBuf, clen, iv);
+        inflate(cipherBuf, clen);
+        cipherLen -= clen;
+        memmove(cipherBuf, cipherBuf + clen, cipherLen);
+    }
+    if (dataAddress == baseAddress + dataCount) {
+        uint32_t duration = getTime() - startTime;
+        printf("Transferred %u bytes in %d.%1d seconds at %d/sec\n", bytesRead, duration / 1000, (duration % 1000) / 10,
+               bytesRead * 1000 / duration);
+        if (!streamDone())
+            printf("Encoded data ended early\n");
+        finishPage();
+        dataCount = 0;
+        streamCmd = 0;
+    }
+    return true;
 }
 
 // process a data packet.
@@ -139,6 +499,7 @@ bool processDataPacket(uint8 *packet, uint8 len) {
     if (ivLen != 0) {
         if (len == ivLen) {
             memcpy(iv, packet, len);
+            memcpy(ctrBase, packet, len);
             ivLen = 0;
             return true;
         }
@@ -147,6 +508,18 @@ bool processDataPacket(uint8 *packet, uint8 len) {
         return false;
     }
 
+    if (tagLen != 0) {
+        if (len <= tagLen) {
+            memcpy(tags[tagCount] - tagLen, packet, len);
+            tagLen -= len;
+            return true;
+        }
+        printf("Bad tag len %d\n", len);
+        tagLen = 0;
+        tagCount = 0;
+        return false;
+    }
+
     if (digestLen != 0) {
         if (len == digestLen) {
             memcpy(digest, packet, len);
@@ -161,6 +534,8 @@ bool processDataPacket(uint8 *packet, uint8 len) {
     }
 
     uint32_t baddr = getWord32(packet);
+    if (streamCmd != 0 && baddr <= dataAddress)
+        return processCompressed(packet + 4, baddr, (uint32_t) (len - 4));
     if (baddr != dataAddress) {
         printf("packet address %X != expected %X\n", baddr, dataAddress);
         if (baddr > dataAddress) {
@@ -171,16 +546,18 @@ bool processDataPacket(uint8 *packet, uint8 len) {
             return true;
         }
         setAddress(baddr);
+        if (dataAddress != baddr)
+            return true;        // the page being left was rejected
     }
 
     uint8_t dlen = (uint8_t) (len - 4);
     bytesRead += dlen;
     if (dlen + dataAddress <= baseAddress + dataCount) {
         // does the packet cross a page boundary?
-        uint32_t offs = dataAddress - bufferBase;
-        if (bufferEnd + dlen > FLASH_PAGE_SIZE) {
-            uint32_t tlen = FLASH_PAGE_SIZE - bufferEnd;
-            copydata(packet + 4, tlen);
+        if (fill->end + dlen > FLASH_PAGE_SIZE) {
+            uint32_t tlen = FLASH_PAGE_SIZE - fill->end;
+            if (!copydata(packet + 4, tlen))
+                return true;
             dlen -= tlen;
             packet += tlen;
         }
@@ -197,12 +574,19 @@ bool processCtrlPacket(uint8 *packet) {
     uint32 address = getWord32(packet + DFU_CTRL_PKT_ADR);
 
     printf("Cmd %X, len %d @ %X\n", cmd, len, address);
+    // commands act on the flash as the data has left it, so the pages waiting are written first. A page
+    // that fails its tag leaves its block incomplete, which the command finds. A PING only waits for
+    // them at the end of the data, so the loader hears of a bad page before it moves on.
+    if (cmd != DFU_CMD_RESTART && (cmd != DFU_CMD_PING || dataCount == 0))
+        commitPages();
     switch (cmd) {
         case DFU_CMD_RESTART:
             dataCount = 0;
-            bufferBase = 0;
-            bufferEnd = 0;
-            bufferStart = 0;
+            streamCmd = 0;
+            tagCount = 0;
+            tagLen = 0;
+            digestFailed = false;
+            dropPages();
             printf("Restarted DFU\n");
             int i = gecko_cmd_le_gap_set_conn_parameters(MIN_CONN_INTERVAL, MAX_CONN_INTERVAL, LATENCY,
                                                          SUPERV_TIMEOUT)->result;
@@ -211,7 +595,7 @@ bool processCtrlPacket(uint8 *packet) {
             return true;
 
         case DFU_CMD_DATA:
-            if (ivLen != 0 || dataCount != 0) {
+            if (ivLen != 0 || dataCount != 0 || tagLen != 0) {
                 printf("DATA command before previous complete\n");
                 return false;
             }
@@ -220,19 +604,60 @@ bool processCtrlPacket(uint8 *packet) {
                 return false;
             }
             dataCount = len;
+            dataLength = len;
             baseAddress = address;
+            tagBase = address & ~(FLASH_PAGE_SIZE - 1);
             setAddress(address);
             startTime = getTime();
             bytesRead = 0;
             printf("DATA command: %d bytes at %X\n", len, address);
             return true;
 
+        case DFU_CMD_ZDATA:
+        case DFU_CMD_PATCH:
+            // the data is decrypted and decoded as it arrives; addresses in the data packets are
+            // offsets into the encoded data, from the block address
+            if (ivLen != 0 || dataCount != 0) {
+                printf("ZDATA/PATCH command before previous complete\n");
+                return false;
+            }
+            if (address < (uint32) USER_BLAT) {
+                printf("Invalid address - %X should be less than %X", address, USER_BLAT);
+                return false;
+            }
+            // a patch is only as good as the firmware it copies from, which the digests before it check
+            if (cmd == DFU_CMD_PATCH && digestFailed) {
+                printf("PATCH command after failed digest\n");
+                return false;
+            }
+            dataCount = len * IV_LEN;
+            baseAddress = address;
+            dataAddress = address;
+            streamCmd = cmd;
+            tagCount = 0;               // encoded blocks don't have page tags
+            cipherLen = 0;
+            if (cmd == DFU_CMD_PATCH)
+                patch_init(&decoder.patch, readFlash, NULL);
+            else
+                lzss_init(&decoder.lzss);
+            startPage(address);
+            startTime = getTime();
+            bytesRead = 0;
+            printf("%s command: %d bytes at %X\n", cmd == DFU_CMD_PATCH ? "PATCH" : "ZDATA", dataCount, address);
+            return true;
+
         case DFU_CMD_IV:
             if (ivLen != 0 || dataCount != 0) {
                 printf("IV command before previous complete\n");
                 return false;
             }
+            if (len != IV_LEN || address > DFU_CIPHER_CTR) {
+                printf("Invalid IV command: %d bytes, mode %d\n", len, address);
+                return false;
+            }
             ivLen = len;
+            ctrMode = address == DFU_CIPHER_CTR;
+            tagCount = 0;               // any tags for the data come after the IV
             printf("IV command: %d bytes\n", ivLen);
             return true;
 
@@ -267,6 +692,62 @@ bool processCtrlPacket(uint8 *packet) {
             }
             return true;
 
+        case DFU_CMD_ERASE:
+            // an erase-only block. The pages read back as 0xFF, which the digest that follows checks
+            if (ivLen != 0 || dataCount != 0 || digestLen != 0) {
+                printf("ERASE command before previous complete\n");
+                return false;
+            }
+            if (len == 0 || !userPages(address, len)) {
+                printf("Invalid erase of %d pages at %X\n", len, address);
+                return false;
+            }
+            printf("ERASE command: %d pages at %X\n", len, address);
+            while (len-- != 0) {
+                FLASH_eraseOneBlock(address);
+                address += FLASH_PAGE_SIZE;
+            }
+            // the buffer may hold part of a page just erased, so don't write it out again
+            dropPages();
+            return true;
+
+        case DFU_CMD_TAG:
+            // tags for the pages of the DATA command that follows, checked before each page is written
+            if (ivLen != 0 || dataCount != 0 || digestLen != 0 || tagLen != 0) {
+                printf("TAG command before previous complete\n");
+                return false;
+            }
+            if (len == 0 || len > MAX_TAGS) {
+                printf("Invalid tag count %d\n", len);
+                return false;
+            }
+            tagCount = len;
+            tagLen = len * TAG_LEN;
+            return true;
+
+        case DFU_CMD_PAGEHASH:
+            // the loader skips pages that already hold what it would send, so it asks what they hold
+            if (ivLen != 0 || dataCount != 0 || digestLen != 0) {
+                printf("PAGEHASH command before previous complete\n");
+                return false;
+            }
+            if (len > MAX_PAGE_HASHES || !userPages(address, len)) {
+                printf("Invalid page hash request %d pages at %X\n", len, address);
+                return false;
+            }
+            pageHashBuf[0] = PAGE_HASH;
+            while (len-- != 0) {
+                putWord32(pageHashBuf + 1, address);
+                CRYPTO_SHA_256(CRYPTO, (const uint8_t *) address, FLASH_PAGE_SIZE, pageHashBuf + 5);
+                // if the stack runs out of buffers the rest are not sent, and the loader sends those pages
+                if (gecko_cmd_gatt_server_send_characteristic_notification(currentConnection, GATTDB_ota_progress,
+                                                                           sizeof(pageHashBuf),
+                                                                           pageHashBuf)->result != 0)
+                    break;
+                address += FLASH_PAGE_SIZE;
+            }
+            return true;
+
         case DFU_CMD_PING:
             // checking if we are up to the same point as the master thinks we should be
             printf("Pinged at %d/%d\n", len, dataAddress - baseAddress);
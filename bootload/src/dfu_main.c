@@ -9,6 +9,7 @@
 #include <bg_types.h>
 #include <aat_def.h>
 #include <em_crypto.h>
+#include <flash.h>
 #include "gecko_configuration.h"
 #include "native_gecko.h"
 
@@ -88,6 +89,13 @@ void dfu_main(void) {
         USER_BLAT->resetVector();
     }
     CRYPTO_AES_DecryptKey256(CRYPTO, deKey, ota_key);
+    initPageTags();
+    FLASH_initDma();
+#if defined(DEBUG)
+    // count cycles, to time page writes
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+#endif
     gecko_init(&config);
     printf("Stack initialised\n");
     gecko_cmd_gatt_set_max_mtu(MAX_MTU);
@@ -99,8 +107,15 @@ void dfu_main(void) {
         struct gecko_msg_le_connection_parameters_evt_t *pp;
         uint16 i;
 
-        /* Check for stack event. */
-        evt = gecko_wait_event();
+        /* Check for stack event. Pages received are written while there are none */
+        if (pagePending()) {
+            evt = gecko_peek_event();
+            if (evt == NULL) {
+                writePendingPage();
+                continue;
+            }
+        } else
+            evt = gecko_wait_event();
 
         /* Handle events */
         unsigned id = BGLIB_MSG_ID(evt->header) & ~gecko_dev_type_gecko;
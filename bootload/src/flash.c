@@ -64,52 +64,91 @@
 
 /**************************************************************************//**
  *
- * Program flash.
+ * Keeps a burst write going.
  *
- * @param block_start is a pointer to the base of the flash.
- * @param count is the number of bytes to be programmed. Must be a multiple of
- * four.
- * @param buffer is a pointer to a buffer holding the data.
+ * If the data for a word is loaded more than 30us after the last one was
+ * written, the MSC ends the burst and may ignore the trigger that follows,
+ * leaving the word waiting in WDATA. It is triggered again here, as
+ * MSC_LoadWriteData() does.
+ *****************************************************************************/
+ RAMFUNC void FLASH_checkWrite (void)
+{
+  if ((MSC->STATUS & (MSC_STATUS_WORDTIMEOUT | MSC_STATUS_BUSY | MSC_STATUS_WDATAREADY))
+      == MSC_STATUS_WORDTIMEOUT)
+    MSC->WRITECMD = MSC_WRITECMD_WRITETRIG;
+}
+
+/**************************************************************************//**
+ *
+ * Set up the LDMA channel used to write flash.
  *
- *  This function is used to write data to the NVM. This is a blocking
- *   function.
+ * The channel is fed by the MSC's WDATA request, and raises the LDMA
+ * interrupt when it has loaded the last word of a write. The LDMA clock is
+ * enabled by CMU_init().
  *****************************************************************************/
- RAMFUNC void FLASH_writeBlock (void *block_start,                                
-                                uint32_t count,
-                                uint8_t const *buffer)
-{      
-  /* Used as a temporary variable to create the blocks to write when padding to closest word. */
-  uint32_t tempWord;  
-  uint8_t *pAddress=(uint8_t*)block_start;
+void FLASH_initDma(void)
+{
+  LDMA->CH[FLASH_DMA_CH].REQSEL = LDMA_CH_REQSEL_SOURCESEL_MSC | LDMA_CH_REQSEL_SIGSEL_MSCWDATA;
+  LDMA->CH[FLASH_DMA_CH].CFG    = _LDMA_CH_CFG_RESETVALUE;
+  LDMA->CH[FLASH_DMA_CH].LOOP   = _LDMA_CH_LOOP_RESETVALUE;
+  LDMA->CH[FLASH_DMA_CH].LINK   = _LDMA_CH_LINK_RESETVALUE;
+  LDMA->IFC  = 1 << FLASH_DMA_CH;
+  LDMA->IEN |= 1 << FLASH_DMA_CH;
+  NVIC_ClearPendingIRQ(LDMA_IRQn);
+  NVIC_EnableIRQ(LDMA_IRQn);
+}
+
+/**************************************************************************//**
+ *
+ * Start programming flash by DMA.
+ *
+ * @param address is the address to program, which must be word aligned.
+ * @param data is a pointer to the words to program, which must stay unchanged
+ * until the write is finished.
+ * @param count is the number of words to program. They must all be in the same
+ * flash page.
+ *
+ * The address is loaded and the LDMA channel streams the words into WDATA as
+ * the MSC auto-increments through the page, so the CPU is free meanwhile.
+ * The LDMA interrupt is raised when the last word has been loaded;
+ * FLASH_finishWrite() must then be called before the MSC is used again.
+ *****************************************************************************/
+ RAMFUNC void FLASH_startWrite (uint32_t address, uint32_t const *data, uint32_t count)
+{
   /* Enable writing to the MSC */
   MSC->WRITECTRL |= MSC_WRITECTRL_WREN;
-  /* Loop over body. */
-  while (count >= sizeof(tempWord))
-  {
-    tempWord = *(uint32_t *)buffer;
-    FLASH_writeWord((uint32_t ) pAddress, tempWord);
-
-    pAddress   += sizeof(tempWord);
-    buffer     += sizeof(tempWord);
-    count      -= sizeof(tempWord);
-  }
-
-  /* Pad at the end */
-  if (count > 0)
-  {
-    /* Get final word. */
-    tempWord = *(uint32_t *)buffer;
+  while (MSC->STATUS & MSC_STATUS_BUSY);
+  MSC->ADDRB    = address;                 // Load address.
+  MSC->WRITECMD = MSC_WRITECMD_LADDRIM;
 
-    /* Fill rest of word with padding. */
-    tempWord |= 0xFFFFFFFF << (8 * count);
-    FLASH_writeWord((uint32_t ) pAddress, tempWord);
+  LDMA->CH[FLASH_DMA_CH].CTRL = LDMA_CH_CTRL_STRUCTTYPE_TRANSFER
+                                | ((count - 1) << _LDMA_CH_CTRL_XFERCNT_SHIFT)
+                                | LDMA_CH_CTRL_BLOCKSIZE_UNIT1
+                                | LDMA_CH_CTRL_DONEIFSEN
+                                | LDMA_CH_CTRL_REQMODE_BLOCK
+                                | LDMA_CH_CTRL_SRCINC_ONE
+                                | LDMA_CH_CTRL_SIZE_WORD
+                                | LDMA_CH_CTRL_DSTINC_NONE;
+  LDMA->CH[FLASH_DMA_CH].SRC  = (uint32_t)data;
+  LDMA->CH[FLASH_DMA_CH].DST  = (uint32_t)&MSC->WDATA;
+  LDMA->CHDONE &= ~(1 << FLASH_DMA_CH);
+  LDMA->CHEN   |= 1 << FLASH_DMA_CH;
+  MSC->WRITECMD = MSC_WRITECMD_WRITETRIG;  // Start the burst.
+}
 
-  }
-      /* Disable writing to the MSC */
+/**************************************************************************//**
+ *
+ * Finish a DMA write, once the LDMA has loaded the last word.
+ *
+ * This function will not return until the last word has been programmed.
+ *****************************************************************************/
+ RAMFUNC void FLASH_finishWrite (void)
+{
+  while (MSC->STATUS & MSC_STATUS_BUSY);   // Waiting for the write to complete.
+  /* Disable writing to the MSC */
   MSC->WRITECTRL &= ~MSC_WRITECTRL_WREN;
 }
 
-
 /**************************************************************************//**
  *
  * Erase a block of flash.
@@ -0,0 +1,93 @@
+//
+// LZSS decompression of firmware blocks, one input byte at a time so packets can be fed as they arrive.
+//
+
+#include <lzss.h>
+
+#define STATE_HEADER    0       // reading the length; low holds the bytes read so far
+#define STATE_FLAGS     1       // next byte is a flag byte
+#define STATE_ITEM      2       // next byte is a literal or the first byte of a match
+#define STATE_MATCH     3       // next byte is the second byte of a match
+
+void lzss_init(lzss_state *s) {
+    s->remaining = 0;
+    s->pos = 0;
+    s->matchLen = 0;
+    s->state = STATE_HEADER;
+    s->low = 0;
+}
+
+bool lzss_done(const lzss_state *s) {
+    return s->state != STATE_HEADER && s->remaining == 0;
+}
+
+// move on to the next item in the group
+static void nextItem(lzss_state *s) {
+    s->flags >>= 1;
+    s->state = --s->items == 0 ? STATE_FLAGS : STATE_ITEM;
+}
+
+// output a byte, remembering it in the window
+static void put(lzss_state *s, uint8_t c, uint8_t *out) {
+    s->window[s->pos] = c;
+    s->pos = (uint16_t) ((s->pos + 1) & (LZSS_WINDOW - 1));
+    *out = c;
+    s->remaining--;
+}
+
+uint32_t lzss_decode(lzss_state *s, const uint8_t *in, uint32_t inLen, uint32_t *used,
+                     uint8_t *out, uint32_t outLen) {
+    uint32_t n = 0, i = 0;
+
+    for (;;) {
+        if (s->matchLen != 0) {
+            if (s->remaining == 0) {
+                // a corrupt match running past the end
+                s->matchLen = 0;
+                break;
+            }
+            if (n == outLen)
+                break;
+            put(s, s->window[(s->pos - s->matchDist) & (LZSS_WINDOW - 1)], out + n++);
+            s->matchLen--;
+            continue;
+        }
+        if (lzss_done(s) || i == inLen)
+            break;
+        if (s->state == STATE_ITEM && (s->flags & 1) && n == outLen)
+            break;
+        uint8_t c = in[i];
+        switch (s->state) {
+            case STATE_HEADER:
+                s->remaining |= (uint32_t) c << (s->low * 8);
+                if (++s->low == LZSS_HEADER_LEN)
+                    s->state = STATE_FLAGS;
+                break;
+
+            case STATE_FLAGS:
+                s->flags = c;
+                s->items = 8;
+                s->state = STATE_ITEM;
+                break;
+
+            case STATE_ITEM:
+                if (s->flags & 1) {
+                    put(s, c, out + n++);
+                    nextItem(s);
+                } else {
+                    s->low = c;
+                    s->state = STATE_MATCH;
+                }
+                break;
+
+            default:
+                s->matchDist = (uint16_t) ((s->low | (c >> 6) << 8) + 1);
+                s->matchLen = (uint8_t) ((c & 0x3F) + LZSS_MIN_MATCH);
+                nextItem(s);
+                break;
+        }
+        i++;
+    }
+    *used = i;
+    return n;
+}
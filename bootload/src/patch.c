@@ -0,0 +1,95 @@
+//
+// Applying delta patches to firmware blocks, a byte at a time so packets can be fed as they arrive.
+//
+
+#include <patch.h>
+
+#define STATE_HEADER    0       // reading the length
+#define STATE_OP        1       // next byte is an operation
+#define STATE_LITERAL   2       // next byte is part of a literal
+#define STATE_ARGS      3       // next byte is part of the arguments of a copy
+#define STATE_COPY      4       // copying from flash, no input needed
+
+void patch_init(patch_state *s, patch_reader read, void *arg) {
+    s->read = read;
+    s->arg = arg;
+    s->remaining = 0;
+    s->count = 0;
+    s->state = STATE_HEADER;
+    s->argLen = 0;
+}
+
+bool patch_done(const patch_state *s) {
+    return s->state != STATE_HEADER && s->remaining == 0;
+}
+
+uint32_t patch_apply(patch_state *s, const uint8_t *in, uint32_t inLen, uint32_t *used,
+                     uint8_t *out, uint32_t outLen) {
+    uint32_t n = 0, i = 0;
+
+    for (;;) {
+        if (s->state == STATE_COPY) {
+            uint32_t len = s->count;
+
+            if (s->remaining == 0 || len == 0) {
+                // done, or a corrupt copy running past the end
+                s->count = 0;
+                s->state = STATE_OP;
+                continue;
+            }
+            if (len > outLen - n)
+                len = outLen - n;
+            if (len > s->remaining)
+                len = s->remaining;
+            if (len == 0)
+                break;
+            s->read(s->arg, s->src, out + n, len);
+            n += len;
+            s->src += len;
+            s->count -= len;
+            s->remaining -= len;
+            continue;
+        }
+        if (patch_done(s) || i == inLen)
+            break;
+        if (s->state == STATE_LITERAL && n == outLen)
+            break;
+        uint8_t c = in[i++];
+        switch (s->state) {
+            case STATE_HEADER:
+                s->remaining |= (uint32_t) c << (s->argLen * 8);
+                if (++s->argLen == PATCH_HEADER_LEN)
+                    s->state = STATE_OP;
+                break;
+
+            case STATE_OP:
+                if (c & PATCH_OP_COPY) {
+                    s->argLen = 0;
+                    s->state = STATE_ARGS;
+                } else {
+                    s->count = (uint32_t) c + 1;
+                    s->state = STATE_LITERAL;
+                }
+                break;
+
+            case STATE_LITERAL:
+                out[n++] = c;
+                s->remaining--;
+                if (--s->count == 0)
+                    s->state = STATE_OP;
+                break;
+
+            default:
+                s->args[s->argLen++] = c;
+                if (s->argLen == PATCH_COPY_LEN - 1) {
+                    s->src = s->args[0] | (uint32_t) s->args[1] << 8 | (uint32_t) s->args[2] << 16 |
+                             (uint32_t) s->args[3] << 24;
+                    s->count = (s->args[4] | (uint32_t) s->args[5] << 8) + 1;
+                    s->state = STATE_COPY;
+                }
+                break;
+        }
+    }
+    *used = i;
+    return n;
+}
@@ -6,7 +6,10 @@ import com.controlj.androidutil.ResourceUtil;
 import com.controlj.otadfu.device.BTHandler;
 
 import java.io.IOException;
+import java.util.Arrays;
+import java.util.HashMap;
 import java.util.List;
+import java.util.Map;
 import java.util.UUID;
 import java.util.concurrent.Semaphore;
 import java.util.concurrent.TimeUnit;
@@ -37,16 +40,26 @@ public class DFULoader extends Thread implements BTHandler.Listener, BTHandler.D
 	static final int DFU_CMD_RESET = 0x5;     // reset device
 	static final int DFU_CMD_DIGEST = 0x6;     // SHA256 digest coming
 	static final int DFU_CMD_PING = 0x7;     // check progress
+	static final int DFU_CMD_ERASE = 0x8;     // erase pages without sending data
+	static final int DFU_CMD_ZDATA = 0x9;     // compressed data coming on the data channel
+	static final int DFU_CMD_PATCH = 0xA;     // patch data coming on the data channel
+	static final int DFU_CMD_PAGEHASH = 0xB;     // send the digests of pages
+	static final int DFU_CMD_TAG = 0xC;     // page tags for the next data coming on the data channel
 
 	static final int DFU_CTRL_PKT_CMD = 0;       // offset of command word
 	static final int DFU_CTRL_PKT_LEN = 2;       // offset of length word
 	static final int DFU_CTRL_PKT_ADR = 4;       // offset of address doubleword
 	static final int DFU_CTRL_PKT_SIZE = 8;       // total length of packet
 
+	static final int DFU_CIPHER_CBC = 0;		// cipher modes, given with the IV
+	static final int DFU_CIPHER_CTR = 1;
+
 	static final int DFU_RESYNC = 1;            // resync to this address
 	static final int DFU_DIGEST_FAILED = 2;		// verification failed
+	static final int DFU_PAGE_HASH = 3;			// the digest of a page
 
 	static final int MAX_RESYNCS = 20;            // max number of times we try to resync
+	static final int MAX_PAGE_HASHES = 8;         // max pages asked for in one PAGEHASH command
 
 	static final int CHUNK_SIZE = 0x800;        // send in chunks this big - same as FLASH_PAGE_SIZE
 
@@ -69,6 +82,7 @@ public class DFULoader extends Thread implements BTHandler.Listener, BTHandler.D
 	private FirmwareLoader loader;
 	private FirmwareLoader.Information info;
 	private int resyncVal;
+	private final Map<Integer, byte[]> deviceDigests = new HashMap<>();	// page digests sent by the device
 	private int mtu;
 
 	public DFULoader(String deviceAddress, FirmwareLoader loader, BTService service, BTHandler btHandler) throws IOException {
@@ -116,6 +130,62 @@ public class DFULoader extends Thread implements BTHandler.Listener, BTHandler.D
 		sendCommand(cmd, 0, 0);
 	}
 
+	/**
+	 * Find which pages of a block the device already has, by asking for the digests of those in the
+	 * page manifest. Encoded blocks are sent whole, as a single page.
+	 * @return	for each page the block touches, true if it need not be sent
+	 */
+	private boolean[] pagesPresent(FirmwareLoader.DataHeader header) throws InterruptedException {
+		if(header.isEncoded() || !loader.hasPageDigests())
+			return new boolean[1];
+		int first = header.getAddr() & ~(CHUNK_SIZE - 1);
+		boolean[] present = new boolean[(header.getAddr() + header.getLength() - first + CHUNK_SIZE - 1) / CHUNK_SIZE];
+		boolean asked = false;
+		synchronized(deviceDigests) {
+			deviceDigests.clear();
+		}
+		for(int i = 0; i != present.length; ) {
+			if(loader.getPageDigest(first + i * CHUNK_SIZE) == null) {
+				i++;
+				continue;
+			}
+			int n = 1;
+			while(i + n != present.length && n != MAX_PAGE_HASHES && loader.getPageDigest(first + (i + n) * CHUNK_SIZE) != null)
+				n++;
+			sendCommand(DFU_CMD_PAGEHASH, n, first + i * CHUNK_SIZE);
+			asked = true;
+			i += n;
+		}
+		if(!asked)
+			return present;
+		// the digests are notified before the device answers the next command. Any that are missing
+		// just mean those pages are sent.
+		sendCommand(DFU_CMD_PING);
+		acquire(MAXQUEUE);
+		semaphore.release(MAXQUEUE);
+		synchronized(deviceDigests) {
+			for(int i = 0; i != present.length; i++) {
+				byte[] digest = loader.getPageDigest(first + i * CHUNK_SIZE);
+				present[i] = digest != null && Arrays.equals(digest, deviceDigests.get(first + i * CHUNK_SIZE));
+			}
+		}
+		return present;
+	}
+
+	// where the data for a page of a block starts in the block
+	private int pageStart(FirmwareLoader.DataHeader header, int page) {
+		if(page == 0)
+			return 0;
+		return (header.getAddr() & ~(CHUNK_SIZE - 1)) + page * CHUNK_SIZE - header.getAddr();
+	}
+
+	// where the data for a page of a block ends in the block. The last page has the padding.
+	private int pageEnd(FirmwareLoader.DataHeader header, int pages, int page) {
+		if(page == pages - 1)
+			return header.getFileLength();
+		return pageStart(header, page + 1);
+	}
+
 	@Override
 	public void run() {
 		state = CONNECTING;
@@ -137,52 +207,111 @@ public class DFULoader extends Thread implements BTHandler.Listener, BTHandler.D
 			}
 			for(int i = 0; i != info.getNumBlocks(); i++) {
 				FirmwareLoader.DataHeader header = loader.getHeader(i);
+				if(header.isEraseOnly()) {
+					// nothing to send - erase the pages, then check them with the digest
+					ResourceUtil.logMsg("Erasing %d bytes at %X", header.getLength(), header.getAddr());
+					sendCommand(DFU_CMD_ERASE, header.getLength() / CHUNK_SIZE, header.getAddr());
+					sendCommand(DFU_CMD_DIGEST, header.getLength(), header.getAddr());
+					acquire(1);
+					btHandler.writeRequest(deviceAddress, DFU_DATA_UUID, header.getDigest(), BluetoothGattCharacteristic.WRITE_TYPE_NO_RESPONSE);
+					continue;
+				}
+				if(header.isBaseCheck()) {
+					// nothing to send - check the firmware that the patches copy from is what they expect
+					ResourceUtil.logMsg("Checking %d bytes at %X", header.getLength(), header.getAddr());
+					sendCommand(DFU_CMD_DIGEST, header.getLength(), header.getAddr());
+					acquire(1);
+					btHandler.writeRequest(deviceAddress, DFU_DATA_UUID, header.getDigest(), BluetoothGattCharacteristic.WRITE_TYPE_NO_RESPONSE);
+					continue;
+				}
 				header.start();
 				ResourceUtil.logMsg("Writing %d bytes at %X", header.getLength(), header.getAddr());
-				int length = header.getLength() + header.getExtra();
-				byte[] iv = header.getInitVector();
-				sendCommand(DFU_CMD_IV, iv.length, 0);
-				acquire(1);
-				btHandler.writeRequest(deviceAddress, DFU_DATA_UUID, iv, BluetoothGattCharacteristic.WRITE_TYPE_NO_RESPONSE);
-				int addr = header.getAddr();
-				sendCommand(DFU_CMD_DATA, length, addr);
-				int count = 0;
-				resyncVal = addr + length;
-				int chunks = addr / CHUNK_SIZE;
-				while(count != length) {
-					int balance = Math.min(length - count, MAX_BUFLEN);
-					byte[] buffer = new byte[balance + 4];
-					put4(buffer, addr, 0);
-					header.seek(count);
-					header.read(buffer, 4);
-					acquire(1);
-					btHandler.writeRequest(deviceAddress, DFU_DATA_UUID, buffer, BluetoothGattCharacteristic.WRITE_TYPE_NO_RESPONSE);
-					count += balance;
-					addr += balance;
-					totalCount += balance;
-					// wait for device to catch up after each chunk.
-					if(count == length || addr / CHUNK_SIZE != chunks) {
-						chunks = addr / CHUNK_SIZE;
-						sendCommand(DFU_CMD_PING, count, 0);
+				int length = header.getFileLength();
+				boolean[] present = pagesPresent(header);
+				int page = 0;
+				while(page != present.length) {
+					// send each run of pages that the device doesn't already have
+					if(present[page]) {
+						totalCount += pageEnd(header, present.length, page) - pageStart(header, page);
+						page++;
+						continue;
 					}
-					if(totalCount * 100 / totalBytes != progress) {
-						progress = totalCount * 100 / totalBytes;
-						service.sendResult(BTService.UPLOAD_PROGRESS, progress);
+					int start = pageStart(header, page);
+					while(page != present.length && !present[page])
+						page++;
+					int end = pageEnd(header, present.length, page - 1);
+					byte[] iv = header.getInitVector(start);
+					sendCommand(DFU_CMD_IV, iv.length, info.isCtr() ? DFU_CIPHER_CTR : DFU_CIPHER_CBC);
+					acquire(1);
+					btHandler.writeRequest(deviceAddress, DFU_DATA_UUID, iv, BluetoothGattCharacteristic.WRITE_TYPE_NO_RESPONSE);
+					int addr = header.getAddr() + start;
+					if(header.isTagged()) {
+						// the tags for the pages of the run, which the device checks each page against
+						int base = header.getAddr() & ~(CHUNK_SIZE - 1);
+						int first = ((addr & ~(CHUNK_SIZE - 1)) - base) / CHUNK_SIZE;
+						int last = (((header.getAddr() + end - 1) & ~(CHUNK_SIZE - 1)) - base) / CHUNK_SIZE;
+						byte[] tags = header.getTags(first, last - first + 1);
+						sendCommand(DFU_CMD_TAG, last - first + 1, 0);
+						for(int offs = 0; offs != tags.length; ) {
+							int n = Math.min(tags.length - offs, MAX_BUFLEN);
+							acquire(1);
+							btHandler.writeRequest(deviceAddress, DFU_DATA_UUID, Arrays.copyOfRange(tags, offs, offs + n),
+									BluetoothGattCharacteristic.WRITE_TYPE_NO_RESPONSE);
+							offs += n;
+						}
 					}
-					synchronized(this) {
-						if(resyncVal < addr) {
-							if(++resyncs > MAX_RESYNCS)
-								interrupt();
-							resyncVal &= ~(MAX_BUFLEN - 1);
-							totalCount -= addr - resyncVal;
-							addr = resyncVal;
-							resyncVal = header.getAddr()+length;
-							count = addr - header.getAddr();
+					// encoded data is sent to the block address like any other; the device decodes it
+					if(header.isPatch())
+						sendCommand(DFU_CMD_PATCH, length / FirmwareLoader.CIPHER_BLOCK, addr);
+					else if(header.isCompressed())
+						sendCommand(DFU_CMD_ZDATA, length / FirmwareLoader.CIPHER_BLOCK, addr);
+					else
+						sendCommand(DFU_CMD_DATA, end - start, addr);
+					int count = start;
+					resyncVal = header.getAddr() + end;
+					int chunks = addr / CHUNK_SIZE;
+					while(count != end) {
+						int balance = Math.min(end - count, MAX_BUFLEN);
+						byte[] buffer = new byte[balance + 4];
+						put4(buffer, addr, 0);
+						header.seek(count);
+						header.read(buffer, 4);
+						acquire(1);
+						btHandler.writeRequest(deviceAddress, DFU_DATA_UUID, buffer, BluetoothGattCharacteristic.WRITE_TYPE_NO_RESPONSE);
+						count += balance;
+						addr += balance;
+						totalCount += balance;
+						// wait for device to catch up after each chunk.
+						if(count == end || addr / CHUNK_SIZE != chunks) {
+							chunks = addr / CHUNK_SIZE;
+							sendCommand(DFU_CMD_PING, count, 0);
+						}
+						// a page that fails its tag is asked for again once it is all there, so wait to
+						// hear about the last one
+						if(count == end && header.isTagged()) {
+							acquire(MAXQUEUE);
+							semaphore.release(MAXQUEUE);
+						}
+						if(totalCount * 100 / totalBytes != progress) {
+							progress = totalCount * 100 / totalBytes;
+							service.sendResult(BTService.UPLOAD_PROGRESS, progress);
+						}
+						synchronized(this) {
+							if(resyncVal < addr) {
+								if(++resyncs > MAX_RESYNCS)
+									interrupt();
+								resyncVal = Math.max(resyncVal & ~(MAX_BUFLEN - 1), header.getAddr() + start);
+								totalCount -= addr - resyncVal;
+								addr = resyncVal;
+								resyncVal = header.getAddr() + end;
+								count = addr - header.getAddr();
+							}
 						}
 					}
 				}
 				byte[] digest = header.getDigest();
-				sendCommand(DFU_CMD_DIGEST, header.getLength() + header.getExtra(), header.getAddr());
+				// the digest covers what was written to flash, which for encoded data excludes the padding
+				sendCommand(DFU_CMD_DIGEST, header.isEncoded() ? header.getLength() : length, header.getAddr());
 				acquire(1);
 				btHandler.writeRequest(deviceAddress, DFU_DATA_UUID, digest, BluetoothGattCharacteristic.WRITE_TYPE_NO_RESPONSE);
 				ResourceUtil.logMsg("Done...");
@@ -243,6 +372,14 @@ public class DFULoader extends Thread implements BTHandler.Listener, BTHandler.D
 						ResourceUtil.logMsg("Resync to %x", get4(val, 1));
 						break;
 
+					case DFU_PAGE_HASH:
+						if(val.length >= 5 + FirmwareLoader.DIGEST_LEN) {
+							synchronized(deviceDigests) {
+								deviceDigests.put(get4(val, 1), Arrays.copyOfRange(val, 5, 5 + FirmwareLoader.DIGEST_LEN));
+							}
+						}
+						break;
+
 					case DFU_DIGEST_FAILED:
 						ResourceUtil.logMsg("Digest failed");
 						service.sendResult(BTService.OOPS, BTService.UPLOAD_FILE, "verification failed");
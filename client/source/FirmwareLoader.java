@@ -3,14 +3,18 @@ package com.controlj.otadfu.backend;
 import android.os.Parcel;
 import android.os.Parcelable;
 
+import java.io.BufferedReader;
 import java.io.File;
 import java.io.FileInputStream;
+import java.io.FileReader;
 import java.io.IOException;
 import java.io.RandomAccessFile;
 import java.nio.ByteBuffer;
 import java.nio.ByteOrder;
 import java.util.ArrayList;
+import java.util.HashMap;
 import java.util.Locale;
+import java.util.Map;
 import java.util.UUID;
 
 /**
@@ -31,7 +35,8 @@ typedef struct {
     unsigned char major[2];        // major version number
     unsigned char minor[2];        // minor version number
     unsigned char numblocks[2];        // the number of blocks in the file,
-    unsigned char unused[6];
+    unsigned char format[1];        // 0 for AES-256-CBC, 1 for AES-256-CTR with the IV as the first counter
+    unsigned char unused[5];
     unsigned char service_uuid[UUID_LEN];    // the service uuid of the bootloader
 } firmware;
 
@@ -42,12 +47,21 @@ typedef struct {
     unsigned char size[4];        // the size of this block
     unsigned char offset[4];        // offset in the file of the data
     unsigned char padding[1];   // length of padding at end
-    unsigned char unused[3];
+    unsigned char flags[1];     // 1 for an erase-only block, with no data in the file; 2 for compressed data;
+                                // 4 for a patch; 8 for a check of the current firmware, with no data in the file;
+                                // 0x10 if the data is followed by a tag for each page it is written to
+    unsigned char units[2];     // compressed and patch blocks: length in the file, in 16 byte cipher blocks
     unsigned char init_vector[IV_LEN];    // the block 0 initialization vector
 	unsigned char sha256[32];       // SHA256 hash of the data
 } block_header;
 
 
+The firmware file may have a page manifest alongside it, named <file>.pages. Each line that isn't
+a comment is the address of a flash page and the SHA256 digest of what it holds after the update,
+in hex. A page that the device says already has that digest need not be sent.
+
+A tagged block has an 8 byte tag for each flash page it touches, in order, after its data in the file.
+They are sent ahead of the data, and the device checks each page against its tag before writing it.
  */
 public class FirmwareLoader {
 	static final int UUID_LEN = 16;        // length of uuid
@@ -56,6 +70,9 @@ public class FirmwareLoader {
 	static final int MAJOR_OFFS = 4;
 	static final int MINOR_OFFS = 6;
 	static final int NUMBLK_OFFS = 8;
+	static final int FORMAT_OFFS = 10;
+	static final int FORMAT_CBC = 0;		// blocks are encrypted with AES-256-CBC
+	static final int FORMAT_CTR = 1;		// blocks are encrypted with AES-256-CTR
 	static final int UUID_OFFS = 16;
 	static final int HEADER_LEN = (16 + UUID_LEN);
 
@@ -65,6 +82,15 @@ public class FirmwareLoader {
 	static final int LENGTH_OFFS = 4;
 	static final int OFFSET_OFFS = 8;
 	static final int EXTRA_OFFS = 12;
+	static final int FLAGS_OFFS = 13;
+	static final int BLOCK_FLAG_ERASE = 0x1;	// erase the pages, there is no data
+	static final int BLOCK_FLAG_COMPRESSED = 0x2;	// the data is compressed, length is the decompressed length
+	static final int BLOCK_FLAG_PATCH = 0x4;	// the data is a patch against the current firmware
+	static final int BLOCK_FLAG_BASE = 0x8;		// check the current firmware before patching, there is no data
+	static final int BLOCK_FLAG_TAGGED = 0x10;	// the data is followed by a tag for each page
+	static final int TAG_LEN = 8;				// length of a page tag
+	static final int UNITS_OFFS = 14;
+	static final int CIPHER_BLOCK = 16;
 	static final int IV_OFFS = 16;
 	static final int DIGEST_OFFS = IV_OFFS + IV_LEN;
 	static final int BLKHDR_LEN = (DIGEST_OFFS + DIGEST_LEN);
@@ -73,12 +99,15 @@ public class FirmwareLoader {
 	private RandomAccessFile randomAccessFile;
 	private Information info;
 	private ArrayList<DataHeader> headers = new ArrayList<>();
+	private Map<Integer, byte[]> pageDigests = new HashMap<>();
 
 	class DataHeader {
 		private int offset;        // file offset
 		private int addr;        // address in memory
 		private int length;        // number of bytes
 		private int extra;        // extra bytes at end
+		private int flags;
+		private int units;        // length in the file of compressed or patch data, in cipher blocks
 		private byte[] initVector = new byte[IV_LEN];
 		private byte[] digest = new byte[DIGEST_LEN];
 
@@ -94,6 +123,38 @@ public class FirmwareLoader {
 			return extra;
 		}
 
+		public boolean isEraseOnly() {
+			return (flags & BLOCK_FLAG_ERASE) != 0;
+		}
+
+		public boolean isCompressed() {
+			return (flags & BLOCK_FLAG_COMPRESSED) != 0;
+		}
+
+		public boolean isPatch() {
+			return (flags & BLOCK_FLAG_PATCH) != 0;
+		}
+
+		public boolean isBaseCheck() {
+			return (flags & BLOCK_FLAG_BASE) != 0;
+		}
+
+		public boolean isTagged() {
+			return (flags & BLOCK_FLAG_TAGGED) != 0;
+		}
+
+		// the data is sent encoded, and decoded by the device
+		public boolean isEncoded() {
+			return isCompressed() || isPatch();
+		}
+
+		// the number of bytes of data in the file
+		public int getFileLength() {
+			if(isEncoded())
+				return units * CIPHER_BLOCK;
+			return length + extra;
+		}
+
 		public void start() throws IOException {
 			if(randomAccessFile == null)
 				randomAccessFile = new RandomAccessFile(info.filename, "r");
@@ -107,8 +168,8 @@ public class FirmwareLoader {
 		public int read(byte[] buf, int bufferOffs) throws IOException {
 			int len = buf.length-bufferOffs;
 			long pos = randomAccessFile.getFilePointer();
-			if(pos + len > offset + length + extra)
-				len = (int)(offset + length + extra - pos);
+			if(pos + len > offset + getFileLength())
+				len = (int)(offset + getFileLength() - pos);
 			if(len == 0)
 				return 0;
 			return randomAccessFile.read(buf, bufferOffs, len);
@@ -118,9 +179,34 @@ public class FirmwareLoader {
 			return initVector;
 		}
 
+		// the IV for decrypting from a position in the data: the counter there in CTR mode, otherwise the
+		// ciphertext before it
+		public byte[] getInitVector(int position) throws IOException {
+			if(position == 0)
+				return initVector;
+			byte[] iv = new byte[IV_LEN];
+			if(info.isCtr()) {
+				// the device only carries into the low 32 bits, which start at zero
+				System.arraycopy(initVector, 0, iv, 0, IV_LEN);
+				ByteBuffer.wrap(iv).putInt(IV_LEN - 4, ByteBuffer.wrap(initVector).getInt(IV_LEN - 4) + position / CIPHER_BLOCK);
+				return iv;
+			}
+			seek(position - IV_LEN);
+			randomAccessFile.readFully(iv);
+			return iv;
+		}
+
 		public byte[] getDigest() {
 			return digest;
 		}
+
+		// the tags for count pages, starting from the first page of the block at index first
+		public byte[] getTags(int first, int count) throws IOException {
+			byte[] tags = new byte[count * TAG_LEN];
+			seek(getFileLength() + first * TAG_LEN);
+			randomAccessFile.readFully(tags);
+			return tags;
+		}
 	}
 
 	public static class Information implements Parcelable {
@@ -128,6 +214,7 @@ public class FirmwareLoader {
 		private UUID serviceUuid;
 		private int totalBytes;
 		private int versionMajor, versionMinor, numBlocks, baseAddr;
+		private int format;
 
 		private Information() {
 
@@ -140,6 +227,7 @@ public class FirmwareLoader {
 			versionMinor = in.readInt();
 			numBlocks = in.readInt();
 			baseAddr = in.readInt();
+			format = in.readInt();
 		}
 
 		@Override
@@ -150,6 +238,7 @@ public class FirmwareLoader {
 			dest.writeInt(versionMinor);
 			dest.writeInt(numBlocks);
 			dest.writeInt(baseAddr);
+			dest.writeInt(format);
 		}
 
 		@Override
@@ -193,6 +282,11 @@ public class FirmwareLoader {
 			return baseAddr;
 		}
 
+		// blocks are encrypted with AES-CTR rather than CBC
+		public boolean isCtr() {
+			return format == FORMAT_CTR;
+		}
+
 		Information(String filename, byte[] initVector, UUID serviceUuid, int versionMajor, int versionMinor, int numBlocks, int baseAddr) {
 			this.filename = filename;
 			this.serviceUuid = serviceUuid;
@@ -233,6 +327,9 @@ public class FirmwareLoader {
 		info.versionMajor = bb.getChar(MAJOR_OFFS);
 		info.versionMinor = bb.getChar(MINOR_OFFS);
 		info.numBlocks = bb.getChar(NUMBLK_OFFS);
+		info.format = bb.get(FORMAT_OFFS);
+		if(info.format != FORMAT_CBC && info.format != FORMAT_CTR)
+			throw new IOException(String.format(Locale.US, "Unknown file format %d", info.format));
 		if(info.numBlocks == 0)
 			throw new IOException("Block count is zero");
 		// the uuid is in big-endian format
@@ -244,6 +341,41 @@ public class FirmwareLoader {
 		for(int i = 0; i != info.numBlocks; i++)
 			readHeader();
 		inputStream.close();
+		File pages = new File(filename + ".pages");
+		if(pages.exists())
+			readPages(pages);
+	}
+
+	private void readPages(File file) throws IOException {
+		BufferedReader reader = new BufferedReader(new FileReader(file));
+		try {
+			String line;
+			while((line = reader.readLine()) != null) {
+				line = line.trim();
+				if(line.isEmpty() || line.startsWith("#"))
+					continue;
+				String[] fields = line.split("\\s+");
+				if(fields.length != 2 || fields[1].length() != DIGEST_LEN * 2)
+					throw new IOException("Invalid line in page manifest: " + line);
+				byte[] digest = new byte[DIGEST_LEN];
+				for(int i = 0; i != DIGEST_LEN; i++)
+					digest[i] = (byte)Integer.parseInt(fields[1].substring(i * 2, i * 2 + 2), 16);
+				pageDigests.put((int)Long.parseLong(fields[0], 16), digest);
+			}
+		} catch(NumberFormatException e) {
+			throw new IOException("Invalid number in page manifest: " + e.getMessage());
+		} finally {
+			reader.close();
+		}
+	}
+
+	// the digest of a page after the update, or null if it must be sent regardless
+	public byte[] getPageDigest(int addr) {
+		return pageDigests.get(addr);
+	}
+
+	public boolean hasPageDigests() {
+		return !pageDigests.isEmpty();
 	}
 
 	private void readHeader() throws IOException {
@@ -257,11 +389,14 @@ public class FirmwareLoader {
 		hdr.addr = bb.getInt(ADDR_OFFS);
 		hdr.offset = bb.getInt(OFFSET_OFFS);
 		hdr.extra = bb.get(EXTRA_OFFS);
+		hdr.flags = bb.get(FLAGS_OFFS);
+		hdr.units = bb.getChar(UNITS_OFFS);
 		bb.position(IV_OFFS);
 		bb.get(hdr.initVector);
 		bb.position(DIGEST_OFFS);
 		bb.get(hdr.digest);
-		info.totalBytes += hdr.length + hdr.extra;
+		if(!hdr.isEraseOnly() && !hdr.isBaseCheck())
+			info.totalBytes += hdr.getFileLength();
 		headers.add(hdr);
 		if(hdr.addr < info.baseAddr)
 			info.baseAddr = hdr.addr;
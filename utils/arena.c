@@ -0,0 +1,165 @@
+//
+// Arena allocator - storage for one packaging run, released all at once.
+//
+// Chunks are mapped directly, and prefaulted where the system supports it, so a chunk sized for
+// the whole input is populated in one go rather than a page fault at a time. Memory reused after a
+// reset is zeroed as it is handed out again, so a reset costs nothing for memory that isn't reused.
+//
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "arena.h"
+
+#define ARENA_ALIGN         16
+#define MIN_CHUNK_SIZE      (64 * 1024)
+
+#define ALIGN_UP(n)         (((n) + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1))
+#define CHUNK_HEADER        ALIGN_UP(sizeof(chunk))
+
+typedef struct chunk {
+    struct chunk *next;
+    size_t size;                // bytes mapped, including this header
+    size_t used;                // bytes handed out, including this header
+    size_t high;                // bytes ever handed out; anything above this is still zero
+    unsigned char *last;        // the most recent allocation
+} chunk;
+
+struct arena {
+    chunk *chunks;              // the current chunk first
+    size_t used;                // bytes handed out from earlier chunks
+    unsigned numChunks;         // chunks obtained since the arena was created
+};
+
+/**
+ * Start a new chunk with room for at least size bytes, and make it current.
+ * @return  The chunk, or NULL if it can't be mapped
+ */
+static chunk *
+newChunk(arena_t arena, size_t size) {
+    chunk *c;
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+
+    size += CHUNK_HEADER;
+    if (size < MIN_CHUNK_SIZE)
+        size = MIN_CHUNK_SIZE;
+#if defined(MAP_POPULATE)
+    flags |= MAP_POPULATE;
+#endif
+    c = mmap(NULL, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+    if (c == MAP_FAILED)
+        return NULL;
+    c->size = size;
+    c->used = c->high = CHUNK_HEADER;
+    c->last = NULL;
+    c->next = arena->chunks;
+    if (arena->chunks != NULL)
+        arena->used += arena->chunks->used - CHUNK_HEADER;
+    arena->chunks = c;
+    arena->numChunks++;
+    return c;
+}
+
+/**
+ * Mark the chunk as used up to a new point, zeroing anything that was used before a reset.
+ */
+static void
+use(chunk *c, size_t used) {
+    if (used > c->used && c->used < c->high)
+        memset((unsigned char *) c + c->used, 0, (used < c->high ? used : c->high) - c->used);
+    c->used = used;
+    if (used > c->high)
+        c->high = used;
+}
+
+arena_t
+arena_new(void) {
+    return calloc(1, sizeof(struct arena));
+}
+
+void
+arena_destroy(arena_t arena) {
+    chunk *c, *next;
+
+    if (arena == NULL)
+        return;
+    for (c = arena->chunks; c != NULL; c = next) {
+        next = c->next;
+        munmap(c, c->size);
+    }
+    free(arena);
+}
+
+void
+arena_reset(arena_t arena) {
+    chunk *c, *next, *keep = arena->chunks;
+
+    for (c = arena->chunks; c != NULL; c = c->next)
+        if (c->size > keep->size)
+            keep = c;
+    for (c = arena->chunks; c != NULL; c = next) {
+        next = c->next;
+        if (c != keep)
+            munmap(c, c->size);
+    }
+    arena->chunks = keep;
+    arena->used = 0;
+    if (keep != NULL) {
+        keep->used = CHUNK_HEADER;
+        keep->last = NULL;
+        keep->next = NULL;
+    }
+}
+
+int
+arena_reserve(arena_t arena, size_t size) {
+    chunk *c = arena->chunks;
+
+    // leave headroom for the small allocations that go with the data, so the chunk still
+    // satisfies the same reservation after a reset
+    if ((c == NULL || c->size - c->used < size) && newChunk(arena, size + size / 4) == NULL)
+        return -1;
+    return 0;
+}
+
+void *
+arena_alloc(arena_t arena, size_t size) {
+    chunk *c = arena->chunks;
+    unsigned char *p;
+
+    size = ALIGN_UP(size);
+    if ((c == NULL || c->size - c->used < size) && (c = newChunk(arena, size)) == NULL)
+        return NULL;
+    p = (unsigned char *) c + c->used;
+    use(c, c->used + size);
+    c->last = p;
+    return p;
+}
+
+int
+arena_extend(arena_t arena, void *p, size_t newsize) {
+    chunk *c = arena->chunks;
+    size_t start;
+
+    if (c == NULL || p == NULL || c->last != p)
+        return 0;
+    start = (size_t) ((unsigned char *) p - (unsigned char *) c);
+    newsize = ALIGN_UP(newsize);
+    if (start + newsize > c->size)
+        return 0;
+    if (start + newsize > c->used)
+        use(c, start + newsize);
+    return 1;
+}
+
+size_t
+arena_used(arena_t arena) {
+    chunk *c = arena->chunks;
+
+    return arena->used + (c == NULL ? 0 : c->used - CHUNK_HEADER);
+}
+
+unsigned
+arena_chunks(arena_t arena) {
+    return arena->numChunks;
+}
@@ -0,0 +1,50 @@
+//
+// Arena allocator - storage for one packaging run, released all at once.
+//
+
+#ifndef UTILS_ARENA_H
+#define UTILS_ARENA_H
+
+#include <stddef.h>
+
+/*
+ * Memory is handed out from large chunks by bumping a pointer. Nothing is freed individually;
+ * arena_reset() makes all of it available again, and arena_destroy() returns it to the system.
+ */
+typedef struct arena *arena_t;
+
+/*
+ * Constructor and destructor. No memory is taken until the first allocation.
+ */
+extern arena_t arena_new(void);
+extern void arena_destroy(arena_t);
+
+/*
+ * Discard everything allocated. The largest chunk is kept for reuse.
+ */
+extern void arena_reset(arena_t);
+
+/*
+ * Make sure the current chunk has room for at least size more bytes, so that a known amount of
+ * data can be loaded into one contiguous chunk. Returns 0, or -1 if the memory can't be had.
+ */
+extern int arena_reserve(arena_t, size_t size);
+
+/*
+ * Allocate zeroed memory, aligned for any type. Returns NULL if the memory can't be had.
+ */
+extern void *arena_alloc(arena_t, size_t size);
+
+/*
+ * Grow the most recent allocation in place. Returns 0 if p is not the most recent allocation
+ * or there is no room after it, in which case nothing changes.
+ */
+extern int arena_extend(arena_t, void *p, size_t newsize);
+
+/*
+ * Bytes handed out since the arena was created or reset, and chunks obtained from the system.
+ */
+extern size_t arena_used(arena_t);
+extern unsigned arena_chunks(arena_t);
+
+#endif //UTILS_ARENA_H
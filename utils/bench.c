@@ -0,0 +1,304 @@
+//
+// bgfbench - time each stage of the firmware packaging pipeline on synthetic images.
+//
+// Every case in a matrix of sizes, layouts, formats and record lengths is generated once from a fixed
+// seed and run a number of times. Each run times parsing, assembly, hashing, encryption and writing
+// separately; the results are printed as JSON with the min, median, mean, max and standard deviation
+// of each stage.
+//
+// Encryption is timed into a sink that discards the data, and writing into a temporary file,
+// so the write time includes encryption and the I/O cost is the difference.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include "bgfirmware.h"
+#include "hexdecode.h"
+#include "synth.h"
+
+#define STAGE_PARSE     0
+#define STAGE_ASSEMBLE  1
+#define STAGE_HASH      2
+#define STAGE_ENCRYPT   3
+#define STAGE_WRITE     4
+#define NUM_STAGES      5
+
+static const char *stageNames[NUM_STAGES] = {"parse", "assemble", "hash", "encrypt", "write"};
+
+static const unsigned long sizes[] = {4096, 65536, 262144, 1048576};
+static const unsigned recordLengths[] = {16, 32, 0};
+
+#define COUNT(a)    (sizeof(a) / sizeof((a)[0]))
+
+unsigned repeats = 10;
+unsigned numThreads;
+unsigned long seed = 1;
+unsigned long onlySize;         // restrict the matrix to one size
+int onlyLayout = -1;            // 0 dense, 1 sparse
+int onlyFormat = -1;            // 0 hex, 1 elf
+int onlyRecord = -1;            // record length, 0 for random
+char *genFile;                  // write the generated input here instead of benchmarking
+int tmpFd = -1;                  // the output is written here; the file is unlinked as soon as it is made
+
+static double
+now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int
+discard(void *arg, const void *data, size_t len, unsigned long offset) {
+    (void) arg;
+    (void) data;
+    (void) len;
+    (void) offset;
+    return 0;
+}
+
+static int
+compareDouble(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+static void
+check(bgf_context *ctx, int result) {
+    if (result != 0) {
+        fprintf(stderr, "%s\n", bgf_error(ctx));
+        exit(1);
+    }
+}
+
+/**
+ * Print the statistics for one stage.
+ */
+static void
+printStats(const char *name, double *times, unsigned n, const char *sep) {
+    double sum = 0, var = 0, mean, median;
+    unsigned i;
+
+    qsort(times, n, sizeof *times, compareDouble);
+    for (i = 0; i != n; i++)
+        sum += times[i];
+    mean = sum / n;
+    for (i = 0; i != n; i++)
+        var += (times[i] - mean) * (times[i] - mean);
+    median = n % 2 ? times[n / 2] : (times[n / 2 - 1] + times[n / 2]) / 2;
+    printf("        \"%s\": {\"min_us\": %.1f, \"median_us\": %.1f, \"mean_us\": %.1f, \"max_us\": %.1f, "
+                   "\"stddev_us\": %.1f}%s\n",
+           name, times[0], median, mean, times[n - 1], n > 1 ? sqrt(var / (n - 1)) : 0.0, sep);
+}
+
+/**
+ * Run one case and print its results.
+ */
+static void
+runCase(const synth_params *params, const char *sep) {
+    static const unsigned char key[BGF_KEY_LEN];
+    static const unsigned char uuid[BGF_UUID_LEN];
+    bgf_sink nullSink = {discard, NULL, 1};
+    double *times[NUM_STAGES];
+    double t;
+    size_t len;
+    unsigned char *image = synth_image(params, &len);
+    bgf_context *ctx = bgf_new();
+    unsigned r, s;
+    char name[64];
+    FILE *fp;
+
+    if (genFile != NULL) {
+        if ((fp = fopen(genFile, "wb")) == NULL || fwrite(image, 1, len, fp) != len || fclose(fp) != 0) {
+            fprintf(stderr, "Can't write %s\n", genFile);
+            exit(1);
+        }
+        exit(0);
+    }
+    bgf_set_key(ctx, key);
+    bgf_set_uuid(ctx, uuid);
+    if (numThreads != 0)
+        bgf_set_threads(ctx, numThreads);
+    for (s = 0; s != NUM_STAGES; s++)
+        times[s] = calloc(repeats, sizeof(double));
+    for (r = 0; r != repeats; r++) {
+        bgf_reset(ctx);
+        t = now();
+        check(ctx, bgf_load_buffer(ctx, image, len, "synthetic"));
+        times[STAGE_PARSE][r] = now() - t;
+        t = now();
+        check(ctx, bgf_assemble(ctx));
+        times[STAGE_ASSEMBLE][r] = now() - t;
+        t = now();
+        check(ctx, bgf_digest(ctx));
+        times[STAGE_HASH][r] = now() - t;
+        t = now();
+        check(ctx, bgf_write(ctx, &nullSink));
+        times[STAGE_ENCRYPT][r] = now() - t;
+        t = now();
+        if (ftruncate(tmpFd, 0) != 0) {
+            fprintf(stderr, "Can't truncate temporary file\n");
+            exit(1);
+        }
+        check(ctx, bgf_write_fd(ctx, tmpFd));
+        times[STAGE_WRITE][r] = now() - t;
+    }
+    if (params->elf)
+        snprintf(name, sizeof name, "elf-%s-%luK", params->sparse ? "sparse" : "dense", params->size / 1024);
+    else if (params->recordLength == 0)
+        snprintf(name, sizeof name, "hex-%s-%luK-recrandom", params->sparse ? "sparse" : "dense", params->size / 1024);
+    else
+        snprintf(name, sizeof name, "hex-%s-%luK-rec%u", params->sparse ? "sparse" : "dense", params->size / 1024,
+                 params->recordLength);
+    printf("    {\n");
+    printf("      \"name\": \"%s\",\n", name);
+    printf("      \"format\": \"%s\",\n", params->elf ? "elf" : "hex");
+    printf("      \"layout\": \"%s\",\n", params->sparse ? "sparse" : "dense");
+    printf("      \"data_bytes\": %lu,\n", params->size);
+    if (!params->elf)
+        printf("      \"record_length\": %u,\n", params->recordLength);
+    printf("      \"input_bytes\": %lu,\n", (unsigned long) len);
+    printf("      \"blocks\": %u,\n", bgf_block_count(ctx));
+    printf("      \"output_bytes\": %lu,\n", bgf_output_size(ctx));
+    printf("      \"stages\": {\n");
+    for (s = 0; s != NUM_STAGES; s++) {
+        printStats(stageNames[s], times[s], repeats, s == NUM_STAGES - 1 ? "" : ",");
+        free(times[s]);
+    }
+    printf("      }\n");
+    printf("    }%s\n", sep);
+    fflush(stdout);
+    bgf_free(ctx);
+    free(image);
+}
+
+/**
+ * Parse an image size, in bytes or with a K or M suffix. Returns 0 if it is not a valid size.
+ */
+static unsigned long
+parseSize(const char *arg) {
+    char *end;
+    unsigned long size = strtoul(arg, &end, 0);
+
+    if (end == arg)
+        return 0;
+    if (*end == 'K' || *end == 'k') {
+        size *= 1024;
+        end++;
+    } else if (*end == 'M' || *end == 'm') {
+        size *= 1024 * 1024;
+        end++;
+    }
+    return *end == 0 ? size : 0;
+}
+
+static void
+usage(void) {
+    fprintf(stderr,
+            "Usage: bgfbench [-n <repeats>] [-j <threads>] [-s <seed>] [-z <size>[K|M]] [-l dense|sparse] [-f hex|elf]\n"
+            "                [-r <record_length>|0] [-g <outfile>]\n");
+    exit(1);
+}
+
+int
+main(int argc, char **argv) {
+    synth_params params, *cases;
+    unsigned numCases = 0, i, z, l, f, r;
+    const unsigned long *caseSizes = sizes;
+    const unsigned *caseRecords = recordLengths;
+    unsigned numSizes = COUNT(sizes), numRecords = COUNT(recordLengths), record;
+    int c;
+    char tmpl[] = "/tmp/bgfbenchXXXXXX";
+
+    while ((c = getopt(argc, argv, "n:j:s:z:l:f:r:g:")) != -1) {
+        switch (c) {
+            case 'n':
+                repeats = (unsigned) strtoul(optarg, NULL, 0);
+                break;
+            case 'j':
+                numThreads = (unsigned) strtoul(optarg, NULL, 0);
+                break;
+            case 's':
+                seed = strtoul(optarg, NULL, 0);
+                break;
+            case 'z':
+                if ((onlySize = parseSize(optarg)) == 0)
+                    usage();
+                break;
+            case 'l':
+                onlyLayout = strcmp(optarg, "sparse") == 0;
+                break;
+            case 'f':
+                onlyFormat = strcmp(optarg, "elf") == 0;
+                break;
+            case 'r':
+                onlyRecord = (int) strtoul(optarg, NULL, 0);
+                break;
+            case 'g':
+                genFile = optarg;
+                break;
+            default:
+                usage();
+        }
+    }
+    if (repeats == 0 || optind != argc)
+        usage();
+    // a size or record length on the command line replaces the table, so values outside it can be used
+    if (onlySize != 0) {
+        caseSizes = &onlySize;
+        numSizes = 1;
+    }
+    if (onlyRecord >= 0) {
+        record = (unsigned) onlyRecord;
+        caseRecords = &record;
+        numRecords = 1;
+    }
+    cases = calloc(numSizes * 2 * (numRecords + 1), sizeof *cases);
+    memset(&params, 0, sizeof params);
+    params.seed = seed;
+    for (z = 0; z != numSizes; z++) {
+        params.size = caseSizes[z];
+        for (l = 0; l != 2; l++) {
+            if (onlyLayout >= 0 && l != (unsigned) onlyLayout)
+                continue;
+            params.sparse = l;
+            for (f = 0; f != 2; f++) {
+                if (onlyFormat >= 0 && f != (unsigned) onlyFormat)
+                    continue;
+                params.elf = f;
+                for (r = 0; r != (f ? 1 : numRecords); r++) {
+                    params.recordLength = f ? 0 : caseRecords[r];
+                    cases[numCases++] = params;
+                }
+            }
+        }
+    }
+    if (numCases == 0)
+        usage();
+    if (genFile != NULL)
+        runCase(&cases[0], "");
+    if ((tmpFd = mkstemp(tmpl)) < 0) {
+        fprintf(stderr, "Can't create temporary file\n");
+        exit(1);
+    }
+    unlink(tmpl);
+    printf("{\n");
+    printf("  \"tool\": \"bgfbench\",\n");
+    printf("  \"seed\": %lu,\n", seed);
+    printf("  \"repeats\": %u,\n", repeats);
+    printf("  \"threads\": %u,\n", numThreads != 0 ? numThreads : (unsigned) sysconf(_SC_NPROCESSORS_ONLN));
+    printf("  \"hex_decoder\": \"%s\",\n", hex_decode_impl());
+    printf("  \"cases\": [\n");
+    for (i = 0; i != numCases; i++)
+        runCase(&cases[i], i == numCases - 1 ? "" : ",");
+    printf("  ]\n");
+    printf("}\n");
+    close(tmpFd);
+    free(cases);
+    return 0;
+}
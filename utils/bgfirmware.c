@@ -0,0 +1,1836 @@
+//
+// libbgfirmware - build encrypted firmware files for the bgbootload OTA bootloader.
+//
+// All state lives in a bgf_context, and errors are returned to the caller rather than reported,
+// so the library can be used from a long running process. See bgfirmware.h for the API.
+//
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include <openssl/conf.h>
+#include <openssl/evp.h>
+#include <openssl/err.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "bgfirmware.h"
+#include "vector.h"
+#include "hexdecode.h"
+#include "extent.h"
+#include "arena.h"
+#include "elf.h"
+#include "compress.h"
+#include "delta.h"
+#include "pagetag.h"
+
+/**
+ * This is the structure of the firmware file. There is a fixed size header followed by one or more block headers,
+ * which point to the data in the rest of the file.
+ * All data in the headers is little endian
+ */
+
+#define    FW_TAG        0x55A322BF        // magic number to identify the file
+#define FW_FORMAT_CBC   0       // blocks are encrypted with AES-256-CBC, chained from the block IV
+#define FW_FORMAT_CTR   1       // blocks are encrypted with AES-256-CTR, the block IV being the first counter
+
+#define KEY_LEN     BGF_KEY_LEN
+#define IV_LEN (128/8)
+#define UUID_LEN    BGF_UUID_LEN
+#define SHA_LEN     (256/8)
+#define BLOCK_SIZE  16      // round blocks up by this for encryption.
+#define CTR_COUNTER_LEN 4   // the part of a CTR nonce that counts, which starts at zero, as the device only carries into 32 bits
+
+#define BLOCK_ROUND_TRIPS   4           // IV, DATA, the final PING and DIGEST for each block
+#define FIXED_ROUND_TRIPS   3           // RESTART, DONE and RESET
+#define ERASE_ROUND_TRIPS   2           // ERASE and DIGEST for an erase-only block
+#define MAX_ERASE_BLOCK     0x8000      // so the DIGEST length fits in a control packet
+#define BASE_ROUND_TRIPS    1           // DIGEST for a base check
+#define TAG_ROUND_TRIPS     1           // TAG for a block with page tags
+#define MAX_BASE_CHECK      0x8000      // so the DIGEST length fits in a control packet
+#define MAX_ENCODED_BLOCK   0xFFFF      // the device is told the decoded size in a DIGEST command
+#define SPLIT_BLOCK         0x8000      // larger blocks are split into pieces this big for encoding
+#define MAX_BLOCK_COST      (1024 * 1024)
+
+typedef struct {
+    unsigned char tag[4];            // magic number goes here
+    unsigned char major[2];        // major version number
+    unsigned char minor[2];        // minor version number
+    unsigned char numblocks[2];        // the number of blocks in the file,
+    unsigned char format[1];        // FW_FORMAT_ cipher mode
+    unsigned char unused[5];
+    unsigned char service_uuid[UUID_LEN];    // the service uuid of the bootloader
+} firmware;
+
+/** A block header.
+ *
+ */
+
+typedef struct {
+    unsigned char addr[4];        // the address at which to load this block
+    unsigned char size[4];        // the size of this block
+    unsigned char offset[4];        // offset in the file of the data
+    unsigned char padding[1];   // length of padding at end
+    unsigned char flags[1];     // BLOCK_FLAG_ bits
+    unsigned char units[2];     // compressed blocks: length in the file, in cipher blocks
+    unsigned char init_vector[IV_LEN];    // the block 0 initialization vector
+    unsigned char sha256[SHA_LEN];       // SHA256 hash of the data
+} block_header;
+
+#define BLOCK_FLAG_ERASE    0x01    // erase-only: the pages are erased, and there is no data in the file
+#define BLOCK_FLAG_COMPRESSED   0x02    // the data in the file is LZSS compressed; size is the decompressed size
+#define BLOCK_FLAG_PATCH    0x04    // the data in the file is a patch against the old firmware; size is the patched size
+#define BLOCK_FLAG_BASE     0x08    // a check that the old firmware is in flash; no data in the file
+#define BLOCK_FLAG_TAGGED   0x10    // the data in the file is followed by a tag for each page it is written to
+#define BLOCK_FLAG_ENCODED  (BLOCK_FLAG_COMPRESSED | BLOCK_FLAG_PATCH)
+
+typedef struct {
+    unsigned char *data;        // what goes in the file, fileLength bytes
+    unsigned char *image;       // what ends up in flash, length bytes, if not the same as data
+    unsigned int length;
+    unsigned int fileLength;
+    unsigned long addr;
+    unsigned flags;             // BLOCK_FLAG_ bits
+} memblock;
+
+/*
+ * One firmware file being written from the assembled blocks. Each output has its own key and
+ * headers; the block layout and digests are shared.
+ */
+typedef struct {
+    const unsigned char *key;
+    bgf_sink sink;
+    firmware fw;
+    block_header *headers;
+    unsigned char tagKey[KEY_LEN];          // the page tag keys derived from key
+    unsigned char tagSubkey[BLOCK_SIZE];
+} output;
+
+/*
+ * One unit of work for the crypto workers: hash and/or encrypt one block for one output, or in CTR
+ * mode, encrypt part of one.
+ */
+typedef struct {
+    memblock *block;
+    output *out;                // NULL when only hashing
+    unsigned index;             // which block
+    unsigned long offset;       // where the block's ciphertext goes in the output
+    unsigned pos, len;          // the part of the block's data, which is all of it if hashing
+} crypt_job;
+
+struct bgf_context {
+    // settings for bgf_write()
+    unsigned char key[KEY_LEN];
+    unsigned char uuid[UUID_LEN];
+    int major, minor;
+    unsigned numThreads;        // number of worker threads for hashing and encryption
+    unsigned long blockCost;    // cost model for laying out blocks
+    double byteCost;
+    unsigned long pageSize;     // align blocks to flash pages of this size, 0 for none
+    bool skipErased;            // send erased pages as erase-only blocks
+    bool compress;              // compress blocks where that makes them smaller
+    bool ctr;                   // encrypt with AES-CTR rather than CBC
+    bool pageTags;              // add page tags to unencoded blocks
+    const bgf_context *oldFirmware;     // the old firmware, to encode blocks as patches against
+
+    // the image
+    arena_t arena;              // owns the extents, blocks and digests
+    extent_map extents;
+    vector_t blocks;            // memblock *, in address order, once assembled
+    bool assembled;
+    unsigned char (*digests)[SHA_LEN];      // digest of each block, once computed
+    unsigned pageBlock;         // bgf_page_info() carries on from this block,
+    unsigned pageIndex;         // whose first skippable page has this index
+
+    // parser state
+    const char *name;           // the input being loaded, for error messages
+    int lineno;
+    unsigned long base;
+    const char *linep;          // start of the current line in the input
+    const char *fileEnd;        // end of the input
+
+    // crypto workers
+    crypt_job *jobs;
+    unsigned numJobs;
+    unsigned nextJob;           // next job to be claimed, updated atomically
+    unsigned mode;              // what the workers do with each job
+
+    bool timing;                // collect stage timings
+    bgf_stats stats;
+
+    pthread_mutex_t lock;       // guards the error state and the worker timings
+    volatile bool failed;       // set by the first error in an operation
+    char errbuf[512];
+};
+
+#define CRYPT_CHUNK (16 * 1024)     // plaintext is hashed and encrypted in pieces this big, to stay in cache
+
+#define CRYPT_HASH      1           // compute the block digest
+#define CRYPT_ENCRYPT   2           // encrypt the block and write it to the output
+
+static pthread_once_t sslOnce = PTHREAD_ONCE_INIT;
+
+/*
+ * A point in time, for timing stages.
+ */
+typedef struct {
+    double wall;
+    double cpu;
+} clock_mark;
+
+/*
+ * Timings collected by one worker, added to the context's totals when it finishes.
+ */
+typedef struct {
+    bgf_timing digest;
+    bgf_timing encrypt;
+    bgf_timing output;
+} worker_timing;
+
+static void
+put2(unsigned char *addr, unsigned int val) {
+    *addr++ = (unsigned char) (val & 0xFF);
+    *addr = (unsigned char) ((val >> 8) & 0xFF);
+}
+
+static void
+put4(unsigned char *addr, unsigned long val) {
+    *addr++ = (unsigned char) (val & 0xFF);
+    *addr++ = (unsigned char) ((val >> 8) & 0xFF);
+    *addr++ = (unsigned char) ((val >> 16) & 0xFF);
+    *addr = (unsigned char) ((val >> 24) & 0xFF);
+}
+
+static unsigned long
+get4(const unsigned char *addr) {
+    return addr[0] + (addr[1] << 8) + ((unsigned long) addr[2] << 16) + ((unsigned long) addr[3] << 24);
+}
+
+/**
+ * Record an error. Only the first error of an operation is kept, since with several workers
+ * the later ones are usually consequences of it.
+ * @return  -1, for the caller to return
+ */
+static int
+fail(bgf_context *ctx, const char *f, ...) {
+    va_list ap;
+
+    pthread_mutex_lock(&ctx->lock);
+    if (!ctx->failed) {
+        va_start(ap, f);
+        vsnprintf(ctx->errbuf, sizeof ctx->errbuf, f, ap);
+        va_end(ap);
+        ctx->failed = true;
+    }
+    pthread_mutex_unlock(&ctx->lock);
+    return -1;
+}
+
+/**
+ * Record an error in a hex record, with its position and the text of the line.
+ */
+static int
+hexfail(bgf_context *ctx, const char *f, ...) {
+    va_list ap;
+    char msg[128];
+    const char *eol = ctx->linep;
+
+    va_start(ap, f);
+    vsnprintf(msg, sizeof msg, f, ap);
+    va_end(ap);
+    while (eol != ctx->fileEnd && *eol != '\n' && *eol != '\r')
+        eol++;
+    return fail(ctx, "%s: %d: %s\nline: \"%.*s\"", ctx->name, ctx->lineno, msg, (int) (eol - ctx->linep), ctx->linep);
+}
+
+static double
+clockUs(clockid_t id) {
+    struct timespec ts;
+
+    clock_gettime(id, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static void
+markNow(clock_mark *m) {
+    m->wall = clockUs(CLOCK_MONOTONIC);
+    m->cpu = clockUs(CLOCK_THREAD_CPUTIME_ID);
+}
+
+/**
+ * Add the time since a mark to a stage, and move the mark to now.
+ */
+static void
+lap(clock_mark *m, bgf_timing *t) {
+    clock_mark n;
+
+    markNow(&n);
+    t->wall_us += n.wall - m->wall;
+    t->cpu_us += n.cpu - m->cpu;
+    *m = n;
+}
+
+static void
+addTiming(bgf_timing *total, const bgf_timing *t) {
+    total->wall_us += t->wall_us;
+    total->cpu_us += t->cpu_us;
+}
+
+/**
+ * Allocate zeroed memory, counting the allocation.
+ */
+static void *
+alloc(bgf_context *ctx, size_t n, size_t size) {
+    ctx->stats.allocations++;
+    return calloc(n, size);
+}
+
+// start a new operation, clearing the error state of the last one
+static void
+begin(bgf_context *ctx) {
+    ctx->failed = false;
+}
+
+static void
+sslInit(void) {
+    ERR_load_crypto_strings();
+    OpenSSL_add_all_algorithms();
+    OPENSSL_config(NULL);
+}
+
+bgf_context *
+bgf_new(void) {
+    bgf_context *ctx = calloc(1, sizeof *ctx);
+
+    if (ctx == NULL)
+        return NULL;
+    pthread_once(&sslOnce, sslInit);
+    if ((ctx->arena = arena_new()) == NULL || (ctx->extents = extent_new(ctx->arena)) == NULL ||
+        (ctx->blocks = vec_new_arena(ctx->arena)) == NULL) {
+        arena_destroy(ctx->arena);
+        free(ctx);
+        return NULL;
+    }
+    pthread_mutex_init(&ctx->lock, NULL);
+    ctx->numThreads = (unsigned) sysconf(_SC_NPROCESSORS_ONLN);
+    if (ctx->numThreads == 0)
+        ctx->numThreads = 1;
+    ctx->blockCost = BGF_BLOCK_COST;
+    ctx->byteCost = BGF_BYTE_COST;
+    return ctx;
+}
+
+void
+bgf_reset(bgf_context *ctx) {
+    // the chunk the arena keeps has room for these; if not, loading fails
+    arena_reset(ctx->arena);
+    ctx->extents = extent_new(ctx->arena);
+    ctx->blocks = vec_new_arena(ctx->arena);
+    ctx->digests = NULL;
+    ctx->assembled = false;
+    ctx->pageBlock = ctx->pageIndex = 0;
+    memset(&ctx->stats, 0, sizeof ctx->stats);
+}
+
+void
+bgf_free(bgf_context *ctx) {
+    if (ctx == NULL)
+        return;
+    arena_destroy(ctx->arena);
+    pthread_mutex_destroy(&ctx->lock);
+    free(ctx);
+}
+
+const char *
+bgf_error(const bgf_context *ctx) {
+    return ctx->errbuf;
+}
+
+void
+bgf_set_key(bgf_context *ctx, const unsigned char key[BGF_KEY_LEN]) {
+    memcpy(ctx->key, key, KEY_LEN);
+}
+
+int
+bgf_parse_key(unsigned char key[BGF_KEY_LEN], const char *hex) {
+    unsigned sum = 0;
+
+    if (strlen(hex) != KEY_LEN * 2 || !hex_decode(key, hex, KEY_LEN, &sum))
+        return -1;
+    return 0;
+}
+
+void
+bgf_set_uuid(bgf_context *ctx, const unsigned char uuid[BGF_UUID_LEN]) {
+    memcpy(ctx->uuid, uuid, UUID_LEN);
+}
+
+void
+bgf_set_version(bgf_context *ctx, int major, int minor) {
+    ctx->major = major;
+    ctx->minor = minor;
+}
+
+void
+bgf_set_threads(bgf_context *ctx, unsigned n) {
+    ctx->numThreads = n == 0 ? 1 : n;
+}
+
+void
+bgf_set_cost(bgf_context *ctx, unsigned long blockCost, double byteCost) {
+    ctx->blockCost = blockCost > MAX_BLOCK_COST ? MAX_BLOCK_COST : blockCost;
+    ctx->byteCost = byteCost;
+}
+
+int
+bgf_set_page_size(bgf_context *ctx, unsigned long size) {
+    begin(ctx);
+    if (size != 0 && (size % BLOCK_SIZE != 0 || (size & (size - 1)) != 0))
+        return fail(ctx, "Page size %lX is not a power of 2 and a multiple of %d", size, BLOCK_SIZE);
+    ctx->pageSize = size;
+    return 0;
+}
+
+void
+bgf_set_skip_erased(bgf_context *ctx, int enable) {
+    ctx->skipErased = enable != 0;
+}
+
+void
+bgf_set_compress(bgf_context *ctx, int enable) {
+    ctx->compress = enable != 0;
+}
+
+void
+bgf_set_base(bgf_context *ctx, const bgf_context *base) {
+    ctx->oldFirmware = base;
+}
+
+void
+bgf_set_ctr(bgf_context *ctx, int enable) {
+    ctx->ctr = enable != 0;
+}
+
+void
+bgf_set_page_tags(bgf_context *ctx, int enable) {
+    ctx->pageTags = enable != 0;
+}
+
+void
+bgf_set_stats(bgf_context *ctx, int enable) {
+    ctx->timing = enable != 0;
+}
+
+void
+bgf_get_stats(const bgf_context *ctx, bgf_stats *stats) {
+    *stats = ctx->stats;
+    stats->allocations += ctx->extents->allocations + arena_chunks(ctx->arena);
+    stats->arena_bytes = arena_used(ctx->arena);
+}
+
+/**
+ * Parse one record from the input.
+ * @param pp    Pointer to the read position, updated to the start of the following line.
+ * @return      0 at end of file or on an EOF record, 1 otherwise, -1 on error.
+ */
+static int
+readHexLine(bgf_context *ctx, const char **pp) {
+    unsigned int cksum, type, cnt;
+    unsigned addr;
+    unsigned char header[3];
+    unsigned char buffer[256];
+    unsigned char count;
+    unsigned char check;
+    unsigned char *dst;
+    bool overlap = false;
+    const char *p = *pp;
+    const char *eol;
+
+    if (p == ctx->fileEnd)
+        return 0;
+    ctx->lineno++;
+    ctx->linep = p;
+    eol = memchr(p, '\n', (size_t) (ctx->fileEnd - p));
+    if (eol == NULL)
+        eol = ctx->fileEnd;
+    *pp = eol == ctx->fileEnd ? eol : eol + 1;
+    p = memchr(p, ':', (size_t) (eol - p));
+    if (p == NULL)
+        return 1;
+    p++;
+    ctx->stats.records++;
+    if (eol - p < 10)
+        return hexfail(ctx, "Truncated record");
+    cksum = 0;
+    if (!hex_decode(&count, p, 1, &cksum))
+        return hexfail(ctx, "Saw 0%o and 0%o:- hex digit expected", (unsigned char) p[0], (unsigned char) p[1]);
+    p += 2;
+    cnt = count;
+    if (eol - p < (long) (8 + cnt * 2))
+        return hexfail(ctx, "Truncated record");
+    // the address, type, data and checksum are decoded in runs, summing as we go.
+    // Data goes straight into its place in the extent map.
+    if (!hex_decode(header, p, sizeof header, &cksum))
+        return hexfail(ctx, "Hex digit expected");
+    p += sizeof header * 2;
+    addr = (header[0] << 8) + header[1];
+    type = header[2];
+    dst = buffer;
+    if (type == 0 && cnt != 0) {
+        switch (extent_reserve(ctx->extents, ctx->base + addr, cnt, &dst)) {
+            case 0:
+                break;
+            case EXTENT_OVERLAP:
+                overlap = true;
+                break;
+            default:
+                return fail(ctx, "Out of memory");
+        }
+    }
+    if (!hex_decode(dst, p, cnt, &cksum) || !hex_decode(&check, p + cnt * 2, 1, &cksum))
+        return hexfail(ctx, "Hex digit expected");
+    if ((cksum & 0xFF) != 0)
+        return hexfail(ctx, "Checksum error");
+    if (overlap)
+        return hexfail(ctx, "Overlapping data at %lX", ctx->base + addr);
+    switch (type) {
+        case 1:    /* EOF */
+            return 0;
+
+        case 0:    /* data */
+            ctx->stats.data_bytes += cnt;
+            break;
+
+        case 4:    /* extended linear address */
+            ctx->base = ((unsigned long) buffer[1] << 16) + ((unsigned long) buffer[0] << 24);
+            break;
+
+        case 2:    /* extended segment address */
+            ctx->base = ((unsigned long) buffer[1] << 4) + ((unsigned long) buffer[0] << 12);
+            break;
+
+        case 3:
+        case 5:
+            break;
+
+        default:
+            return hexfail(ctx, "Unknown record type %2.2X - length %d", type, cnt);
+
+    }
+    return 1;
+}
+
+/**
+ * Add an ELF segment to the image, copying it from the file.
+ */
+static int
+addSegment(void *arg, unsigned long addr, unsigned int cnt, const unsigned char *data) {
+    bgf_context *ctx = arg;
+    unsigned char *dst;
+    int result;
+
+    if (cnt == 0)
+        return 0;
+    if ((result = extent_reserve(ctx->extents, addr, cnt, &dst)) == EXTENT_OVERLAP)
+        return fail(ctx, "%s: Overlapping data at %lX", ctx->name, addr);
+    if (result != 0)
+        return fail(ctx, "Out of memory");
+    memcpy(dst, data, cnt);
+    ctx->stats.records++;
+    ctx->stats.data_bytes += cnt;
+    return 0;
+}
+
+int
+bgf_load_buffer(bgf_context *ctx, const void *data, size_t len, const char *name) {
+    const char *err;
+    const char *p = data;
+    int result = 0;
+    clock_mark mark;
+
+    begin(ctx);
+    if (ctx->assembled)
+        return fail(ctx, "%s: Image already assembled", name);
+    if (ctx->extents == NULL || ctx->blocks == NULL)
+        return fail(ctx, "Out of memory");
+    if (ctx->timing)
+        markNow(&mark);
+    ctx->name = name;
+    ctx->stats.inputs++;
+    ctx->stats.input_bytes += len;
+    // an ELF file holds its data as is, hex takes at least two characters a byte
+    if (elf_is_elf(data, len)) {
+        if (arena_reserve(ctx->arena, len) != 0)
+            result = fail(ctx, "Out of memory");
+        else if ((err = elf_load(data, len, addSegment, ctx)) != NULL)
+            result = fail(ctx, "%s: %s", name, err);
+    } else if (arena_reserve(ctx->arena, len / 2) != 0) {
+        result = fail(ctx, "Out of memory");
+    } else {
+        ctx->base = 0;
+        ctx->lineno = 0;
+        ctx->fileEnd = p + len;
+        while ((result = readHexLine(ctx, &p)) > 0)
+            continue;
+    }
+    if (ctx->timing)
+        lap(&mark, &ctx->stats.parse);
+    return result;
+}
+
+int
+bgf_load_file(bgf_context *ctx, const char *path) {
+    struct stat st;
+    void *map;
+    int result = 0;
+    int fd = open(path, O_RDONLY);
+
+    begin(ctx);
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        if (fd >= 0)
+            close(fd);
+        return fail(ctx, "Can't open %s", path);
+    }
+    if (st.st_size != 0) {
+        map = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) {
+            close(fd);
+            return fail(ctx, "Can't map %s", path);
+        }
+        madvise(map, (size_t) st.st_size, MADV_SEQUENTIAL);
+        result = bgf_load_buffer(ctx, map, (size_t) st.st_size, path);
+        munmap(map, (size_t) st.st_size);
+    }
+    close(fd);
+    return result;
+}
+
+/**
+ * Round an address down or up to a flash page boundary, if blocks are page aligned.
+ */
+static unsigned long
+pageDown(const bgf_context *ctx, unsigned long addr) {
+    return ctx->pageSize == 0 ? addr : addr & ~(ctx->pageSize - 1);
+}
+
+static unsigned long
+pageUp(const bgf_context *ctx, unsigned long addr) {
+    return ctx->pageSize == 0 ? addr : (addr + ctx->pageSize - 1) & ~(ctx->pageSize - 1);
+}
+
+/**
+ * The length of a block in the file. Page aligned blocks are already a multiple of the cipher block
+ * size, and need no padding.
+ */
+static unsigned long
+fileLength(const bgf_context *ctx, unsigned long span) {
+    return ctx->pageSize != 0 ? span : (span + BLOCK_SIZE) & ~(BLOCK_SIZE - 1);
+}
+
+/**
+ * The cost of sending one block spanning the given number of bytes, in byte-equivalents.
+ */
+static unsigned long
+blockCost(const bgf_context *ctx, unsigned long span) {
+    return ctx->blockCost + IV_LEN + SHA_LEN + fileLength(ctx, span);
+}
+
+/**
+ * Choose which extents to merge into each block, to minimise the cost of sending them all.
+ *
+ * Merging two neighbouring blocks saves one block's overhead and costs the gap between them, give
+ * or take a cipher block of padding. So a gap narrow enough that merging always wins is merged
+ * outright, and one wide enough that it never wins always separates blocks. The runs of extents
+ * between the gaps that are left are grouped by dynamic programming: best[j] is the lowest cost of
+ * the first j runs, and start[j] the first run of the last block in that grouping.
+ * With page alignment, extents are measured by the pages they cover, and extents sharing a page
+ * always go in the same block, so no page is written twice. There is no padding to allow for.
+ * @return  The number of blocks, or 0 if out of memory; ends[] is set to the index after the last
+ *          extent of each.
+ */
+static unsigned
+planBlocks(bgf_context *ctx, unsigned cnt, unsigned **ends) {
+    unsigned long overhead = ctx->blockCost + IV_LEN + SHA_LEN;
+    unsigned long mergeGap = ctx->pageSize != 0 ? overhead : overhead + 2 - BLOCK_SIZE;
+    unsigned long splitGap = ctx->pageSize != 0 ? overhead : overhead + 2 * BLOCK_SIZE - 1;
+    unsigned *first = arena_alloc(ctx->arena, (cnt + 1) * sizeof *first);
+    unsigned *start = arena_alloc(ctx->arena, (cnt + 1) * sizeof *start);
+    unsigned long *best = arena_alloc(ctx->arena, (cnt + 1) * sizeof *best);
+    unsigned long *runAddr = arena_alloc(ctx->arena, cnt * sizeof *runAddr);
+    unsigned long *runEnd = arena_alloc(ctx->arena, cnt * sizeof *runEnd);
+    unsigned i, j, n = 0, numBlocks = 0;
+
+    if (first == NULL || start == NULL || best == NULL || runAddr == NULL || runEnd == NULL)
+        return 0;
+    for (i = 0; i != cnt; i++) {
+        extent *e = extent_at(ctx->extents, i);
+        if (n == 0 || pageDown(ctx, e->addr) >= runEnd[n - 1] + mergeGap) {
+            first[n] = i;
+            runAddr[n++] = pageDown(ctx, e->addr);
+        }
+        runEnd[n - 1] = pageUp(ctx, e->addr + e->length);
+    }
+    first[n] = cnt;
+    best[0] = 0;
+    for (j = 1; j <= n; j++) {
+        best[j] = ULONG_MAX;
+        for (i = j; i-- != 0;) {
+            unsigned long cost = best[i] + blockCost(ctx, runEnd[j - 1] - runAddr[i]);
+            if (cost < best[j]) {
+                best[j] = cost;
+                start[j] = i;
+            }
+            if (i != 0 && runAddr[i] - runEnd[i - 1] > splitGap)
+                break;
+        }
+    }
+    // walk back through the choices, then put the blocks in address order
+    if ((*ends = arena_alloc(ctx->arena, n * sizeof **ends)) == NULL)
+        return 0;
+    for (j = n; j != 0; j = start[j])
+        (*ends)[numBlocks++] = first[j];
+    for (i = 0; i != numBlocks / 2; i++) {
+        j = (*ends)[i];
+        (*ends)[i] = (*ends)[numBlocks - 1 - i];
+        (*ends)[numBlocks - 1 - i] = j;
+    }
+    return numBlocks;
+}
+
+/**
+ * Is a page of data all 0xFF?
+ */
+static bool
+isErased(const unsigned char *data, unsigned long len) {
+    while (len-- != 0)
+        if (*data++ != 0xFF)
+            return false;
+    return true;
+}
+
+/**
+ * Add a data block for part of an assembled block, with its own padding. The padding overwrites
+ * the start of the erased run after the part, which is no longer sent, or for the last part, the
+ * padding of the block. The last part starts anywhere, so it may need more padding than the block
+ * has room for, and then gets a copy of its data.
+ */
+static int
+addDataPart(bgf_context *ctx, const memblock *mb, unsigned long from, unsigned long to) {
+    memblock *part = arena_alloc(ctx->arena, sizeof *part);
+    unsigned char *data;
+
+    if (part == NULL)
+        return fail(ctx, "Out of memory");
+    part->addr = from;
+    part->data = mb->data + (from - mb->addr);
+    part->length = (unsigned) (to - from);
+    part->fileLength = (unsigned) fileLength(ctx, part->length);
+    if (to == mb->addr + mb->length) {
+        if (part->fileLength > mb->fileLength - (from - mb->addr)) {
+            if ((data = arena_alloc(ctx->arena, part->fileLength)) == NULL)
+                return fail(ctx, "Out of memory");
+            memcpy(data, part->data, part->length);
+            part->data = data;
+        }
+        ctx->stats.padding_bytes -= mb->fileLength - mb->length;
+    }
+    memset(part->data + part->length, (unsigned char) (part->fileLength - part->length),
+           part->fileLength - part->length);
+    ctx->stats.padding_bytes += part->fileLength - part->length;
+    if (vec_add(ctx->blocks, part) == VEC_NOMEM)
+        return fail(ctx, "Out of memory");
+    return 0;
+}
+
+/**
+ * Replace runs of whole pages of 0xFF inside the blocks with erase-only blocks, which carry no data:
+ * the device erases the pages and checks the digest. A run is only cut out if the bytes saved
+ * outweigh the extra blocks, going by the cost model. The erase-only blocks share one buffer of
+ * 0xFF, used only for their digests. Runs are cut on the larger of the alignment page size and
+ * BGF_PAGE_SIZE, since the device erases whole flash pages and rejects erase blocks that don't
+ * start on one.
+ */
+static int
+splitErased(bgf_context *ctx) {
+    unsigned long page = ctx->pageSize > BGF_PAGE_SIZE ? ctx->pageSize : BGF_PAGE_SIZE;
+    unsigned long overhead = ctx->blockCost + IV_LEN + SHA_LEN;
+    unsigned long eraseCost = ctx->blockCost * ERASE_ROUND_TRIPS / BLOCK_ROUND_TRIPS + SHA_LEN;
+    vector_t blocks = ctx->blocks;
+    unsigned char *erased = NULL;
+    memblock *mb, *eb;
+    vec_cursor cur;
+
+    if ((ctx->blocks = vec_new_arena(ctx->arena)) == NULL)
+        return fail(ctx, "Out of memory");
+    VEC_FOREACH(blocks, mb, memblock *, cur) {
+        unsigned long end = mb->addr + mb->length;
+        unsigned long from = mb->addr, rs, re, addr;
+
+        for (rs = (mb->addr + page - 1) & ~(page - 1); rs + page <= end; rs = re + page) {
+            for (re = rs; re + page <= end && isErased(mb->data + (re - mb->addr), page); re += page)
+                ;
+            if (re == rs)
+                continue;
+            // cutting out the run costs the erase blocks, and another data block if there is data both sides
+            if (re - rs <= eraseCost * ((re - rs + MAX_ERASE_BLOCK - 1) / MAX_ERASE_BLOCK) +
+                           (rs != from && re != end ? overhead : 0))
+                continue;
+            if (erased == NULL) {
+                if ((erased = arena_alloc(ctx->arena, MAX_ERASE_BLOCK)) == NULL)
+                    return fail(ctx, "Out of memory");
+                memset(erased, 0xFF, MAX_ERASE_BLOCK);
+            }
+            if (rs != from && addDataPart(ctx, mb, from, rs) != 0)
+                return -1;
+            for (addr = rs; addr != re; addr += eb->length) {
+                if ((eb = arena_alloc(ctx->arena, sizeof *eb)) == NULL)
+                    return fail(ctx, "Out of memory");
+                eb->addr = addr;
+                eb->length = (unsigned) (re - addr < MAX_ERASE_BLOCK ? re - addr : MAX_ERASE_BLOCK);
+                eb->image = erased;
+                eb->flags = BLOCK_FLAG_ERASE;
+                ctx->stats.erased_bytes += eb->length;
+                if (vec_add(ctx->blocks, eb) == VEC_NOMEM)
+                    return fail(ctx, "Out of memory");
+            }
+            from = re;
+            if (re == end)
+                break;
+        }
+        if (from == mb->addr) {
+            if (vec_add(ctx->blocks, mb) == VEC_NOMEM)
+                return fail(ctx, "Out of memory");
+        } else if (from != end && addDataPart(ctx, mb, from, end) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+/**
+ * Split blocks too large to encode into pieces. The pieces are a multiple of BLOCK_SIZE, so only
+ * the last needs padding, and it has the padding of the original block.
+ */
+static int
+splitLarge(bgf_context *ctx) {
+    vector_t blocks = ctx->blocks;
+    memblock *mb, *part;
+    vec_cursor cur;
+    unsigned pos;
+
+    if ((ctx->blocks = vec_new_arena(ctx->arena)) == NULL)
+        return fail(ctx, "Out of memory");
+    VEC_FOREACH(blocks, mb, memblock *, cur) {
+        if ((mb->flags & BLOCK_FLAG_ERASE) || mb->length <= MAX_ENCODED_BLOCK) {
+            if (vec_add(ctx->blocks, mb) == VEC_NOMEM)
+                return fail(ctx, "Out of memory");
+            continue;
+        }
+        for (pos = 0; pos < mb->length; pos += SPLIT_BLOCK) {
+            if ((part = arena_alloc(ctx->arena, sizeof *part)) == NULL)
+                return fail(ctx, "Out of memory");
+            part->addr = mb->addr + pos;
+            part->data = mb->data + pos;
+            part->length = mb->length - pos > SPLIT_BLOCK ? SPLIT_BLOCK : mb->length - pos;
+            part->fileLength = mb->length - pos > SPLIT_BLOCK ? SPLIT_BLOCK : mb->fileLength - pos;
+            if (vec_add(ctx->blocks, part) == VEC_NOMEM)
+                return fail(ctx, "Out of memory");
+        }
+    }
+    return 0;
+}
+
+/**
+ * Can a block be replaced by an encoded form, which must be shorter in the file?
+ */
+static bool
+canEncode(const memblock *mb) {
+    return (mb->flags & (BLOCK_FLAG_ERASE | BLOCK_FLAG_ENCODED)) == 0 && mb->length <= MAX_ENCODED_BLOCK &&
+           mb->fileLength > BLOCK_SIZE;
+}
+
+/**
+ * Replace a block's data with an encoded form, which the device decodes as it arrives. The padding
+ * follows the encoded data, and the digest is still of the decoded data, which is all the device
+ * writes.
+ * @return  The bytes saved in the file
+ */
+static unsigned
+useEncoded(memblock *mb, unsigned char *out, size_t len, unsigned flag) {
+    unsigned fileLen = (unsigned) ((len + BLOCK_SIZE) & ~(BLOCK_SIZE - 1)), saved = mb->fileLength - fileLen;
+
+    memset(out + len, (unsigned char) (fileLen - len), fileLen - len);
+    mb->image = mb->data;
+    mb->data = out;
+    mb->fileLength = fileLen;
+    mb->flags |= flag;
+    return saved;
+}
+
+/**
+ * Compress each data block, keeping the compressed form if it is shorter in the file. Each
+ * compressed block is decompressed again with the bootloader's decoder and checked against the
+ * original before it is used.
+ */
+static int
+compressBlocks(bgf_context *ctx) {
+    memblock *mb;
+    vec_cursor cur;
+    unsigned char *out;
+    size_t len;
+
+    VEC_FOREACH(ctx->blocks, mb, memblock *, cur) {
+        if (!canEncode(mb))
+            continue;
+        if ((out = arena_alloc(ctx->arena, mb->fileLength)) == NULL)
+            return fail(ctx, "Out of memory");
+        len = lzss_compress(mb->data, mb->length, out, mb->fileLength - BLOCK_SIZE - 1);
+        if (len == 0)
+            continue;
+        if (lzss_verify(out, len, mb->data, mb->length) != 0)
+            return fail(ctx, "Compressed block at %lX does not decompress correctly", mb->addr);
+        ctx->stats.compressed_bytes += useEncoded(mb, out, len, BLOCK_FLAG_COMPRESSED);
+    }
+    return 0;
+}
+
+/**
+ * Encode each data block as a patch against the old firmware, keeping the patch if it is shorter
+ * in the file. Patches only copy from flash that no block before them has overwritten, and each is
+ * applied again with the bootloader's code and checked against the original before it is used.
+ * The parts of the old firmware that patches copy from are checked by base check blocks, sent
+ * before anything is written: each is a DIGEST of part of the old firmware, which is copied so the
+ * base context isn't needed after assembly.
+ */
+static int
+patchBlocks(bgf_context *ctx) {
+    const bgf_context *base = ctx->oldFirmware;
+    unsigned long page = ctx->pageSize != 0 ? ctx->pageSize : BGF_PAGE_SIZE;
+    unsigned i, n = extent_count(base->extents);
+    vector_t blocks = ctx->blocks;
+    unsigned long from, to, end;
+    delta_base *db;
+    memblock *mb, *cb;
+    vec_cursor cur;
+    unsigned char *out;
+    size_t len;
+    int result = 0;
+
+    if (base->assembled || n == 0)
+        return fail(ctx, "The old firmware must be loaded, and not assembled");
+    if ((db = delta_new()) == NULL)
+        return fail(ctx, "Out of memory");
+    ctx->stats.allocations++;
+    for (i = 0; i != n; i++)
+        delta_add(db, extent_at(base->extents, i)->addr, extent_at(base->extents, i)->data,
+                  extent_at(base->extents, i)->length);
+    delta_set_page_size(db, page);
+    VEC_FOREACH(blocks, mb, memblock *, cur) {
+        // what the device overwrites, including the padding of unencoded blocks
+        end = mb->addr + (mb->fileLength > mb->length ? mb->fileLength : mb->length);
+        if (canEncode(mb)) {
+            if ((out = arena_alloc(ctx->arena, mb->fileLength)) == NULL) {
+                delta_free(db);
+                return fail(ctx, "Out of memory");
+            }
+            len = delta_encode(db, mb->addr, mb->data, mb->length, out, mb->fileLength - BLOCK_SIZE - 1);
+            if (len != 0) {
+                if (delta_verify(db, out, len, mb->data, mb->length) != 0) {
+                    delta_free(db);
+                    return fail(ctx, "Patch for block at %lX does not apply correctly", mb->addr);
+                }
+                delta_keep(db);
+                ctx->stats.patched_bytes += useEncoded(mb, out, len, BLOCK_FLAG_PATCH);
+            }
+        }
+        delta_exclude(db, mb->addr, end);
+    }
+    if ((ctx->blocks = vec_new_arena(ctx->arena)) == NULL)
+        result = fail(ctx, "Out of memory");
+    for (i = 0; result == 0 && i != n; i++) {
+        extent *e = extent_at(base->extents, i);
+
+        if (!delta_used(db, i, &from, &to))
+            continue;
+        for (; from != to; from += cb->length) {
+            if ((cb = arena_alloc(ctx->arena, sizeof *cb)) == NULL) {
+                result = fail(ctx, "Out of memory");
+                break;
+            }
+            cb->addr = from;
+            cb->length = (unsigned) (to - from < MAX_BASE_CHECK ? to - from : MAX_BASE_CHECK);
+            if ((cb->image = arena_alloc(ctx->arena, cb->length)) == NULL) {
+                result = fail(ctx, "Out of memory");
+                break;
+            }
+            memcpy(cb->image, e->data + (from - e->addr), cb->length);
+            cb->flags = BLOCK_FLAG_BASE;
+            if (vec_add(ctx->blocks, cb) == VEC_NOMEM) {
+                result = fail(ctx, "Out of memory");
+                break;
+            }
+        }
+    }
+    VEC_FOREACH(blocks, mb, memblock *, cur) {
+        if (result == 0 && vec_add(ctx->blocks, mb) == VEC_NOMEM)
+            result = fail(ctx, "Out of memory");
+    }
+    delta_free(db);
+    return result;
+}
+
+/**
+ * Mark the blocks that get page tags: those sent as plain data, starting on a cipher block, which
+ * the device decrypts a page at a time. Encoded blocks are written as they are decoded, so they
+ * have only their digests.
+ */
+static void
+tagBlocks(bgf_context *ctx) {
+    memblock *mb;
+    vec_cursor cur;
+
+    VEC_FOREACH(ctx->blocks, mb, memblock *, cur) {
+        if ((mb->flags & (BLOCK_FLAG_ERASE | BLOCK_FLAG_BASE | BLOCK_FLAG_ENCODED)) == 0 &&
+            mb->addr % BLOCK_SIZE == 0)
+            mb->flags |= BLOCK_FLAG_TAGGED;
+    }
+}
+
+/**
+ * The number of page tags a block has, one for each flash page its data in the file is written to.
+ */
+static unsigned
+tagCount(const memblock *mb) {
+    unsigned long first = mb->addr & ~(unsigned long) (BGF_PAGE_SIZE - 1);
+
+    if ((mb->flags & BLOCK_FLAG_TAGGED) == 0)
+        return 0;
+    return (unsigned) ((mb->addr + mb->fileLength - 1 - first) / BGF_PAGE_SIZE + 1);
+}
+
+/**
+ * Where the data for a block's page, by index, starts in the block. It ends where the next starts,
+ * or at the end of the data in the file.
+ */
+static unsigned
+tagStart(const memblock *mb, unsigned index) {
+    if (index == 0)
+        return 0;
+    return (unsigned) ((mb->addr & ~(unsigned long) (BGF_PAGE_SIZE - 1)) + index * BGF_PAGE_SIZE - mb->addr);
+}
+
+/**
+ * Build the blocks to be written from the extent map. Extents are coalesced as chosen by the cost
+ * model, with the gaps zero filled. Each block is padded to a multiple of BLOCK_SIZE; the pad bytes
+ * hold the pad length. The block takes over the extent's buffer, so only gap-separated extents are
+ * copied.
+ * With page alignment, each block instead starts and ends on a page boundary, and everything in it
+ * that is not loaded data is filled with 0xFF, as erased flash would be.
+ * Then, if wanted, erased pages are cut out of the blocks into erase-only blocks, and the rest are
+ * encoded as patches against the old firmware, or compressed, splitting any too large to encode.
+ * Blocks left as plain data are given page tags if wanted, also splitting large blocks.
+ */
+int
+bgf_assemble(bgf_context *ctx) {
+    unsigned i, j, b, numBlocks, lead, cnt;
+    unsigned char fill = (unsigned char) (ctx->pageSize != 0 ? 0xFF : 0);
+    unsigned *ends;
+    clock_mark mark;
+
+    begin(ctx);
+    if (ctx->assembled)
+        return 0;
+    if (ctx->extents == NULL || ctx->blocks == NULL)
+        return fail(ctx, "Out of memory");
+    if ((cnt = extent_count(ctx->extents)) == 0)
+        return fail(ctx, "No data read");
+    if (ctx->timing)
+        markNow(&mark);
+    ctx->stats.extents = cnt;
+    if ((numBlocks = planBlocks(ctx, cnt, &ends)) == 0)
+        return fail(ctx, "Out of memory");
+    for (b = 0; b != numBlocks; b++) {
+        i = b == 0 ? 0 : ends[b - 1];
+        extent *e = extent_at(ctx->extents, i);
+        extent *last = extent_at(ctx->extents, ends[b] - 1);
+        memblock *mb = arena_alloc(ctx->arena, sizeof *mb);
+        if (mb == NULL)
+            return fail(ctx, "Out of memory");
+        mb->addr = pageDown(ctx, e->addr);
+        lead = (unsigned) (e->addr - mb->addr);
+        mb->length = lead + e->length;
+        mb->fileLength = (unsigned) fileLength(ctx, pageUp(ctx, last->addr + last->length) - mb->addr);
+        if (extent_grow(ctx->extents, e, mb->fileLength) != 0)
+            return fail(ctx, "Out of memory");
+        if (lead != 0) {
+            memmove(e->data + lead, e->data, e->length);
+            memset(e->data, fill, lead);
+            ctx->stats.gap_bytes += lead;
+        }
+        for (j = i + 1; j != ends[b]; j++) {
+            extent *n = extent_at(ctx->extents, j);
+            unsigned newLength = (unsigned) (n->addr + n->length - mb->addr);
+            memset(e->data + mb->length, fill, n->addr - mb->addr - mb->length);
+            ctx->stats.gap_bytes += n->addr - mb->addr - mb->length;
+            memcpy(e->data + n->addr - mb->addr, n->data, n->length);
+            mb->length = newLength;
+        }
+        if (ctx->pageSize != 0) {
+            memset(e->data + mb->length, fill, mb->fileLength - mb->length);
+            ctx->stats.gap_bytes += mb->fileLength - mb->length;
+            mb->length = mb->fileLength;
+        }
+        memset(e->data + mb->length, (unsigned char) (mb->fileLength - mb->length), mb->fileLength - mb->length);
+        ctx->stats.padding_bytes += mb->fileLength - mb->length;
+        mb->data = e->data;
+        e->data = NULL;
+        e->capacity = 0;
+        if (vec_add(ctx->blocks, mb) == VEC_NOMEM)
+            return fail(ctx, "Out of memory");
+    }
+    if (ctx->skipErased && splitErased(ctx) != 0)
+        return -1;
+    if ((ctx->oldFirmware != NULL || ctx->compress || ctx->pageTags) && splitLarge(ctx) != 0)
+        return -1;
+    if (ctx->oldFirmware != NULL && patchBlocks(ctx) != 0)
+        return -1;
+    if (ctx->compress && compressBlocks(ctx) != 0)
+        return -1;
+    if (ctx->pageTags)
+        tagBlocks(ctx);
+    ctx->stats.blocks = vec_size(ctx->blocks);
+    ctx->assembled = true;
+    ctx->pageBlock = ctx->pageIndex = 0;
+    if (ctx->timing)
+        lap(&mark, &ctx->stats.assemble);
+    return 0;
+}
+
+unsigned
+bgf_block_count(const bgf_context *ctx) {
+    return vec_size(ctx->blocks);
+}
+
+int
+bgf_block_info(const bgf_context *ctx, unsigned index, unsigned long *addr, unsigned *length) {
+    memblock *m1;
+
+    if (index >= vec_size(ctx->blocks))
+        return -1;
+    m1 = vec_elementAt(ctx->blocks, index);
+    *addr = m1->addr;
+    *length = m1->length;
+    return 0;
+}
+
+int
+bgf_block_erase_only(const bgf_context *ctx, unsigned index) {
+    memblock *m1 = vec_elementAt(ctx->blocks, index);
+
+    return m1 != NULL && (m1->flags & BLOCK_FLAG_ERASE) != 0;
+}
+
+int
+bgf_block_base_check(const bgf_context *ctx, unsigned index) {
+    memblock *m1 = vec_elementAt(ctx->blocks, index);
+
+    return m1 != NULL && (m1->flags & BLOCK_FLAG_BASE) != 0;
+}
+
+/**
+ * The number of pages of a block a loader can skip, and the address of the first. Only blocks whose
+ * data is sent as it is qualify, and every page of the block is the same distance from a cipher
+ * block boundary.
+ */
+static unsigned
+skippablePages(const memblock *mb, unsigned long *first) {
+    unsigned long end = mb->addr + mb->length;
+
+    if (mb->flags & (BLOCK_FLAG_ERASE | BLOCK_FLAG_BASE | BLOCK_FLAG_ENCODED))
+        return 0;
+    *first = (mb->addr + BGF_PAGE_SIZE - 1) & ~(unsigned long) (BGF_PAGE_SIZE - 1);
+    if ((*first - mb->addr) % BLOCK_SIZE != 0 || *first + BGF_PAGE_SIZE > end)
+        return 0;
+    return (unsigned) ((end - *first) / BGF_PAGE_SIZE);
+}
+
+int
+bgf_page_info(bgf_context *ctx, unsigned index, unsigned long *addr, unsigned char digest[BGF_DIGEST_LEN]) {
+    memblock *m1;
+    unsigned long first;
+    unsigned count, digest_len;
+
+    begin(ctx);
+    // indexes are usually asked for in order, so carry on from the block the last one was in
+    if (index < ctx->pageIndex)
+        ctx->pageBlock = ctx->pageIndex = 0;
+    for (; ctx->pageBlock < vec_size(ctx->blocks); ctx->pageBlock++) {
+        m1 = vec_elementAt(ctx->blocks, ctx->pageBlock);
+        count = skippablePages(m1, &first);
+        if (index - ctx->pageIndex < count) {
+            *addr = first + (unsigned long) (index - ctx->pageIndex) * BGF_PAGE_SIZE;
+            if (EVP_Digest(m1->data + (*addr - m1->addr), BGF_PAGE_SIZE, digest, &digest_len, EVP_sha256(),
+                           NULL) != 1)
+                return fail(ctx, "Sha digest failed");
+            return 0;
+        }
+        ctx->pageIndex += count;
+    }
+    return 1;
+}
+
+int
+bgf_estimate(const bgf_context *ctx, bgf_transfer *est) {
+    memblock *m1;
+    vec_cursor cur;
+    if (!ctx->assembled)
+        return -1;
+    est->bytes = 0;
+    est->round_trips = FIXED_ROUND_TRIPS;
+    VEC_FOREACH(ctx->blocks, m1, memblock *, cur) {
+        if (m1->flags & BLOCK_FLAG_ERASE) {
+            est->bytes += SHA_LEN;
+            est->round_trips += ERASE_ROUND_TRIPS;
+        } else if (m1->flags & BLOCK_FLAG_BASE) {
+            est->bytes += SHA_LEN;
+            est->round_trips += BASE_ROUND_TRIPS;
+        } else {
+            est->bytes += IV_LEN + m1->fileLength + SHA_LEN + tagCount(m1) * TAG_LEN;
+            est->round_trips += BLOCK_ROUND_TRIPS + (m1->flags & BLOCK_FLAG_TAGGED ? TAG_ROUND_TRIPS : 0);
+        }
+    }
+    est->seconds = (est->bytes + (double) ctx->blockCost * est->round_trips / BLOCK_ROUND_TRIPS) *
+                   ctx->byteCost / 1e6;
+    return 0;
+}
+
+unsigned long
+bgf_output_size(const bgf_context *ctx) {
+    memblock *m1;
+    vec_cursor cur;
+    unsigned long size = sizeof(firmware) + sizeof(block_header) * vec_size(ctx->blocks);
+
+    VEC_FOREACH(ctx->blocks, m1, memblock *, cur)size += m1->fileLength + tagCount(m1) * TAG_LEN;
+    return size;
+}
+
+/**
+ * Write part of an output.
+ */
+static int
+sinkWrite(bgf_context *ctx, const bgf_sink *sink, const void *data, size_t len, unsigned long offset) {
+    if (sink->write(sink->arg, data, len, offset) != 0)
+        return fail(ctx, "Write to output failed");
+    __sync_fetch_and_add(&ctx->stats.output_bytes, len);
+    return 0;
+}
+
+/**
+ * Start hashing and encrypting a job. In CTR mode the counter starts at the job's position in the
+ * block.
+ */
+static int
+cryptInit(bgf_context *ctx, crypt_job *job, EVP_CIPHER_CTX *cctx, EVP_MD_CTX *shaCtx) {
+    unsigned char iv[IV_LEN];
+    unsigned long count;
+    int i;
+
+    if (shaCtx != NULL && EVP_DigestInit_ex(shaCtx, EVP_sha256(), NULL) != 1)
+        return fail(ctx, "Sha digest init failed");
+    if (cctx == NULL)
+        return 0;
+    memcpy(iv, job->out->headers[job->index].init_vector, IV_LEN);
+    if (ctx->ctr) {
+        count = job->pos / BLOCK_SIZE;
+        for (i = IV_LEN - 1; i >= IV_LEN - CTR_COUNTER_LEN; i--) {
+            count += iv[i];
+            iv[i] = (unsigned char) count;
+            count >>= 8;
+        }
+    }
+    if (EVP_EncryptInit_ex(cctx, ctx->ctr ? EVP_aes_256_ctr() : EVP_aes_256_cbc(), NULL, job->out->key, iv) != 1)
+        return fail(ctx, "EncryptInit_ex failed");
+    return 0;
+}
+
+/**
+ * Encrypt one chunk of a block into outbuf.
+ */
+static int
+cryptChunk(bgf_context *ctx, EVP_CIPHER_CTX *cctx, const unsigned char *data, unsigned len, unsigned char *outbuf) {
+    int outlen;
+
+    if (EVP_EncryptUpdate(cctx, outbuf, &outlen, data, (int) len) != 1)
+        return fail(ctx, "EncryptUpdate failed");
+    if ((unsigned) outlen != len)
+        return fail(ctx, "Mismatched length after encryption - %d should be %u", outlen, len);
+    return 0;
+}
+
+/**
+ * The size of the chunk starting at pos in a job.
+ */
+static unsigned
+chunkLength(const crypt_job *job, unsigned pos) {
+    unsigned len = job->pos + job->len - pos;
+
+    return len > CRYPT_CHUNK ? CRYPT_CHUNK : len;
+}
+
+/**
+ * Derive an output's page tag keys from its firmware key, as pagetag.h describes: the CMAC key, and
+ * the subkey K1 that the last cipher block of a tagged page is masked with.
+ */
+static int
+tagKeys(bgf_context *ctx, output *out) {
+    EVP_CIPHER_CTX *cctx = EVP_CIPHER_CTX_new();
+    unsigned char l[BLOCK_SIZE];
+    int i, outlen, result = 0;
+
+    if (cctx == NULL)
+        return fail(ctx, "Failed to initialise cipher context");
+    memset(l, 0, sizeof l);
+    EVP_CIPHER_CTX_set_padding(cctx, 0);
+    if (EVP_EncryptInit_ex(cctx, EVP_aes_256_ecb(), NULL, out->key, NULL) != 1 ||
+        EVP_EncryptUpdate(cctx, out->tagKey, &outlen, (const unsigned char *) TAG_KEY_LABEL, KEY_LEN) != 1 ||
+        EVP_EncryptInit_ex(cctx, EVP_aes_256_ecb(), NULL, out->tagKey, NULL) != 1 ||
+        EVP_EncryptUpdate(cctx, l, &outlen, l, BLOCK_SIZE) != 1)
+        result = fail(ctx, "Page tag key derivation failed");
+    EVP_CIPHER_CTX_free(cctx);
+    for (i = 0; i != BLOCK_SIZE; i++)
+        out->tagSubkey[i] = (unsigned char) (l[i] << 1 | (i != BLOCK_SIZE - 1 ? l[i + 1] >> 7 : 0));
+    if (l[0] & 0x80)
+        out->tagSubkey[BLOCK_SIZE - 1] ^= 0x87;
+    return result;
+}
+
+/**
+ * Compute the tags for the pages of a block whose data starts in the part from pos to pos + len,
+ * and write them to the output after the block's data. The CBC-MAC runs through the cipher
+ * context, with buf, which holds at least a page, for the ciphertext it discards.
+ */
+static int
+tagPages(bgf_context *ctx, const crypt_job *job, EVP_CIPHER_CTX *cctx, unsigned pos, unsigned len,
+         unsigned char *buf) {
+    memblock *m1 = job->block;
+    unsigned i, start, end, count = tagCount(m1);
+    unsigned char block[BLOCK_SIZE], zero[BLOCK_SIZE];
+    int j, outlen;
+
+    memset(zero, 0, sizeof zero);
+    for (i = 0; i != count; i++) {
+        start = tagStart(m1, i);
+        if (start < pos || start >= pos + len)
+            continue;
+        end = i == count - 1 ? m1->fileLength : tagStart(m1, i + 1);
+        memset(block, 0, sizeof block);
+        put4(block, m1->addr + start);
+        put4(block + 4, end - start);
+        if (EVP_EncryptInit_ex(cctx, EVP_aes_256_cbc(), NULL, job->out->tagKey, zero) != 1 ||
+            EVP_EncryptUpdate(cctx, buf, &outlen, block, BLOCK_SIZE) != 1 ||
+            EVP_EncryptUpdate(cctx, buf, &outlen, m1->data + start, (int) (end - start - BLOCK_SIZE)) != 1)
+            return fail(ctx, "Page tag failed");
+        for (j = 0; j != BLOCK_SIZE; j++)
+            block[j] = m1->data[end - BLOCK_SIZE + j] ^ job->out->tagSubkey[j];
+        if (EVP_EncryptUpdate(cctx, buf, &outlen, block, BLOCK_SIZE) != 1)
+            return fail(ctx, "Page tag failed");
+        if (sinkWrite(ctx, &job->out->sink, buf, TAG_LEN, job->offset + m1->fileLength + i * TAG_LEN) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+/**
+ * Hash and/or encrypt one block in a single pass. Each chunk of plaintext is fed to the digest, then
+ * encrypted into the worker's chunk buffer and written straight to its place in the output.
+ * Blocks whose flash image differs from the data in the file, such as erase-only, encoded and base
+ * check blocks, have the image hashed first instead.
+ * A NULL context skips that step. If timings are wanted, each step is timed separately.
+ */
+static int
+cryptBlock(bgf_context *ctx, crypt_job *job, EVP_CIPHER_CTX *cctx, EVP_MD_CTX *shaCtx, unsigned char *outbuf,
+           worker_timing *wt) {
+    memblock *m1 = job->block;
+    unsigned pos, len;
+    unsigned int digest_len;
+    clock_mark mark;
+
+    if (wt != NULL)
+        markNow(&mark);
+    if (m1->image != NULL && shaCtx != NULL) {
+        if (EVP_Digest(m1->image, m1->length, ctx->digests[job->index], &digest_len, EVP_sha256(), NULL) != 1)
+            return fail(ctx, "SHA digest failed");
+        if (wt != NULL)
+            lap(&mark, &wt->digest);
+        shaCtx = NULL;
+    }
+    if (job->len == 0)
+        return 0;
+    if (cryptInit(ctx, job, cctx, shaCtx) != 0)
+        return -1;
+    for (pos = job->pos; pos != job->pos + job->len; pos += len) {
+        len = chunkLength(job, pos);
+        if (shaCtx != NULL) {
+            if (EVP_DigestUpdate(shaCtx, m1->data + pos, len) != 1)
+                return fail(ctx, "Sha digest update failed");
+            if (wt != NULL)
+                lap(&mark, &wt->digest);
+        }
+        if (cctx != NULL) {
+            if (cryptChunk(ctx, cctx, m1->data + pos, len, outbuf) != 0)
+                return -1;
+            if (wt != NULL)
+                lap(&mark, &wt->encrypt);
+            if (sinkWrite(ctx, &job->out->sink, outbuf, len, job->offset + pos) != 0)
+                return -1;
+            if (wt != NULL)
+                lap(&mark, &wt->output);
+        }
+    }
+    if (cctx != NULL && (m1->flags & BLOCK_FLAG_TAGGED)) {
+        if (tagPages(ctx, job, cctx, job->pos, job->len, outbuf) != 0)
+            return -1;
+        if (wt != NULL)
+            lap(&mark, &wt->encrypt);
+    }
+    if (shaCtx != NULL) {
+        if (EVP_DigestFinal_ex(shaCtx, ctx->digests[job->index], &digest_len) != 1 || digest_len != SHA_LEN)
+            return fail(ctx, "SHA digest final failed");
+        if (wt != NULL)
+            lap(&mark, &wt->digest);
+    }
+    return 0;
+}
+
+/**
+ * Worker thread body. Each worker has its own contexts and chunk buffer, and claims jobs until there
+ * are none left, or one has failed.
+ */
+static void *
+cryptWorker(void *arg) {
+    bgf_context *ctx = arg;
+    EVP_CIPHER_CTX *cctx = NULL;
+    EVP_MD_CTX *shaCtx = NULL;
+    unsigned char *outbuf = NULL;
+    unsigned i;
+    worker_timing wt;
+
+    memset(&wt, 0, sizeof wt);
+    if (ctx->mode & CRYPT_ENCRYPT) {
+        cctx = EVP_CIPHER_CTX_new();
+        outbuf = malloc(CRYPT_CHUNK);
+        if (cctx == NULL || outbuf == NULL)
+            fail(ctx, "Failed to initialise cipher context");
+        else
+            EVP_CIPHER_CTX_set_padding(cctx, 0);
+    }
+    if ((ctx->mode & CRYPT_HASH) && (shaCtx = EVP_MD_CTX_create()) == NULL)
+        fail(ctx, "Failed to initialise digest context");
+    while (!ctx->failed && (i = __sync_fetch_and_add(&ctx->nextJob, 1)) < ctx->numJobs)
+        if (cryptBlock(ctx, &ctx->jobs[i], cctx, shaCtx, outbuf, ctx->timing ? &wt : NULL) != 0)
+            break;
+    pthread_mutex_lock(&ctx->lock);
+    addTiming(&ctx->stats.digest, &wt.digest);
+    addTiming(&ctx->stats.encrypt, &wt.encrypt);
+    addTiming(&ctx->stats.output, &wt.output);
+    if (outbuf != NULL)
+        ctx->stats.allocations++;
+    pthread_mutex_unlock(&ctx->lock);
+    free(outbuf);
+    if (cctx != NULL)
+        EVP_CIPHER_CTX_free(cctx);
+    if (shaCtx != NULL)
+        EVP_MD_CTX_destroy(shaCtx);
+    return NULL;
+}
+
+/**
+ * Run all the queued crypt jobs on a pool of worker threads, and wait for them to finish.
+ */
+static int
+runCryptJobs(bgf_context *ctx, unsigned mode) {
+    unsigned i, n = ctx->numThreads;
+    pthread_t *threads;
+
+    if (n > ctx->numJobs)
+        n = ctx->numJobs;
+    ctx->nextJob = 0;
+    ctx->mode = mode;
+    if (n <= 1) {
+        cryptWorker(ctx);
+        return ctx->failed ? -1 : 0;
+    }
+    if ((threads = calloc(n, sizeof *threads)) == NULL)
+        return fail(ctx, "Out of memory");
+    for (i = 0; i != n; i++)
+        if (pthread_create(&threads[i], NULL, cryptWorker, ctx) != 0) {
+            fail(ctx, "Failed to create worker thread");
+            break;
+        }
+    while (i-- != 0)
+        pthread_join(threads[i], NULL);
+    free(threads);
+    return ctx->failed ? -1 : 0;
+}
+
+int
+bgf_digest(bgf_context *ctx) {
+    unsigned numBlocks = vec_size(ctx->blocks);
+    memblock *m1;
+    vec_cursor cur;
+    int result;
+
+    begin(ctx);
+    if (!ctx->assembled)
+        return fail(ctx, "No blocks assembled");
+    if (ctx->digests != NULL)
+        return 0;
+    ctx->digests = arena_alloc(ctx->arena, numBlocks * sizeof *ctx->digests);
+    ctx->jobs = alloc(ctx, numBlocks, sizeof *ctx->jobs);
+    if (ctx->digests == NULL || ctx->jobs == NULL) {
+        ctx->digests = NULL;
+        free(ctx->jobs);
+        ctx->jobs = NULL;
+        return fail(ctx, "Out of memory");
+    }
+    VEC_FOREACH(ctx->blocks, m1, memblock *, cur) {
+        ctx->jobs[vec_cursor_index(&cur)].block = m1;
+        ctx->jobs[vec_cursor_index(&cur)].index = vec_cursor_index(&cur);
+        ctx->jobs[vec_cursor_index(&cur)].pos = 0;
+        ctx->jobs[vec_cursor_index(&cur)].len = m1->fileLength;
+    }
+    ctx->numJobs = numBlocks;
+    result = runCryptJobs(ctx, CRYPT_HASH);
+    free(ctx->jobs);
+    ctx->jobs = NULL;
+    if (result != 0) {
+        ctx->digests = NULL;
+    }
+    return result;
+}
+
+/**
+ * Fill in the file header for an output, and the block headers apart from the digests.
+ * The block layout is the same for every output, but each gets its own random IVs.
+ */
+static int
+setupHeaders(bgf_context *ctx, output *out, const unsigned char *uuid, int major, int minor) {
+    memblock *m1;
+    vec_cursor cur;
+    unsigned numBlocks = vec_size(ctx->blocks);
+    unsigned long offset = sizeof(firmware) + sizeof(block_header) * numBlocks;
+
+    memset(&out->fw, 0, sizeof(out->fw));
+    memcpy(out->fw.service_uuid, uuid, UUID_LEN);
+    put4(out->fw.tag, FW_TAG);
+    put2(out->fw.major, (unsigned int) major);
+    put2(out->fw.minor, (unsigned int) minor);
+    put2(out->fw.numblocks, numBlocks);
+    out->fw.format[0] = ctx->ctr ? FW_FORMAT_CTR : FW_FORMAT_CBC;
+    if ((out->headers = alloc(ctx, numBlocks, sizeof *out->headers)) == NULL)
+        return fail(ctx, "Out of memory");
+    VEC_FOREACH(ctx->blocks, m1, memblock *, cur) {
+        block_header *header = &out->headers[vec_cursor_index(&cur)];
+        put4(header->addr, m1->addr);
+        put4(header->size, m1->length);
+        put4(header->offset, offset);
+        header->flags[0] = (unsigned char) m1->flags;
+        if (m1->flags & (BLOCK_FLAG_ERASE | BLOCK_FLAG_BASE))
+            continue;
+        if (ctx->ctr) {
+            // a random nonce, with the counter starting from zero so it never carries out of it
+            arc4random_buf(header->init_vector, IV_LEN - CTR_COUNTER_LEN);
+            memset(header->init_vector + IV_LEN - CTR_COUNTER_LEN, 0, CTR_COUNTER_LEN);
+        } else
+            arc4random_buf(header->init_vector, sizeof header->init_vector);
+        if (m1->flags & BLOCK_FLAG_ENCODED) {
+            // the pad bytes hold the pad length
+            header->padding[0] = m1->data[m1->fileLength - 1];
+            put2(header->units, m1->fileLength / BLOCK_SIZE);
+        } else
+            header->padding[0] = (unsigned char) (m1->fileLength - m1->length);
+        offset += m1->fileLength + tagCount(m1) * TAG_LEN;
+    }
+    return 0;
+}
+
+/**
+ * Queue one job per block of an output. If split, CTR blocks are queued a chunk per job instead,
+ * so a large block is spread over the workers.
+ */
+static void
+addCryptJobs(bgf_context *ctx, output *out, bool split) {
+    memblock *m1;
+    vec_cursor cur;
+    unsigned pos = 0;
+
+    VEC_FOREACH(ctx->blocks, m1, memblock *, cur) {
+        do {
+            crypt_job *job = &ctx->jobs[ctx->numJobs++];
+            job->block = m1;
+            job->out = out;
+            job->index = vec_cursor_index(&cur);
+            job->offset = get4(out->headers[job->index].offset);
+            job->pos = pos;
+            job->len = split && ctx->ctr && m1->fileLength - pos > CRYPT_CHUNK ? CRYPT_CHUNK : m1->fileLength - pos;
+            pos += job->len;
+        } while (pos != m1->fileLength);
+        pos = 0;
+    }
+}
+
+/**
+ * The most jobs addCryptJobs() may queue for an output.
+ */
+static unsigned
+maxCryptJobs(const bgf_context *ctx) {
+    memblock *m1;
+    vec_cursor cur;
+    unsigned n = 0;
+
+    VEC_FOREACH(ctx->blocks, m1, memblock *, cur) {
+        n += m1->fileLength > CRYPT_CHUNK ? (m1->fileLength + CRYPT_CHUNK - 1) / CRYPT_CHUNK : 1;
+    }
+    return n;
+}
+
+/**
+ * Copy the digests into an output's block headers, and write the headers at the start of the file.
+ */
+static int
+writeHeaders(bgf_context *ctx, output *out) {
+    unsigned i, numBlocks = vec_size(ctx->blocks);
+
+    for (i = 0; i != numBlocks; i++)
+        memcpy(out->headers[i].sha256, ctx->digests[i], SHA_LEN);
+    if (sinkWrite(ctx, &out->sink, &out->fw, sizeof out->fw, 0) != 0)
+        return -1;
+    return sinkWrite(ctx, &out->sink, out->headers, sizeof *out->headers * numBlocks, sizeof out->fw);
+}
+
+/**
+ * Encrypt blocks in order, streaming the ciphertext to an output that can't seek one chunk at a time.
+ */
+static int
+streamBlocks(bgf_context *ctx, output *out) {
+    EVP_CIPHER_CTX *cctx = EVP_CIPHER_CTX_new();
+    unsigned char outbuf[CRYPT_CHUNK];
+    unsigned pos, len;
+    crypt_job job;
+    vec_cursor cur;
+    int result = 0;
+    clock_mark mark;
+
+    if (cctx == NULL)
+        return fail(ctx, "Failed to initialise cipher context");
+    EVP_CIPHER_CTX_set_padding(cctx, 0);
+    if (ctx->timing)
+        markNow(&mark);
+    job.out = out;
+    VEC_FOREACH(ctx->blocks, job.block, memblock *, cur) {
+        job.index = vec_cursor_index(&cur);
+        if ((result = cryptInit(ctx, &job, cctx, NULL)) != 0)
+            break;
+        job.offset = get4(out->headers[job.index].offset);
+        job.pos = 0;
+        job.len = job.block->fileLength;
+        for (pos = 0; result == 0 && pos != job.block->fileLength; pos += len) {
+            len = chunkLength(&job, pos);
+            if ((result = cryptChunk(ctx, cctx, job.block->data + pos, len, outbuf)) != 0)
+                break;
+            if (ctx->timing)
+                lap(&mark, &ctx->stats.encrypt);
+            result = sinkWrite(ctx, &out->sink, outbuf, len, job.offset + pos);
+            if (ctx->timing)
+                lap(&mark, &ctx->stats.output);
+        }
+        if (result == 0 && (job.block->flags & BLOCK_FLAG_TAGGED))
+            result = tagPages(ctx, &job, cctx, 0, job.block->fileLength, outbuf);
+        if (result != 0)
+            break;
+    }
+    EVP_CIPHER_CTX_free(cctx);
+    return result;
+}
+
+/**
+ * Write a set of outputs. All the offsets are known once the headers are built.
+ * A single seekable output with no digests yet is hashed and encrypted in one pass, the workers
+ * writing ciphertext directly into place, and the headers are filled in last.
+ * Otherwise the digests are computed first (or reused), and the headers written; then every block of
+ * every seekable output is encrypted in parallel, CTR blocks a chunk at a time, and outputs that
+ * can't seek, such as pipes, are streamed in order. Either way the memory used for output is a chunk buffer per worker,
+ * regardless of the image size.
+ */
+static int
+writeOutputs(bgf_context *ctx, output *outs, unsigned count) {
+    unsigned i, numBlocks = vec_size(ctx->blocks);
+    int result = 0;
+    bool fused;
+
+    if (!ctx->assembled)
+        return fail(ctx, "No blocks assembled");
+    for (i = 0; ctx->pageTags && i != count; i++)
+        if (tagKeys(ctx, &outs[i]) != 0)
+            return -1;
+    // in CTR mode, an image of fewer blocks than workers is encrypted faster split up after hashing
+    fused = ctx->digests == NULL && count == 1 && outs[0].sink.seekable &&
+            (!ctx->ctr || numBlocks >= ctx->numThreads);
+    if (!fused && bgf_digest(ctx) != 0)
+        return -1;
+    ctx->jobs = alloc(ctx, (size_t) maxCryptJobs(ctx) * count, sizeof *ctx->jobs);
+    ctx->numJobs = 0;
+    if (ctx->jobs == NULL)
+        return fail(ctx, "Out of memory");
+    if (fused) {
+        if ((ctx->digests = arena_alloc(ctx->arena, numBlocks * sizeof *ctx->digests)) == NULL) {
+            free(ctx->jobs);
+            ctx->jobs = NULL;
+            return fail(ctx, "Out of memory");
+        }
+        addCryptJobs(ctx, &outs[0], false);
+        result = runCryptJobs(ctx, CRYPT_HASH | CRYPT_ENCRYPT);
+        if (result == 0)
+            result = writeHeaders(ctx, &outs[0]);
+        else
+            ctx->digests = NULL;
+    } else {
+        for (i = 0; result == 0 && i != count; i++) {
+            result = writeHeaders(ctx, &outs[i]);
+            if (outs[i].sink.seekable)
+                addCryptJobs(ctx, &outs[i], true);
+        }
+        if (result == 0)
+            result = runCryptJobs(ctx, CRYPT_ENCRYPT);
+        for (i = 0; result == 0 && i != count; i++)
+            if (!outs[i].sink.seekable)
+                result = streamBlocks(ctx, &outs[i]);
+    }
+    free(ctx->jobs);
+    ctx->jobs = NULL;
+    if (result == 0)
+        ctx->stats.files += count;
+    return result;
+}
+
+int
+bgf_write(bgf_context *ctx, const bgf_sink *sink) {
+    output out;
+    int result;
+
+    begin(ctx);
+    if (!ctx->assembled)
+        return fail(ctx, "No blocks assembled");
+    memset(&out, 0, sizeof out);
+    out.key = ctx->key;
+    out.sink = *sink;
+    if (setupHeaders(ctx, &out, ctx->uuid, ctx->major, ctx->minor) != 0)
+        return -1;
+    result = writeOutputs(ctx, &out, 1);
+    free(out.headers);
+    return result;
+}
+
+int
+bgf_write_variants(bgf_context *ctx, const bgf_variant *variants, unsigned count) {
+    output *outs;
+    unsigned i;
+    int result;
+
+    begin(ctx);
+    if (!ctx->assembled)
+        return fail(ctx, "No blocks assembled");
+    if (count == 0)
+        return 0;
+    if ((outs = alloc(ctx, count, sizeof *outs)) == NULL)
+        return fail(ctx, "Out of memory");
+    result = 0;
+    for (i = 0; result == 0 && i != count; i++) {
+        outs[i].key = variants[i].key;
+        outs[i].sink = variants[i].sink;
+        result = setupHeaders(ctx, &outs[i], variants[i].uuid, variants[i].major, variants[i].minor);
+    }
+    if (result == 0)
+        result = writeOutputs(ctx, outs, count);
+    for (i = 0; i != count; i++)
+        free(outs[i].headers);
+    free(outs);
+    return result;
+}
+
+/**
+ * Write data at a given offset in a file.
+ */
+static int
+fdWriteAt(void *arg, const void *data, size_t len, unsigned long offset) {
+    int fd = (int) (intptr_t) arg;
+    const unsigned char *p = data;
+
+    while (len != 0) {
+        ssize_t n = pwrite(fd, p, len, (off_t) offset);
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= (size_t) n;
+        offset += (unsigned long) n;
+    }
+    return 0;
+}
+
+/**
+ * Write data to a file that can't seek. It arrives in order, so the offset is not needed.
+ */
+static int
+fdWriteNext(void *arg, const void *data, size_t len, unsigned long offset) {
+    int fd = (int) (intptr_t) arg;
+    const unsigned char *p = data;
+
+    (void) offset;
+
+    while (len != 0) {
+        ssize_t n = write(fd, p, len);
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= (size_t) n;
+    }
+    return 0;
+}
+
+bgf_sink
+bgf_fd_sink(int fd) {
+    bgf_sink sink;
+
+    sink.arg = (void *) (intptr_t) fd;
+    sink.seekable = lseek(fd, 0L, SEEK_SET) == 0;
+    sink.write = sink.seekable ? fdWriteAt : fdWriteNext;
+    return sink;
+}
+
+int
+bgf_write_fd(bgf_context *ctx, int fd) {
+    bgf_sink sink = bgf_fd_sink(fd);
+
+    return bgf_write(ctx, &sink);
+}
+
+int
+bgf_write_file(bgf_context *ctx, const char *path) {
+    int fd, result;
+
+    if (strcmp(path, "-") == 0)
+        return bgf_write_fd(ctx, STDOUT_FILENO);
+    begin(ctx);
+    if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+        return fail(ctx, "Can't create output file %s", path);
+    result = bgf_write_fd(ctx, fd);
+    if (close(fd) != 0 && result == 0)
+        result = fail(ctx, "Write to %s failed", path);
+    return result;
+}
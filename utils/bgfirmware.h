@@ -0,0 +1,275 @@
+//
+// libbgfirmware - build encrypted firmware files for the bgbootload OTA bootloader.
+//
+// A context holds the settings and the image for one packaging job. Contexts are independent, so
+// a process may use several at once from different threads; a single context must only be used
+// by one thread at a time. Functions returning int return 0 on success, or -1 with a description
+// of the problem available from bgf_error(). Nothing in the library exits or prints.
+//
+// Typical use:
+//
+//      bgf_context *ctx = bgf_new();
+//      bgf_set_key(ctx, key);
+//      bgf_set_uuid(ctx, uuid);
+//      if (bgf_load_file(ctx, "app.elf") || bgf_assemble(ctx) || bgf_write_file(ctx, "app.fmw"))
+//          fprintf(stderr, "%s\n", bgf_error(ctx));
+//      bgf_free(ctx);
+//
+
+#ifndef UTILS_BGFIRMWARE_H
+#define UTILS_BGFIRMWARE_H
+
+#include <stddef.h>
+
+#define BGF_KEY_LEN     (256/8)     // length of the AES key
+#define BGF_UUID_LEN    16          // length of the bootloader service uuid
+#define BGF_BLOCK_COST  1024        // default command overhead of a block, in byte-equivalents
+#define BGF_BYTE_COST   58.6        // default transfer time per byte in microseconds
+#define BGF_PAGE_SIZE   0x800       // flash page size of the EFR32BG1B
+#define BGF_DIGEST_LEN  (256/8)     // length of a SHA256 digest
+
+typedef struct bgf_context bgf_context;
+
+/*
+ * Where a firmware file is written. write() is called with each piece of the file and its offset,
+ * and returns 0 on success. If the sink is seekable, pieces may arrive in any order and from
+ * several threads at once, so write() must be thread safe; otherwise they arrive in order from the
+ * calling thread.
+ */
+typedef struct {
+    int (*write)(void *arg, const void *data, size_t len, unsigned long offset);
+    void *arg;
+    int seekable;
+} bgf_sink;
+
+/*
+ * One output of a batch: a key, service uuid and version, and where to write the file.
+ */
+typedef struct {
+    unsigned char key[BGF_KEY_LEN];
+    unsigned char uuid[BGF_UUID_LEN];
+    int major, minor;
+    bgf_sink sink;
+} bgf_variant;
+
+/*
+ * Time spent in one stage of the pipeline, in microseconds. For stages run on the worker threads
+ * (digest, encrypt, output) the times are summed over the workers.
+ */
+typedef struct {
+    double wall_us;
+    double cpu_us;
+} bgf_timing;
+
+/*
+ * Counters and timings for the image in a context, accumulated since it was created or reset.
+ * Timings are only collected if enabled with bgf_set_stats(); the counters always are.
+ */
+typedef struct {
+    bgf_timing parse;           // loading input files
+    bgf_timing assemble;        // building blocks from the loaded data
+    bgf_timing digest;          // hashing block data
+    bgf_timing encrypt;         // encrypting block data
+    bgf_timing output;          // passing file contents to sinks
+    unsigned long inputs;       // files or buffers loaded
+    unsigned long input_bytes;  // size of the inputs
+    unsigned long records;      // hex records, or ELF segments, read
+    unsigned long data_bytes;   // bytes of image data loaded
+    unsigned long extents;      // contiguous runs of data before assembly
+    unsigned long blocks;       // blocks after assembly
+    unsigned long gap_bytes;    // fill added when coalescing extents into blocks, or aligning them to pages
+    unsigned long padding_bytes;    // cipher padding added to blocks
+    unsigned long erased_bytes; // bytes sent as erase-only blocks rather than data
+    unsigned long compressed_bytes; // bytes of block data saved by compression
+    unsigned long patched_bytes;    // bytes of block data saved by patching the old firmware
+    unsigned long allocations;  // heap allocations, counting each arena chunk once
+    unsigned long arena_bytes;  // bytes of the image held in the arena
+    unsigned long files;        // firmware files written
+    unsigned long output_bytes; // bytes passed to sinks
+} bgf_stats;
+
+/*
+ * Estimated cost of sending the assembled image to a device.
+ */
+typedef struct {
+    unsigned long bytes;        // block data, IVs and digests sent
+    unsigned long round_trips;  // control commands, each of which waits for the device
+    double seconds;             // estimated transfer time
+} bgf_transfer;
+
+/*
+ * Constructor and destructor.
+ */
+extern bgf_context *bgf_new(void);
+extern void bgf_free(bgf_context *);
+
+/*
+ * Discard the loaded image and blocks, keeping the settings, so the context can be reused.
+ */
+extern void bgf_reset(bgf_context *);
+
+/*
+ * Description of the last error.
+ */
+extern const char *bgf_error(const bgf_context *);
+
+/*
+ * Settings for single file output.
+ */
+extern void bgf_set_key(bgf_context *, const unsigned char key[BGF_KEY_LEN]);
+extern void bgf_set_uuid(bgf_context *, const unsigned char uuid[BGF_UUID_LEN]);
+extern void bgf_set_version(bgf_context *, int major, int minor);
+
+/*
+ * Convert a key from hex. Returns -1 if it is not the right length or not valid hex.
+ */
+extern int bgf_parse_key(unsigned char key[BGF_KEY_LEN], const char *hex);
+
+/*
+ * The number of worker threads used for hashing and encryption. The default is the number of CPUs.
+ */
+extern void bgf_set_threads(bgf_context *, unsigned);
+
+/*
+ * The cost model used to lay out blocks. Each block costs the device a round trip for each of its
+ * IV, DATA, DIGEST and final PING commands, given as the number of bytes that could have been sent
+ * in that time; each byte sent, including gap fill and padding, costs byteCost microseconds.
+ * Extents are merged into blocks wherever that lowers the total. The defaults, BGF_BLOCK_COST and
+ * BGF_BYTE_COST, assume two 64 byte packets per 7.5ms connection interval and two intervals per
+ * round trip. Takes effect at the next assembly.
+ */
+extern void bgf_set_cost(bgf_context *, unsigned long blockCost, double byteCost);
+
+/*
+ * Align blocks to flash pages of the given size, a power of 2, or 0 (the default) for no alignment.
+ * Each block then covers whole pages, with anything not loaded filled with 0xFF, so the device
+ * writes every page once and never needs to merge in existing flash contents. Takes effect at the
+ * next assembly.
+ */
+extern int bgf_set_page_size(bgf_context *, unsigned long size);
+
+/*
+ * Send whole flash pages of 0xFF as erase-only blocks, where that is cheaper by the cost model.
+ * The device erases them without receiving any data. The pages are BGF_PAGE_SIZE, or the page size
+ * set for alignment if that is larger, so erase blocks always cover whole flash pages.
+ * Files with erase-only blocks need a loader and bootloader that support them. Takes effect at the
+ * next assembly.
+ */
+extern void bgf_set_skip_erased(bgf_context *, int enable);
+
+/*
+ * Compress blocks with LZSS where that makes them smaller, so fewer bytes are sent. The device
+ * decrypts and decompresses each block as it arrives. Files with compressed blocks need a loader and
+ * bootloader that support them. Takes effect at the next assembly.
+ */
+extern void bgf_set_compress(bgf_context *, int enable);
+
+/*
+ * Encode blocks as patches against the old firmware on the device, where that makes them smaller.
+ * The patches copy what they can from the old firmware in flash, and carry the rest. base is a
+ * context with the old firmware loaded but not assembled; it must stay loaded until this context
+ * is assembled, and NULL turns patching off. The file then starts with base check blocks, which
+ * check that the parts of the old firmware the patches use are in flash before anything is written.
+ * Files with patches need a loader and bootloader that support them. Takes effect at the next
+ * assembly.
+ */
+extern void bgf_set_base(bgf_context *, const bgf_context *base);
+
+/*
+ * Encrypt with AES-256-CTR rather than CBC. Each block's IV is then a nonce, and any part of a
+ * block can be decrypted without the ciphertext before it, so large blocks are encrypted in
+ * parallel too. The file header records the mode; files using CTR need a loader and bootloader
+ * that support it. CBC is the default.
+ */
+extern void bgf_set_ctr(bgf_context *, int enable);
+
+/*
+ * Add a tag to each flash page of the blocks sent as plain data, so the bootloader can check a page
+ * before writing it, and have it sent again if it was corrupted. The tags, described in pagetag.h,
+ * follow each block's data in the file. Files with tags need a loader and bootloader that support
+ * them.
+ */
+extern void bgf_set_page_tags(bgf_context *, int enable);
+
+/*
+ * Enable or disable collection of stage timings, which costs a few system calls per chunk of data.
+ */
+extern void bgf_set_stats(bgf_context *, int enable);
+
+/*
+ * Get the counters and timings.
+ */
+extern void bgf_get_stats(const bgf_context *, bgf_stats *);
+
+/*
+ * Load data from a file or a memory buffer. ELF files are recognised by their magic number and
+ * loaded from their program headers; anything else is parsed as Intel hex. The name is used
+ * in error messages. Data from several loads is combined; overlapping data is an error.
+ */
+extern int bgf_load_file(bgf_context *, const char *path);
+extern int bgf_load_buffer(bgf_context *, const void *data, size_t len, const char *name);
+
+/*
+ * Build the blocks to be written from the loaded data. Must be called after loading and before
+ * writing.
+ */
+extern int bgf_assemble(bgf_context *);
+
+/*
+ * The assembled blocks.
+ */
+extern unsigned bgf_block_count(const bgf_context *);
+extern int bgf_block_info(const bgf_context *, unsigned index, unsigned long *addr, unsigned *length);
+extern int bgf_block_erase_only(const bgf_context *, unsigned index);
+extern int bgf_block_base_check(const bgf_context *, unsigned index);
+
+/*
+ * The pages of the assembled image that a loader can skip if the device already has them: each is
+ * a whole BGF_PAGE_SIZE flash page of a block that is neither erase-only, a base check, compressed
+ * nor patched, starting a whole number of cipher blocks into it, so it can be sent alone with the
+ * ciphertext before it as the IV, with or without page tags. Gets the address of the index'th such
+ * page and the SHA256 digest of what it holds after the update. Returns 1 if there are no more,
+ * and -1 if the digest can't be computed. Asking for the pages in order takes one pass over the
+ * blocks.
+ */
+extern int bgf_page_info(bgf_context *, unsigned index, unsigned long *addr,
+                         unsigned char digest[BGF_DIGEST_LEN]);
+
+/*
+ * Estimate the transfer of the assembled image using the cost model.
+ */
+extern int bgf_estimate(const bgf_context *, bgf_transfer *);
+
+/*
+ * The size of the firmware file that will be written.
+ */
+extern unsigned long bgf_output_size(const bgf_context *);
+
+/*
+ * Compute the block digests. This is done as needed by the write functions, and the results are
+ * kept for later writes, since they do not depend on the key.
+ */
+extern int bgf_digest(bgf_context *);
+
+/*
+ * Write a firmware file using the context's key, uuid and version.
+ */
+extern int bgf_write(bgf_context *, const bgf_sink *);
+
+/*
+ * Write a firmware file to a file descriptor or a named file ("-" is stdout).
+ */
+extern int bgf_write_fd(bgf_context *, int fd);
+extern int bgf_write_file(bgf_context *, const char *path);
+
+/*
+ * Write several firmware files from the same image, in parallel.
+ */
+extern int bgf_write_variants(bgf_context *, const bgf_variant *, unsigned count);
+
+/*
+ * A sink for a file descriptor. It is seekable if the descriptor is; writing starts at offset 0.
+ */
+extern bgf_sink bgf_fd_sink(int fd);
+
+#endif //UTILS_BGFIRMWARE_H
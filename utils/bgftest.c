@@ -0,0 +1,224 @@
+//
+// Tests of libbgfirmware: images are loaded from hex in memory, written to a memory sink, and each
+// block of the file is decrypted and checked against the image.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <openssl/evp.h>
+#include "bgfirmware.h"
+
+#define IMAGE_BASE      0x10000
+#define IMAGE_SIZE      0x8000
+#define FILE_HEADER     32
+#define BLOCK_HEADER    64
+#define BLOCK_FLAG_ERASE    0x01
+
+static const unsigned char key[BGF_KEY_LEN] = {1, 2, 3, 4, 5, 6, 7, 8};
+
+static int failures;
+
+static void
+check(const char *name, int ok, const char *what) {
+    if (!ok) {
+        fprintf(stderr, "%s: %s\n", name, what);
+        failures++;
+    }
+}
+
+// xorshift32, so the data is the same every run
+static unsigned char
+nextByte(unsigned *state) {
+    unsigned x = *state;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return (unsigned char) x;
+}
+
+/*
+ * An image with the bytes that are present, and the hex file for it.
+ */
+typedef struct {
+    unsigned char data[IMAGE_SIZE];
+    unsigned char present[IMAGE_SIZE];
+    char *hex;
+    size_t hexLen;
+} image;
+
+static void
+hexRecord(image *im, unsigned addr, unsigned type, const unsigned char *data, unsigned len) {
+    unsigned sum = len + (addr >> 8 & 0xFF) + (addr & 0xFF) + type, i;
+
+    im->hexLen += sprintf(im->hex + im->hexLen, ":%02X%04X%02X", len, addr & 0xFFFF, type);
+    for (i = 0; i != len; i++) {
+        im->hexLen += sprintf(im->hex + im->hexLen, "%02X", data[i]);
+        sum += data[i];
+    }
+    im->hexLen += sprintf(im->hex + im->hexLen, "%02X\n", -sum & 0xFF);
+}
+
+// build the hex file from the present bytes, 16 to a record
+static void
+makeHex(image *im) {
+    unsigned char upper[2] = {IMAGE_BASE >> 24 & 0xFF, IMAGE_BASE >> 16 & 0xFF};
+    unsigned pos = 0, len;
+
+    im->hex = malloc(IMAGE_SIZE * 3 + 64);
+    im->hexLen = 0;
+    hexRecord(im, 0, 4, upper, 2);
+    while (pos != IMAGE_SIZE) {
+        if (!im->present[pos]) {
+            pos++;
+            continue;
+        }
+        for (len = 0; len != 16 && pos + len != IMAGE_SIZE && im->present[pos + len]; len++)
+            ;
+        hexRecord(im, IMAGE_BASE + pos, 0, im->data + pos, len);
+        pos += len;
+    }
+    hexRecord(im, 0, 1, NULL, 0);
+}
+
+static void
+fill(image *im, unsigned from, unsigned to, int value, unsigned *seed) {
+    for (; from != to; from++) {
+        im->data[from] = (unsigned char) (value < 0 ? nextByte(seed) : value);
+        im->present[from] = 1;
+    }
+}
+
+/*
+ * A seekable sink into a buffer of the expected output size.
+ */
+typedef struct {
+    unsigned char *data;
+    unsigned long size;
+    int overrun;
+} buffer;
+
+static int
+bufferWrite(void *arg, const void *data, size_t len, unsigned long offset) {
+    buffer *bp = arg;
+
+    if (offset + len > bp->size) {
+        bp->overrun = 1;
+        return -1;
+    }
+    memcpy(bp->data + offset, data, len);
+    return 0;
+}
+
+static unsigned long
+get4(const unsigned char *p) {
+    return p[0] | p[1] << 8 | p[2] << 16 | (unsigned long) p[3] << 24;
+}
+
+/*
+ * Decrypt every block in a CBC format file and check it against the image.
+ */
+static void
+checkFile(const char *name, const image *im, const buffer *file) {
+    unsigned count = file->data[8] | file->data[9] << 8, i, j;
+    EVP_CIPHER_CTX *cctx = EVP_CIPHER_CTX_new();
+    unsigned char *plain = malloc(IMAGE_SIZE + 16);
+    int outlen;
+
+    for (i = 0; i != count; i++) {
+        const unsigned char *h = file->data + FILE_HEADER + i * BLOCK_HEADER;
+        unsigned long addr = get4(h), size = get4(h + 4), offset = get4(h + 8);
+        unsigned pad = h[12], flags = h[13], ok = 1;
+
+        if (addr < IMAGE_BASE || addr + size > IMAGE_BASE + IMAGE_SIZE) {
+            check(name, 0, "block outside the image");
+            continue;
+        }
+        if (flags & BLOCK_FLAG_ERASE) {
+            for (j = 0; j != size; j++)
+                ok &= !im->present[addr - IMAGE_BASE + j] || im->data[addr - IMAGE_BASE + j] == 0xFF;
+            check(name, ok, "erase-only block over data");
+            continue;
+        }
+        if (offset + size + pad > file->size || (size + pad) % 16 != 0 || pad > 16) {
+            check(name, 0, "bad block length or padding");
+            continue;
+        }
+        EVP_DecryptInit_ex(cctx, EVP_aes_256_cbc(), NULL, key, h + 16);
+        EVP_CIPHER_CTX_set_padding(cctx, 0);
+        EVP_DecryptUpdate(cctx, plain, &outlen, file->data + offset, (int) (size + pad));
+        for (j = 0; j != size; j++)
+            ok &= !im->present[addr - IMAGE_BASE + j] || plain[j] == im->data[addr - IMAGE_BASE + j];
+        for (j = 0; j != pad; j++)
+            ok &= plain[size + j] == pad;
+        check(name, ok, "block data or padding doesn't match");
+    }
+    EVP_CIPHER_CTX_free(cctx);
+    free(plain);
+}
+
+/*
+ * Assemble and write an image, then check the file. Returns the number of erase-only blocks.
+ */
+static unsigned
+writeImage(const char *name, image *im, int skipErased, unsigned long pageSize) {
+    bgf_context *ctx = bgf_new();
+    buffer file = {NULL, 0, 0};
+    unsigned erased = 0, i;
+
+    bgf_set_key(ctx, key);
+    bgf_set_skip_erased(ctx, skipErased);
+    if (bgf_set_page_size(ctx, pageSize) != 0 || bgf_load_buffer(ctx, im->hex, im->hexLen, name) != 0 ||
+        bgf_assemble(ctx) != 0) {
+        check(name, 0, bgf_error(ctx));
+    } else {
+        bgf_sink sink = {bufferWrite, &file, 1};
+
+        file.size = bgf_output_size(ctx);
+        file.data = calloc(file.size, 1);
+        if (bgf_write(ctx, &sink) != 0)
+            check(name, 0, bgf_error(ctx));
+        else
+            checkFile(name, im, &file);
+        check(name, !file.overrun, "write past the output size");
+        for (i = 0; i != bgf_block_count(ctx); i++)
+            erased += bgf_block_erase_only(ctx, i) != 0;
+        free(file.data);
+    }
+    bgf_free(ctx);
+    return erased;
+}
+
+int
+main(void) {
+    image *im = calloc(1, sizeof *im);
+    unsigned seed = 0x12345678;
+
+    // data that starts off a cipher block, then an erased run and more data, so the part after the
+    // run needs different padding than the block had
+    fill(im, 0x1004, 0x2000, -1, &seed);
+    fill(im, 0x2000, 0x4000, 0xFF, &seed);
+    fill(im, 0x4000, 0x4100, -1, &seed);
+    makeHex(im);
+    check("unaligned", writeImage("unaligned", im, 1, 0) == 1, "erased run not cut out");
+    writeImage("unaligned", im, 0, 0);
+    check("unaligned paged", writeImage("unaligned paged", im, 1, BGF_PAGE_SIZE) == 1,
+          "erased run not cut out");
+    free(im->hex);
+
+    // the same with a tail that is not a whole number of words
+    fill(im, 0x4100, 0x4107, -1, &seed);
+    makeHex(im);
+    check("odd tail", writeImage("odd tail", im, 1, 0) == 1, "erased run not cut out");
+    free(im->hex);
+
+    free(im);
+    if (failures != 0) {
+        fprintf(stderr, "%d failures\n", failures);
+        return 1;
+    }
+    printf("bgfirmware tests passed\n");
+    return 0;
+}
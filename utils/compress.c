@@ -0,0 +1,169 @@
+//
+// LZSS compression of firmware blocks, for the bootloader's streaming decoder.
+//
+// Matches are found greedily through hash chains on 3 byte prefixes, limited to the decoder's window.
+//
+
+#include <stdlib.h>
+#include <string.h>
+#include "compress.h"
+
+#define HASH_BITS       12
+#define HASH_SIZE       (1 << HASH_BITS)
+#define MAX_CHAIN       128         // candidates tried at each position
+#define NO_POS          (-1L)
+
+#define VERIFY_PACKET   64          // the decoder is fed as the device gets it, a packet at a time
+#define VERIFY_PAGE     0x800       // into a page buffer
+
+static unsigned
+hash3(const unsigned char *p) {
+    return ((p[0] << 8 ^ p[1] << 4 ^ p[2]) * 2654435761u) >> (32 - HASH_BITS) & (HASH_SIZE - 1);
+}
+
+/*
+ * Output state: items are added to the current group, whose flag byte is at flagPos.
+ */
+typedef struct {
+    unsigned char *out;
+    size_t len;
+    size_t maxLen;
+    size_t flagPos;
+    unsigned items;
+} encoder;
+
+static int
+startItem(encoder *enc, size_t size) {
+    if (enc->items == 8) {
+        if (enc->len == enc->maxLen)
+            return -1;
+        enc->flagPos = enc->len++;
+        enc->out[enc->flagPos] = 0;
+        enc->items = 0;
+    }
+    if (enc->len + size > enc->maxLen)
+        return -1;
+    return 0;
+}
+
+static int
+literal(encoder *enc, unsigned char c) {
+    if (startItem(enc, 1) != 0)
+        return -1;
+    enc->out[enc->flagPos] |= 1 << enc->items++;
+    enc->out[enc->len++] = c;
+    return 0;
+}
+
+static int
+match(encoder *enc, size_t dist, size_t length) {
+    if (startItem(enc, 2) != 0)
+        return -1;
+    enc->items++;
+    dist--;
+    enc->out[enc->len++] = (unsigned char) dist;
+    enc->out[enc->len++] = (unsigned char) ((dist >> 8) << 6 | (length - LZSS_MIN_MATCH));
+    return 0;
+}
+
+size_t
+lzss_compress(const unsigned char *in, size_t len, unsigned char *out, size_t maxLen) {
+    long *head, *prev;
+    encoder enc;
+    size_t pos = 0, i;
+    int result = 0;
+
+    if (maxLen < LZSS_HEADER_LEN || len > 0xFFFFFFFFUL)
+        return 0;
+    head = malloc(HASH_SIZE * sizeof *head);
+    prev = malloc(LZSS_WINDOW * sizeof *prev);
+    if (head == NULL || prev == NULL) {
+        free(head);
+        free(prev);
+        return 0;
+    }
+    for (i = 0; i != HASH_SIZE; i++)
+        head[i] = NO_POS;
+    enc.out = out;
+    enc.maxLen = maxLen;
+    enc.flagPos = 0;
+    enc.items = 8;
+    for (i = 0; i != LZSS_HEADER_LEN; i++)
+        out[i] = (unsigned char) (len >> (i * 8));
+    enc.len = LZSS_HEADER_LEN;
+    while (pos < len && result == 0) {
+        size_t bestLen = 0, bestDist = 0, limit = len - pos, step;
+        long cand;
+        unsigned chain = MAX_CHAIN;
+
+        if (limit > LZSS_MAX_MATCH)
+            limit = LZSS_MAX_MATCH;
+        if (limit >= LZSS_MIN_MATCH) {
+            for (cand = head[hash3(in + pos)]; cand != NO_POS && pos - cand <= LZSS_WINDOW && chain-- != 0;
+                 cand = prev[cand & (LZSS_WINDOW - 1)]) {
+                size_t l = 0;
+
+                while (l != limit && in[cand + l] == in[pos + l])
+                    l++;
+                if (l > bestLen) {
+                    bestLen = l;
+                    bestDist = pos - cand;
+                    if (l == limit)
+                        break;
+                }
+            }
+        }
+        if (bestLen >= LZSS_MIN_MATCH) {
+            result = match(&enc, bestDist, bestLen);
+            step = bestLen;
+        } else {
+            result = literal(&enc, in[pos]);
+            step = 1;
+        }
+        // every position passed over goes into the chains
+        while (step-- != 0) {
+            if (pos + LZSS_MIN_MATCH <= len) {
+                unsigned h = hash3(in + pos);
+                prev[pos & (LZSS_WINDOW - 1)] = head[h];
+                head[h] = (long) pos;
+            }
+            pos++;
+        }
+    }
+    free(head);
+    free(prev);
+    return result == 0 ? enc.len : 0;
+}
+
+int
+lzss_verify(const unsigned char *in, size_t inLen, const unsigned char *orig, size_t origLen) {
+    lzss_state *s = malloc(sizeof *s);
+    unsigned char page[VERIFY_PAGE];
+    size_t done = 0;
+    uint32_t used, n, fill = 0;
+    int result = 0;
+
+    if (s == NULL)
+        return -1;
+    lzss_init(s);
+    while (result == 0 && !lzss_done(s)) {
+        uint32_t inPiece = inLen > VERIFY_PACKET ? VERIFY_PACKET : (uint32_t) inLen;
+
+        n = lzss_decode(s, in, inPiece, &used, page + fill, VERIFY_PAGE - fill);
+        in += used;
+        inLen -= used;
+        if (n == 0 && used == 0)
+            result = -1;                    // ran out of input
+        else if (done + fill + n > origLen || memcmp(page + fill, orig + done + fill, n) != 0)
+            result = -1;
+        fill += n;
+        if (fill == VERIFY_PAGE) {
+            done += fill;
+            fill = 0;
+        }
+    }
+    if (done + fill != origLen)
+        result = -1;
+    free(s);
+    return result;
+}
@@ -0,0 +1,23 @@
+//
+// LZSS compression of firmware blocks, for the bootloader's streaming decoder.
+//
+
+#ifndef UTILS_COMPRESS_H
+#define UTILS_COMPRESS_H
+
+#include <stddef.h>
+#include "lzss.h"
+
+/*
+ * Compress len bytes into out, in the stream format described in lzss.h. Returns the compressed
+ * length, or 0 if it would be more than maxLen, in which case the contents of out are undefined.
+ */
+extern size_t lzss_compress(const unsigned char *in, size_t len, unsigned char *out, size_t maxLen);
+
+/*
+ * Decompress a stream with the bootloader's decoder and compare the result with the original.
+ * Returns 0 if they match.
+ */
+extern int lzss_verify(const unsigned char *in, size_t inLen, const unsigned char *orig, size_t origLen);
+
+#endif //UTILS_COMPRESS_H
@@ -0,0 +1,432 @@
+//
+// Delta encoding of firmware blocks against the firmware already on the device.
+//
+// Every position in the old firmware is indexed by a hash of the 8 bytes starting there. At each
+// position in a new block, copies are tried first from where the last copy left off, then from
+// the same address, then from the hash chain; the longest that the device can still read is
+// taken if it is long enough to be worth a copy operation, otherwise the byte goes in a literal.
+//
+
+#include <stdlib.h>
+#include <string.h>
+#include "delta.h"
+
+#define GRAM            8           // bytes hashed at each position, and the shortest copy used
+#define HASH_BITS       16
+#define HASH_SIZE       (1 << HASH_BITS)
+#define MAX_CHAIN       32          // hash chain candidates tried at each position
+#define NO_POS          0xFFFFFFFFu
+
+#define VERIFY_PACKET   64          // the patch is applied as the device gets it, a packet at a time
+#define VERIFY_PAGE     0x800       // into a page buffer
+
+typedef struct {
+    unsigned long addr;
+    const unsigned char *data;
+    unsigned length;
+    unsigned start;                 // position of the first byte in the index
+    unsigned long usedFrom;         // range copied from by the patches kept
+    unsigned long usedTo;
+    unsigned long newFrom;          // range copied from by the last patch encoded
+    unsigned long newTo;
+} region;
+
+typedef struct {
+    unsigned long from;
+    unsigned long to;
+} range;
+
+struct delta_base {
+    region *regions;
+    unsigned numRegions;
+    range *excluded;                // flash already overwritten, in page units
+    unsigned numExcluded;
+    unsigned long pageSize;
+    unsigned *head;                 // the index, built on first use
+    unsigned *next;
+    unsigned total;                 // bytes indexed
+    int bad;                        // a patch being verified read something it shouldn't
+};
+
+static void *
+grow(void *p, unsigned n, size_t size) {
+    // grow by doubling, whenever n reaches a power of 2
+    if (n == 0 || (n & (n - 1)) == 0) {
+        p = realloc(p, (n == 0 ? 1 : n * 2) * size);
+        if (p == NULL)
+            abort();
+    }
+    return p;
+}
+
+static unsigned
+hashGram(const unsigned char *p) {
+    unsigned long long v = 0;
+    unsigned i;
+
+    for (i = 0; i != GRAM; i++)
+        v = v << 8 | p[i];
+    return (unsigned) ((v * 0x9E3779B97F4A7C15ULL) >> (64 - HASH_BITS));
+}
+
+delta_base *
+delta_new(void) {
+    delta_base *base = calloc(1, sizeof *base);
+
+    if (base != NULL)
+        base->pageSize = VERIFY_PAGE;
+    return base;
+}
+
+void
+delta_free(delta_base *base) {
+    if (base == NULL)
+        return;
+    free(base->regions);
+    free(base->excluded);
+    free(base->head);
+    free(base->next);
+    free(base);
+}
+
+void
+delta_add(delta_base *base, unsigned long addr, const unsigned char *data, unsigned len) {
+    region *r;
+
+    base->regions = grow(base->regions, base->numRegions, sizeof *base->regions);
+    r = &base->regions[base->numRegions++];
+    r->addr = addr;
+    r->data = data;
+    r->length = len;
+    r->start = base->total;
+    r->usedFrom = r->usedTo = 0;
+    r->newFrom = r->newTo = 0;
+    base->total += len;
+}
+
+void
+delta_set_page_size(delta_base *base, unsigned long pageSize) {
+    base->pageSize = pageSize;
+}
+
+void
+delta_exclude(delta_base *base, unsigned long from, unsigned long to) {
+    range *r;
+
+    base->excluded = grow(base->excluded, base->numExcluded, sizeof *base->excluded);
+    r = &base->excluded[base->numExcluded++];
+    r->from = from & ~(base->pageSize - 1);
+    r->to = (to + base->pageSize - 1) & ~(base->pageSize - 1);
+}
+
+/**
+ * Build the hash chains, in address order so each chain runs from the highest position down.
+ */
+static void
+buildIndex(delta_base *base) {
+    unsigned i, j, h;
+
+    base->head = malloc(HASH_SIZE * sizeof *base->head);
+    base->next = malloc((base->total + 1) * sizeof *base->next);
+    if (base->head == NULL || base->next == NULL)
+        abort();
+    for (i = 0; i != HASH_SIZE; i++)
+        base->head[i] = NO_POS;
+    for (i = 0; i != base->numRegions; i++) {
+        region *r = &base->regions[i];
+
+        for (j = 0; j + GRAM <= r->length; j++) {
+            h = hashGram(r->data + j);
+            base->next[r->start + j] = base->head[h];
+            base->head[h] = r->start + j;
+        }
+    }
+}
+
+/**
+ * Find the region holding an address, or NULL.
+ */
+static region *
+findAddr(const delta_base *base, unsigned long addr) {
+    unsigned lo = 0, hi = base->numRegions;
+
+    while (lo != hi) {
+        unsigned mid = (lo + hi) / 2;
+        region *r = &base->regions[mid];
+
+        if (addr < r->addr)
+            hi = mid;
+        else if (addr >= r->addr + r->length)
+            lo = mid + 1;
+        else
+            return r;
+    }
+    return NULL;
+}
+
+/**
+ * Find the region holding an index position.
+ */
+static region *
+findPos(const delta_base *base, unsigned pos) {
+    unsigned lo = 0, hi = base->numRegions;
+
+    while (hi - lo > 1) {
+        unsigned mid = (lo + hi) / 2;
+
+        if (pos < base->regions[mid].start)
+            hi = mid;
+        else
+            lo = mid;
+    }
+    return &base->regions[lo];
+}
+
+/**
+ * How many bytes from src can be copied to dst. The source must be in the old firmware, clear of
+ * the flash earlier blocks have overwritten, and clear of the pages of this block, starting at
+ * first, that the device has written by the time the copy ends.
+ */
+static size_t
+copyLimit(const delta_base *base, unsigned long src, unsigned long dst, unsigned long first, size_t limit) {
+    unsigned long page = base->pageSize;
+    region *r = findAddr(base, src);
+    unsigned i;
+
+    if (r == NULL)
+        return 0;
+    if (limit > r->addr + r->length - src)
+        limit = r->addr + r->length - src;
+    for (i = 0; i != base->numExcluded; i++) {
+        const range *x = &base->excluded[i];
+
+        if (src >= x->from && src < x->to)
+            return 0;
+        if (src < x->from && limit > x->from - src)
+            limit = x->from - src;
+    }
+    // this block's pages are written as the output passes the end of each one
+    if (src >= first) {
+        if (src < (dst & ~(page - 1)))
+            return 0;
+        if (limit > (src & ~(page - 1)) + page - dst)
+            limit = (src & ~(page - 1)) + page - dst;
+    } else {
+        // clear of this block's pages, or done before the first of them is written
+        size_t before = first - src, unwritten = dst < first + page ? first + page - dst : 0;
+
+        if (limit > before && limit > unwritten)
+            limit = before > unwritten ? before : unwritten;
+    }
+    return limit;
+}
+
+/**
+ * Add a range to a region's record of what is copied from.
+ */
+static void
+markUsed(unsigned long *from, unsigned long *to, unsigned long start, unsigned long end) {
+    if (*from == *to || start < *from)
+        *from = start;
+    if (end > *to)
+        *to = end;
+}
+
+/**
+ * The length of the match between the old firmware at src and the new data, up to limit.
+ */
+static size_t
+matchLength(const delta_base *base, unsigned long src, const unsigned char *in, size_t limit) {
+    region *r = findAddr(base, src);
+    const unsigned char *p;
+    size_t l = 0;
+
+    if (r == NULL)
+        return 0;
+    if (limit > r->addr + r->length - src)
+        limit = r->addr + r->length - src;
+    p = r->data + (src - r->addr);
+    while (l != limit && p[l] == in[l])
+        l++;
+    return l;
+}
+
+/*
+ * The patch being written, and the literal run waiting to go into it.
+ */
+typedef struct {
+    unsigned char *out;
+    size_t len;
+    size_t maxLen;
+    const unsigned char *literal;
+    size_t literalLen;
+} patch_out;
+
+static int
+flushLiteral(patch_out *po) {
+    while (po->literalLen != 0) {
+        size_t n = po->literalLen > PATCH_MAX_LITERAL ? PATCH_MAX_LITERAL : po->literalLen;
+
+        if (po->len + n + 1 > po->maxLen)
+            return -1;
+        po->out[po->len++] = (unsigned char) (n - 1);
+        memcpy(po->out + po->len, po->literal, n);
+        po->len += n;
+        po->literal += n;
+        po->literalLen -= n;
+    }
+    return 0;
+}
+
+static int
+putCopy(patch_out *po, unsigned long src, size_t length) {
+    unsigned i;
+
+    if (flushLiteral(po) != 0 || po->len + PATCH_COPY_LEN > po->maxLen)
+        return -1;
+    po->out[po->len++] = PATCH_OP_COPY;
+    for (i = 0; i != 4; i++)
+        po->out[po->len++] = (unsigned char) (src >> (i * 8));
+    po->out[po->len++] = (unsigned char) (length - 1);
+    po->out[po->len++] = (unsigned char) ((length - 1) >> 8);
+    return 0;
+}
+
+size_t
+delta_encode(delta_base *base, unsigned long addr, const unsigned char *in, size_t len,
+             unsigned char *out, size_t maxLen) {
+    unsigned long first = addr & ~(base->pageSize - 1);
+    unsigned long shift = 0;            // dst - src of the last copy
+    size_t pos = 0;
+    patch_out po;
+    unsigned i;
+
+    if (maxLen < PATCH_HEADER_LEN || len > 0xFFFFFFFFUL || base->numRegions == 0)
+        return 0;
+    if (base->head == NULL)
+        buildIndex(base);
+    for (i = 0; i != base->numRegions; i++)
+        base->regions[i].newFrom = base->regions[i].newTo = 0;
+    for (i = 0; i != PATCH_HEADER_LEN; i++)
+        out[i] = (unsigned char) (len >> (i * 8));
+    po.out = out;
+    po.len = PATCH_HEADER_LEN;
+    po.maxLen = maxLen;
+    po.literal = in;
+    po.literalLen = 0;
+    while (pos != len) {
+        unsigned long dst = addr + pos, bestSrc = 0, cand[2];
+        size_t bestLen = 0, limit = len - pos, l;
+        unsigned p, chain = MAX_CHAIN;
+
+        if (limit > PATCH_MAX_COPY)
+            limit = PATCH_MAX_COPY;
+        if (limit >= GRAM) {
+            cand[0] = dst - shift;
+            cand[1] = dst;
+            for (i = 0; i != 2; i++) {
+                if ((l = matchLength(base, cand[i], in + pos, limit)) > bestLen &&
+                    (l = copyLimit(base, cand[i], dst, first, l)) > bestLen) {
+                    bestLen = l;
+                    bestSrc = cand[i];
+                }
+            }
+            for (p = base->head[hashGram(in + pos)]; p != NO_POS && bestLen != limit && chain-- != 0;
+                 p = base->next[p]) {
+                region *r = findPos(base, p);
+                unsigned long src = r->addr + (p - r->start);
+
+                if ((l = matchLength(base, src, in + pos, limit)) > bestLen &&
+                    (l = copyLimit(base, src, dst, first, l)) > bestLen) {
+                    bestLen = l;
+                    bestSrc = src;
+                }
+            }
+        }
+        if (bestLen >= GRAM) {
+            region *r = findAddr(base, bestSrc);
+
+            if (putCopy(&po, bestSrc, bestLen) != 0)
+                return 0;
+            markUsed(&r->newFrom, &r->newTo, bestSrc, bestSrc + bestLen);
+            shift = dst - bestSrc;
+            pos += bestLen;
+            po.literal = in + pos;
+        } else {
+            po.literalLen++;
+            pos++;
+        }
+    }
+    if (flushLiteral(&po) != 0)
+        return 0;
+    return po.len;
+}
+
+static void
+readBase(void *arg, uint32_t addr, uint8_t *buf, uint32_t len) {
+    delta_base *base = arg;
+    region *r = findAddr(base, addr);
+
+    if (r == NULL || addr + len > r->addr + r->length) {
+        base->bad = 1;
+        memset(buf, 0, len);
+        return;
+    }
+    memcpy(buf, r->data + (addr - r->addr), len);
+}
+
+int
+delta_verify(delta_base *base, const unsigned char *patch, size_t patchLen, const unsigned char *orig,
+             size_t origLen) {
+    patch_state s;
+    unsigned char page[VERIFY_PAGE];
+    size_t done = 0;
+    uint32_t used, n, fill = 0;
+    int result = 0;
+
+    base->bad = 0;
+    patch_init(&s, readBase, base);
+    while (result == 0 && !patch_done(&s)) {
+        uint32_t inPiece = patchLen > VERIFY_PACKET ? VERIFY_PACKET : (uint32_t) patchLen;
+
+        n = patch_apply(&s, patch, inPiece, &used, page + fill, VERIFY_PAGE - fill);
+        patch += used;
+        patchLen -= used;
+        if (n == 0 && used == 0)
+            result = -1;                    // ran out of input
+        else if (done + fill + n > origLen || memcmp(page + fill, orig + done + fill, n) != 0)
+            result = -1;
+        fill += n;
+        if (fill == VERIFY_PAGE) {
+            done += fill;
+            fill = 0;
+        }
+    }
+    if (done + fill != origLen || base->bad)
+        result = -1;
+    return result;
+}
+
+void
+delta_keep(delta_base *base) {
+    unsigned i;
+
+    for (i = 0; i != base->numRegions; i++) {
+        region *r = &base->regions[i];
+
+        if (r->newFrom != r->newTo)
+            markUsed(&r->usedFrom, &r->usedTo, r->newFrom, r->newTo);
+    }
+}
+
+int
+delta_used(const delta_base *base, unsigned index, unsigned long *from, unsigned long *to) {
+    const region *r;
+
+    if (index >= base->numRegions)
+        return 0;
+    r = &base->regions[index];
+    *from = r->usedFrom;
+    *to = r->usedTo;
+    return r->usedFrom != r->usedTo;
+}
@@ -0,0 +1,60 @@
+//
+// Delta encoding of firmware blocks against the firmware already on the device.
+//
+
+#ifndef UTILS_DELTA_H
+#define UTILS_DELTA_H
+
+#include <stddef.h>
+#include "patch.h"
+
+/*
+ * The old firmware, as a set of regions whose contents in flash are known, indexed for finding
+ * matches. As blocks are written the device overwrites parts of it, which can then no longer be
+ * copied from.
+ */
+typedef struct delta_base delta_base;
+
+/*
+ * Constructor and destructor. Regions must be added in address order, and not overlap. The data
+ * is not copied, so it must stay valid until the base is freed.
+ */
+extern delta_base *delta_new(void);
+extern void delta_free(delta_base *);
+extern void delta_add(delta_base *, unsigned long addr, const unsigned char *data, unsigned len);
+
+/*
+ * Mark a range of flash as overwritten by an earlier block. pageSize is the size of the device's
+ * flash pages, which it writes whole.
+ */
+extern void delta_exclude(delta_base *, unsigned long from, unsigned long to);
+extern void delta_set_page_size(delta_base *, unsigned long pageSize);
+
+/*
+ * Encode a block of len bytes to be written at addr as a patch, in the format described in
+ * patch.h. Copies never read flash that an earlier block, or this one, has overwritten by the time
+ * the device gets to them. Returns the patch length, or 0 if it would be more than maxLen.
+ */
+extern size_t delta_encode(delta_base *, unsigned long addr, const unsigned char *in, size_t len,
+                           unsigned char *out, size_t maxLen);
+
+/*
+ * Record that the last patch encoded is to be used, so what it copies from is included in
+ * delta_used().
+ */
+extern void delta_keep(delta_base *);
+
+/*
+ * Apply a patch with the bootloader's code and compare the result with the original. Returns 0 if
+ * they match.
+ */
+extern int delta_verify(delta_base *, const unsigned char *patch, size_t patchLen, const unsigned char *orig,
+                        size_t origLen);
+
+/*
+ * The part of a region, by index in the order added, that the patches kept copy from.
+ * Returns 0 if none of it is used.
+ */
+extern int delta_used(const delta_base *, unsigned index, unsigned long *from, unsigned long *to);
+
+#endif //UTILS_DELTA_H
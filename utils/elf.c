@@ -2,4 +2,50 @@
 // Created by Clyde Stubbs on 4/4/17.
 //
 
+#include <string.h>
 #include "elf.h"
+
+static unsigned get2(const uint8 *p) {
+    return p[0] + (p[1] << 8);
+}
+
+static unsigned long get4(const uint8 *p) {
+    return p[0] + (p[1] << 8) + ((unsigned long) p[2] << 16) + ((unsigned long) p[3] << 24);
+}
+
+int elf_is_elf(const unsigned char *image, size_t len) {
+    return len >= 4 && memcmp(image, ELF_MAGIC, 4) == 0;
+}
+
+const char *elf_load(const unsigned char *image, size_t len,
+                     int (*add)(void *arg, unsigned long addr, unsigned int cnt, const unsigned char *data),
+                     void *arg) {
+    const elf_file_header *fh = (const elf_file_header *) image;
+    unsigned long phoff;
+    unsigned phnum, phentsize, i;
+
+    if (len < sizeof(elf_file_header) || !elf_is_elf(image, len))
+        return "Not an ELF file";
+    if (fh->wordsize != ELF_CLASS32 || fh->endianness != ELF_LITTLE)
+        return "Only 32 bit little endian ELF files are supported";
+    phoff = get4(fh->phoff);
+    phnum = get2(fh->phnum);
+    phentsize = get2(fh->phentsize);
+    if (phnum == 0)
+        return "No program headers";
+    if (phentsize < sizeof(elf_program_header) || phoff > len || (len - phoff) / phentsize < phnum)
+        return "Program header table is outside the file";
+    for (i = 0; i != phnum; i++) {
+        const elf_program_header *ph = (const elf_program_header *) (image + phoff + i * phentsize);
+        unsigned long offset = get4(ph->offset);
+        unsigned long filesz = get4(ph->filesz);
+
+        if (get4(ph->type) != ELF_PT_LOAD || filesz == 0)
+            continue;
+        if (offset > len || len - offset < filesz)
+            return "Segment data is outside the file";
+        if (add(arg, get4(ph->paddr), (unsigned int) filesz, image + offset) != 0)
+            return "Segment could not be loaded";
+    }
+    return NULL;
+}
@@ -5,6 +5,15 @@
 #ifndef UTILS_ELF_H
 #define UTILS_ELF_H
 
+#include <stddef.h>
+
+typedef unsigned char uint8;
+
+#define ELF_MAGIC       "\177ELF"
+#define ELF_CLASS32     1           // wordsize for 32 bit files
+#define ELF_LITTLE      1           // endianness for little endian files
+#define ELF_PT_LOAD     1           // program header type for loadable segments
+
 typedef struct {
     uint8 magic[4];
     uint8 wordsize;        // 1 = 32bit, 2 = 64 bit
@@ -39,4 +48,24 @@ typedef struct {
     uint8 flags[4];
     uint8 align[4];
 }   elf_program_header;
+
+/**
+ * Does this data start with an ELF header?
+ */
+extern int elf_is_elf(const unsigned char *image, size_t len);
+
+/**
+ * Walk the PT_LOAD segments of a 32 bit little endian ELF file and pass the file contents of each
+ * one to a callback, at its physical (load) address. Segments with no file contents are skipped.
+ *
+ * @param image     The ELF file contents
+ * @param len       The length of the file
+ * @param add       Called once for each loadable segment, with arg. Returns 0 to continue, or nonzero to stop
+ * @param arg       Passed to add
+ * @return          NULL on success, or a description of the problem with the file
+ */
+extern const char *elf_load(const unsigned char *image, size_t len,
+                            int (*add)(void *arg, unsigned long addr, unsigned int cnt, const unsigned char *data),
+                            void *arg);
+
 #endif //UTILS_ELF_H
@@ -0,0 +1,192 @@
+//
+// Extent map - the loaded image as a sorted set of contiguous address ranges.
+//
+// Records normally arrive in ascending address order, so the common case is appending to the
+// extent written last; that is checked before falling back to a binary search.
+// With an arena, the extent being appended to is usually the most recent allocation, so it grows
+// in place without copying.
+//
+
+#include <stdlib.h>
+#include <string.h>
+#include "extent.h"
+#include "arena.h"
+
+#define MIN_EXTENT_CAPACITY 4096
+#define EXTENT_SLACK        16      // spare bytes kept at the end of an extent, so it can be padded in place
+
+extent_map extent_new(arena_t arena) {
+    extent_map map;
+
+    if (arena != NULL) {
+        if ((map = arena_alloc(arena, sizeof *map)) == NULL || (map->extents = vec_new_arena(arena)) == NULL)
+            return NULL;
+        map->arena = arena;
+        return map;
+    }
+    if ((map = calloc(1, sizeof *map)) == NULL)
+        return NULL;
+    if ((map->extents = vec_new()) == NULL) {
+        free(map);
+        return NULL;
+    }
+    return map;
+}
+
+void extent_destroy(extent_map map) {
+    extent *e;
+
+    if (map == NULL || map->arena != NULL)
+        return;
+    VEC_ITERATE(map->extents, e, extent *) {
+        free(e->data);
+        free(e);
+    }
+    vec_destroy(map->extents);
+    free(map);
+}
+
+/*
+ * Grow an extent whose storage is in an arena. The latest allocation grows in place by just what
+ * is needed; anything else moves to a new buffer, with room to grow.
+ */
+static int arena_grow(extent_map map, extent *e, unsigned size) {
+    unsigned newsize = e->capacity;
+    unsigned char *data;
+
+    if (size <= e->capacity)
+        return 0;
+    if (arena_extend(map->arena, e->data, size)) {
+        e->capacity = size;
+        return 0;
+    }
+    if (newsize == 0)
+        newsize = size;
+    while (newsize < size)
+        newsize *= 2;
+    if ((data = arena_alloc(map->arena, newsize)) == NULL)
+        return -1;
+    if (e->capacity != 0)
+        memcpy(data, e->data, e->capacity);
+    e->data = data;
+    e->capacity = newsize;
+    return 0;
+}
+
+int extent_grow(extent_map map, extent *e, unsigned size) {
+    unsigned newsize = e->capacity;
+    unsigned char *data;
+
+    if (map->arena != NULL)
+        return arena_grow(map, e, size);
+    if (size <= e->capacity)
+        return 0;
+    if (newsize < MIN_EXTENT_CAPACITY)
+        newsize = MIN_EXTENT_CAPACITY;
+    while (newsize < size)
+        newsize *= 2;
+    if ((data = realloc(e->data, newsize)) == NULL)
+        return -1;
+    e->data = data;
+    e->capacity = newsize;
+    map->allocations++;
+    return 0;
+}
+
+/*
+ * Find the index of the last extent starting at or below addr, or -1 if there is none.
+ */
+static int find(extent_map map, unsigned long addr) {
+    unsigned cnt = vec_size(map->extents);
+    extent *e;
+    int lo, hi;
+
+    if (map->hint < cnt) {
+        e = vec_elementAt(map->extents, map->hint);
+        if (e->addr <= addr) {
+            extent *n = vec_elementAt(map->extents, map->hint + 1);
+            if (n == NULL || n->addr > addr)
+                return map->hint;
+        }
+    }
+    lo = 0;
+    hi = (int) cnt - 1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        e = vec_elementAt(map->extents, (unsigned) mid);
+        if (e->addr <= addr)
+            lo = mid + 1;
+        else
+            hi = mid - 1;
+    }
+    return hi;
+}
+
+int extent_reserve(extent_map map, unsigned long addr, unsigned len, unsigned char **dst) {
+    int i = find(map, addr);
+    extent *e = i < 0 ? NULL : vec_elementAt(map->extents, (unsigned) i);
+    extent *n = vec_elementAt(map->extents, (unsigned) (i + 1));
+
+    if (e != NULL && addr < e->addr + e->length)
+        return EXTENT_OVERLAP;
+    if (n != NULL && addr + len > n->addr)
+        return EXTENT_OVERLAP;
+    if (e != NULL && addr == e->addr + e->length) {
+        // append, and absorb the next extent if this closes the gap
+        unsigned newlen = e->length + len;
+        if (n != NULL && addr + len == n->addr) {
+            if (extent_grow(map, e, newlen + n->length + EXTENT_SLACK) != 0)
+                return -1;
+            memcpy(e->data + newlen, n->data, n->length);
+            e->length = newlen + n->length;
+            if (map->arena == NULL) {
+                free(n->data);
+                free(n);
+            }
+            vec_removeAt(map->extents, (unsigned) (i + 1));
+        } else {
+            if (extent_grow(map, e, newlen + EXTENT_SLACK) != 0)
+                return -1;
+            e->length = newlen;
+        }
+        map->hint = (unsigned) i;
+        *dst = e->data + (addr - e->addr);
+        return 0;
+    }
+    if (n != NULL && addr + len == n->addr) {
+        // prepend to the following extent
+        if (extent_grow(map, n, n->length + len + EXTENT_SLACK) != 0)
+            return -1;
+        memmove(n->data + len, n->data, n->length);
+        n->addr = addr;
+        n->length += len;
+        map->hint = (unsigned) (i + 1);
+        *dst = n->data;
+        return 0;
+    }
+    if (map->arena != NULL)
+        e = arena_alloc(map->arena, sizeof *e);
+    else {
+        e = calloc(1, sizeof *e);
+        map->allocations++;
+    }
+    if (e == NULL)
+        return -1;
+    e->addr = addr;
+    e->length = len;
+    // insert first, so the buffer is the most recent allocation if the vector grows
+    if (vec_insert(map->extents, e, (unsigned) (i + 1)) == VEC_NOMEM) {
+        if (map->arena == NULL)
+            free(e);
+        return -1;
+    }
+    if (extent_grow(map, e, len + EXTENT_SLACK) != 0) {
+        vec_removeAt(map->extents, (unsigned) (i + 1));
+        if (map->arena == NULL)
+            free(e);
+        return -1;
+    }
+    map->hint = (unsigned) (i + 1);
+    *dst = e->data;
+    return 0;
+}
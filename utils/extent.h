@@ -0,0 +1,60 @@
+//
+// Extent map - the loaded image as a sorted set of contiguous address ranges.
+//
+
+#ifndef UTILS_EXTENT_H
+#define UTILS_EXTENT_H
+
+#include "vector.h"
+#include "arena.h"
+
+/*
+ * One contiguous run of loaded data. The buffer may have spare capacity beyond length.
+ */
+typedef struct {
+    unsigned long addr;         // address of the first byte
+    unsigned length;            // bytes loaded
+    unsigned capacity;          // bytes allocated at data
+    unsigned char *data;
+} extent;
+
+/*
+ * The map holds extents sorted by address. Extents never overlap or touch; data that
+ * makes two extents adjacent causes them to be merged.
+ */
+typedef struct extent_map {
+    vector_t extents;           // extent *, sorted by address
+    unsigned hint;              // index of the extent most recently written
+    unsigned long allocations;  // extents and buffers allocated or reallocated on the heap
+    arena_t arena;              // where storage comes from, NULL for the heap
+} *extent_map;
+
+/*
+ * Constructor and destructor. If an arena is given the map and all its storage come from it, and
+ * are released with it. Otherwise the destructor frees any extent buffers still owned by the map.
+ * The constructor returns NULL if it is out of memory.
+ */
+extern extent_map extent_new(arena_t);
+extern void extent_destroy(extent_map);
+
+/*
+ * Reserve len bytes at addr, and set *dst to where they should be stored. The pointer is valid
+ * until the next call. Returns 0, EXTENT_OVERLAP if any byte in the range has already been
+ * reserved, or -1 if out of memory.
+ */
+#define EXTENT_OVERLAP  1
+extern int extent_reserve(extent_map, unsigned long addr, unsigned len, unsigned char **dst);
+
+/*
+ * Ensure an extent in the map has room for at least size bytes. Returns 0, or -1 if out of memory,
+ * in which case the extent is unchanged.
+ */
+extern int extent_grow(extent_map, extent *, unsigned size);
+
+/*
+ * Number of extents, and access by index in address order.
+ */
+#define extent_count(map)       vec_size((map)->extents)
+#define extent_at(map, i)       ((extent *) vec_elementAt((map)->extents, (i)))
+
+#endif //UTILS_EXTENT_H
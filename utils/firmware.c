@@ -1,324 +1,202 @@
 #include	<stdio.h>
-#include	<ctype.h>
 #include	<stdarg.h>
 #include	<stdlib.h>
 #include <string.h>
 #include <stdbool.h>
 #include <uuid/uuid.h>
-#include <openssl/conf.h>
-#include <openssl/evp.h>
-#include <openssl/err.h>
-#include <sys/time.h>
 #include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
 #include "vector.h"
+#include "bgfirmware.h"
 
 /**
- * This is the structure of the firmware file. There is a fixed size header followed by one or more block headers,
- * which point to the data in the rest of the file.
- * All data in the headers is little endian
+ * Command line front end for libbgfirmware.
  */
 
-#define    FW_TAG        0x55A322BF        // magic number to identify the file
+#define KEY_LEN     BGF_KEY_LEN
 
-#define KEY_LEN     (256/8)
-#define IV_LEN (128/8)
-#define UUID_LEN    16
-#define BLOCK_SIZE  16      // round blocks up by this for encryption.
-
-typedef struct {
-    unsigned char tag[4];            // magic number goes here
-    unsigned char major[2];        // major version number
-    unsigned char minor[2];        // minor version number
-    unsigned char numblocks[2];        // the number of blocks in the file,
-    unsigned char unused[6];
-    unsigned char service_uuid[UUID_LEN];    // the service uuid of the bootloader
-} firmware;
-
-/** A block header.
- *
+/*
+ * One output file of a batch.
  */
-
 typedef struct {
-    unsigned char addr[4];        // the address at which to load this block
-    unsigned char size[4];        // the size of this block
-    unsigned char offset[4];        // offset in the file of the data
-    unsigned char padding[1];   // length of padding at end
-    unsigned char unused[3];
-    unsigned char init_vector[IV_LEN];    // the block 0 initialization vector
-    unsigned char sha256[32];       // SHA256 hash of the data
-} block_header;
+    bgf_variant var;
+    char *outfile;
+    int fd;
+} batch_entry;
 
-typedef struct {
-    unsigned char *data;
-    unsigned int length;
-    unsigned int fileLength;
-    unsigned long addr;
-} memblock;
-
-unsigned long base, last;
 int lineno, major, minor;
 char *filename;
 char *outfile;
+char *manifest;         // batch manifest file, if any
 char verbose;
-char lbuf[1024];
 unsigned char keybuf[KEY_LEN];
-unsigned long offset;
-vector_t memblocks;
-vector_t assembledBlocks;
 uuid_t uuid;
-firmware fw;
 long baseAddress;   // the expected base address
+unsigned numThreads;    // number of worker threads for hashing and encryption, 0 for the default
+bool stats;             // report timings and counters
+char *statsFile;        // where to write them, stderr if NULL
+double startWall, startCpu;     // when we started, for the totals
+unsigned long blockCost = BGF_BLOCK_COST;   // cost model for laying out blocks
+double byteCost = BGF_BYTE_COST;
+unsigned long pageSize;         // align blocks to flash pages of this size
+bool skipErased;                // send erased pages as erase-only blocks
+bool compress;                  // compress blocks
+char *oldFile;                  // the firmware on the device, to send patches against
+bool pageManifest;              // write a page manifest alongside each output file
+bool ctr;                       // encrypt with AES-CTR rather than CBC
+bool pageTags;                  // add page tags to plain data blocks
 
 
-
-void add_data(unsigned long i, unsigned int cnt, unsigned char *buffer);
-
-static void
-put2(unsigned char *addr, unsigned int val) {
-    *addr++ = (unsigned char) (val & 0xFF);
-    *addr = (unsigned char) ((val >> 8) & 0xFF);
-}
-
-static void
-put4(unsigned char *addr, unsigned long val) {
-    *addr++ = (unsigned char) (val & 0xFF);
-    *addr++ = (unsigned char) ((val >> 8) & 0xFF);
-    *addr++ = (unsigned char) ((val >> 16) & 0xFF);
-    *addr = (unsigned char) ((val >> 24) & 0xFF);
-}
-
 void
-hexerror(char *f, ...) {
+error(char *f, ...) {
     va_list ap;
 
     va_start(ap, f);
     fprintf(stderr, "%s: %d: ", filename, lineno);
     vfprintf(stderr, f, ap);
     putc('\n', stderr);
-    fprintf(stderr, "line: \"%s", lbuf);
     exit(1);
 }
 
+/**
+ * Report a library error and exit.
+ */
 void
-error(char *f, ...) {
-    va_list ap;
-
-    va_start(ap, f);
-    fprintf(stderr, "%s: %d: ", filename, lineno);
-    vfprintf(stderr, f, ap);
-    putc('\n', stderr);
+fatal(bgf_context *ctx) {
+    fprintf(stderr, "%s\n", bgf_error(ctx));
     exit(1);
 }
 
+static double
+clockUs(clockid_t id) {
+    struct timespec ts;
 
-unsigned char
-getx(char **p) {
-    unsigned char hi, lo;
-
-    hi = (unsigned char) *(*p)++;
-    lo = (unsigned char) *(*p)++;
-    if (!isxdigit(hi) || !isxdigit(lo)) {
-        hexerror("Saw 0%o and 0%o:- hex digit expected", hi, lo);
-    }
-    if (islower(hi))
-        hi = (unsigned char) toupper(hi);
-    if (islower(lo))
-        lo = (unsigned char) toupper(lo);
-    if (hi >= 'A')
-        hi -= 'A' - ('9' + 1);
-    if (lo >= 'A')
-        lo -= 'A' - ('9' + 1);
-    hi -= '0';
-    lo -= '0';
-    return (hi << 4) + lo;
+    clock_gettime(id, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
 }
 
-
-int
-readHexLine() {
-    int i, j, cksum, type;
-    unsigned int cnt;
-    unsigned addr;
-    unsigned char buffer[256];
-    char *p;
-
-    if (fgets(lbuf, sizeof lbuf, stdin) == NULL)
-        return 0;
-    lineno++;
-    p = lbuf;
-    while ((i = *p++) != ':')
-        if (i == 0)
-            return 1;
-    cnt = getx(&p);
-    cksum = getx(&p);
-    addr = getx(&p);
-    addr += (cksum << 8);
-    /* addr -= 0x100;*/
-    cksum += addr + cnt;
-    cksum += type = getx(&p);
-    for (j = 0; j != cnt; j++) {
-        unsigned char c = getx(&p);
-        buffer[j] = c;
-        cksum += c;
-    }
-    cksum += getx(&p);
-    if ((cksum & 0xFF) != 0) {
-        hexerror("Checksum error");
-    }
-    switch (type) {
-        case 1:    /* EOF */
-            return 0;
-
-        case 0:    /* data */
-            add_data(base + addr, cnt, buffer);
-            break;
-
-        case 4:    /* extended linear address */
-            base = ((unsigned long) buffer[1] << 16) + ((unsigned long) buffer[0] << 24);
-            if (verbose > 1)
-                fprintf(stderr, "%d: Linear address %lX\n", lineno, base);
-            break;
-
-        case 2:    /* extended segment address */
-            base = ((unsigned long) buffer[1] << 4) + ((unsigned long) buffer[0] << 12);
-            if (verbose > 1)
-                fprintf(stderr, "%d: Segment address %lX\n", lineno, base);
-            break;
-
-        case 3:
-        case 5:
-            break;
-
-        default:
-            hexerror("Unknown record type %2.2X - length %d", type, cnt);
-            break;
-
-    }
-    return 1;
-}
-
-void add_data(unsigned long addr, unsigned int cnt, unsigned char *buffer) {
-    memblock *mb = calloc(sizeof(memblock), 1);
-    mb->data = malloc(cnt);
-    memcpy(mb->data, buffer, cnt);
-    mb->length = cnt;
-    mb->addr = addr;
-    vec_add(memblocks, mb);
+static void
+printTiming(FILE *fp, const char *name, double wall, double cpu, const char *sep) {
+    fprintf(fp, "    \"%s\": {\"wall_us\": %.1f, \"cpu_us\": %.1f}%s\n", name, wall, cpu, sep);
 }
 
-int cmpBlock(const void *a1, const void *a2) {
-    const memblock *m1, *m2;
-    m1 = *(memblock **) a1;
-    m2 = *(memblock **) a2;
-    if (m1->addr < m2->addr)
-        return -1;
-    if (m1->addr > m2->addr)
-        return 1;
-    return 0;
+/**
+ * Write the stats report as JSON. Worker stage times are summed over the workers, so with
+ * several threads they may add up to more than the total.
+ */
+void
+writeStats(bgf_context *ctx) {
+    bgf_stats st;
+    FILE *fp = stderr;
+
+    if (statsFile != NULL && (fp = fopen(statsFile, "w")) == NULL)
+        error("Can't create stats file %s", statsFile);
+    bgf_get_stats(ctx, &st);
+    fprintf(fp, "{\n");
+    fprintf(fp, "  \"inputs\": %lu,\n", st.inputs);
+    fprintf(fp, "  \"input_bytes\": %lu,\n", st.input_bytes);
+    fprintf(fp, "  \"records\": %lu,\n", st.records);
+    fprintf(fp, "  \"data_bytes\": %lu,\n", st.data_bytes);
+    fprintf(fp, "  \"extents\": %lu,\n", st.extents);
+    fprintf(fp, "  \"blocks\": %lu,\n", st.blocks);
+    fprintf(fp, "  \"gap_bytes\": %lu,\n", st.gap_bytes);
+    fprintf(fp, "  \"padding_bytes\": %lu,\n", st.padding_bytes);
+    fprintf(fp, "  \"erased_bytes\": %lu,\n", st.erased_bytes);
+    fprintf(fp, "  \"compressed_bytes\": %lu,\n", st.compressed_bytes);
+    fprintf(fp, "  \"patched_bytes\": %lu,\n", st.patched_bytes);
+    fprintf(fp, "  \"file_bytes\": %lu,\n", bgf_output_size(ctx));
+    fprintf(fp, "  \"files\": %lu,\n", st.files);
+    fprintf(fp, "  \"output_bytes\": %lu,\n", st.output_bytes);
+    fprintf(fp, "  \"allocations\": %lu,\n", st.allocations);
+    fprintf(fp, "  \"arena_bytes\": %lu,\n", st.arena_bytes);
+    fprintf(fp, "  \"stages\": {\n");
+    printTiming(fp, "parse", st.parse.wall_us, st.parse.cpu_us, ",");
+    printTiming(fp, "assemble", st.assemble.wall_us, st.assemble.cpu_us, ",");
+    printTiming(fp, "digest", st.digest.wall_us, st.digest.cpu_us, ",");
+    printTiming(fp, "encrypt", st.encrypt.wall_us, st.encrypt.cpu_us, ",");
+    printTiming(fp, "output", st.output.wall_us, st.output.cpu_us, "");
+    fprintf(fp, "  },\n");
+    fprintf(fp, "  \"total\": {\"wall_us\": %.1f, \"cpu_us\": %.1f}\n",
+            clockUs(CLOCK_MONOTONIC) - startWall, clockUs(CLOCK_PROCESS_CPUTIME_ID) - startCpu);
+    fprintf(fp, "}\n");
+    if (fp != stderr && fclose(fp) != 0)
+        error("Write to %s failed", statsFile);
 }
 
-void combine(unsigned i, unsigned j) {
-    memblock *m1 = vec_elementAt(memblocks, i);
-    memblock *ml = vec_elementAt(memblocks, j - 1);
-    unsigned totLength = (unsigned int) (ml->addr + ml->length - m1->addr);
-    totLength += BLOCK_SIZE;
-    totLength &= ~(BLOCK_SIZE - 1);
-    m1->fileLength = totLength;
-    unsigned char *buf = calloc(totLength, 1);
-    for (unsigned k = i; k != j; k++) {
-        memblock *m2 = vec_elementAt(memblocks, k);
-        memcpy(buf + m2->addr - m1->addr, m2->data, m2->length);
-        free(m2->data);
-        if (k != i)
-            free(m2);
-    }
-    m1->data = buf;
-    m1->length = (unsigned int) (ml->addr + ml->length - m1->addr);
-    memset(buf + m1->length, (unsigned char) (totLength - m1->length), (totLength - m1->length));
-    vec_add(assembledBlocks, m1);
+/**
+ * Clean up and exit after a successful run.
+ */
+void
+finish(bgf_context *ctx) {
+    if (stats)
+        writeStats(ctx);
+    bgf_free(ctx);
+    exit(0);
 }
 
-void assembleBlocks() {
-
-    memblock *m1, *m2;
-
-    if (memblocks->count == 0) {
-        error("No data read");
-    }
-    vec_sort(memblocks, cmpBlock);
-    unsigned int i = 0;
-    m1 = vec_first(memblocks);
-    unsigned int length = m1->length;
-    for (unsigned int j = 1; j != vec_size(memblocks); j++) {
-        m2 = vec_elementAt(memblocks, j);
-        if (m1->addr + length >= m2->addr - BLOCK_SIZE - 1) {
-            length += m2->length;
-            continue;
-        }
-        combine(i, j);
-        i = j + 1;
+/**
+ * Write the page manifest for an output file to <outfile>.pages. Each non-comment line is a page
+ * that the loader can skip if the device already has it:
+ *
+ *      <address> <sha256>
+ *
+ * in hex, the digest being of the whole page as it will be after the update. The loader asks the
+ * device for the digests of these pages and sends only the ones that differ.
+ */
+void writePages(bgf_context *ctx, const char *out) {
+    unsigned char digest[BGF_DIGEST_LEN];
+    unsigned long addr;
+    unsigned i, j;
+    char *name = malloc(strlen(out) + sizeof ".pages");
+    FILE *fp;
+    int result;
+
+    sprintf(name, "%s.pages", out);
+    if ((fp = fopen(name, "w")) == NULL)
+        error("Can't create page manifest %s", name);
+    fprintf(fp, "# page size %X\n", BGF_PAGE_SIZE);
+    for (i = 0; (result = bgf_page_info(ctx, i, &addr, digest)) == 0; i++) {
+        fprintf(fp, "%08lX ", addr);
+        for (j = 0; j != BGF_DIGEST_LEN; j++)
+            fprintf(fp, "%02X", digest[j]);
+        putc('\n', fp);
     }
-    if (i != vec_size(memblocks))
-        combine(i, vec_size(memblocks));
+    if (result < 0)
+        fatal(ctx);
+    if (fclose(fp) != 0)
+        error("Write to %s failed", name);
+    if (verbose != 0)
+        fprintf(stderr, "Wrote %s, %u pages\n", name, i);
+    free(name);
 }
 
-void writeData() {
-    memblock *m1;
-    int outlen;
-    EVP_CIPHER_CTX *ctx;
-    ctx = EVP_CIPHER_CTX_new();
-    EVP_MD_CTX * shaCtx = EVP_MD_CTX_create();
-    if (ctx == NULL) {
-        error("Failed to initialise cipher context");
-    }
-    block_header header;
-    memset(&fw, 0, sizeof(fw));
-    for (int i = 0; i != UUID_LEN; i++)
-        fw.service_uuid[i] = uuid[i];
-    put4(fw.tag, FW_TAG);
-    put2(fw.major, (unsigned int) major);
-    put2(fw.minor, (unsigned int) minor);
-    put2(fw.numblocks, (unsigned int) vec_size(assembledBlocks));
-    unsigned long offset = sizeof(firmware) + sizeof(block_header) * vec_size(assembledBlocks);
-    fseek(stdout, 0L, SEEK_SET);
-    fwrite(&fw, sizeof fw, 1, stdout);
-    VEC_ITERATE(assembledBlocks, m1, memblock *) {
-        memset(&header, 0, sizeof(header));
-        arc4random_buf(header.init_vector, sizeof header.init_vector);
-        if(EVP_DigestInit_ex(shaCtx, EVP_sha256(), NULL) != 1)
-            error("Sha digest init failed");
-        if(EVP_DigestUpdate(shaCtx, m1->data, m1->fileLength) != 1)
-            error("Sha digest update failed");
-        unsigned int digest_len;
-        if(EVP_MD_size(EVP_sha256()) != sizeof(header.sha256))
-            error("Sha digest length wrong");
-        if(EVP_DigestFinal(shaCtx, header.sha256, &digest_len) != 1|| digest_len != sizeof(header.sha256))
-            error("SHA digest final failed");
-        if (EVP_EncryptInit_ex(ctx, EVP_aes_256_cbc(), NULL, keybuf, header.init_vector) != 1) {
-            error("EncryptInit_ex failed");
-        }
-        unsigned char *outbuf = malloc(m1->fileLength);
-        if (EVP_EncryptUpdate(ctx, outbuf, &outlen, m1->data, m1->fileLength) != 1) {
-            error("EncryptUpdate failed");
-        }
-        if (outlen != m1->fileLength) {
-            error("Mismatched length after encryption - %d should be %d", outlen, m1->fileLength);
-        }
-        free(m1->data);
-        m1->data = outbuf;
-        put4(header.addr, m1->addr);
-        put4(header.size, m1->length);
-        put4(header.offset, offset);
-        header.padding[0] = (unsigned char) (m1->fileLength - m1->length);
-        offset += m1->fileLength;
-        fwrite(&header, sizeof header, 1, stdout);
+/**
+ * Write one firmware file per manifest entry, all from the same image.
+ */
+void writeBatch(bgf_context *ctx, vector_t entries) {
+    batch_entry *be;
+    bgf_variant *variants = calloc(vec_size(entries), sizeof *variants);
+    vec_cursor cur;
+
+    VEC_FOREACH(entries, be, batch_entry *, cur) {
+        if ((be->fd = open(be->outfile, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+            error("Can't create output file %s", be->outfile);
+        be->var.sink = bgf_fd_sink(be->fd);
+        variants[vec_cursor_index(&cur)] = be->var;
     }
-    EVP_CIPHER_CTX_free(ctx);
-    EVP_MD_CTX_destroy(shaCtx);
-    VEC_ITERATE(assembledBlocks, m1, memblock *) {
-        fwrite(m1->data, 1, m1->fileLength, stdout);
+    if (bgf_write_variants(ctx, variants, vec_size(entries)) != 0)
+        fatal(ctx);
+    VEC_FOREACH(entries, be, batch_entry *, cur) {
+        if (close(be->fd) != 0)
+            error("Write to %s failed", be->outfile);
+        if (verbose != 0)
+            fprintf(stderr, "Wrote %s\n", be->outfile);
+        if (pageManifest)
+            writePages(ctx, be->outfile);
     }
-    fclose(stdout);
+    free(variants);
 }
 
 bool file_exists(char *fileName) {
@@ -343,27 +221,81 @@ char *readKey(char *fileName) {
 }
 
 
+/**
+ * Read a batch manifest. Each non-blank line that does not start with # describes one output file:
+ *
+ *      <aeskey> <service_uuid> <major.minor> <outfile>
+ *
+ * The key may be given in hex or as the name of a key file, as for -k.
+ * @return  A vector of batch_entry *
+ */
+vector_t readManifest(char *name) {
+    FILE *fp = fopen(name, "r");
+    vector_t entries = vec_new();
+    char line[1024], key[1024], uuidText[1024], version[1024], out[1024];
+    char *arg;
+
+    if (fp == NULL)
+        error("Can't open manifest %s", name);
+    filename = name;
+    lineno = 0;
+    while (fgets(line, sizeof line, fp) != NULL) {
+        lineno++;
+        if (sscanf(line, " %1023s", key) != 1 || key[0] == '#')
+            continue;
+        batch_entry *be = calloc(1, sizeof *be);
+        if (sscanf(line, "%1023s %1023s %1023s %1023s", key, uuidText, version, out) != 4)
+            error("Expected <aeskey> <service_uuid> <major.minor> <outfile>");
+        arg = key;
+        if (strlen(arg) != KEY_LEN * 2 && file_exists(arg))
+            arg = readKey(arg);
+        if (bgf_parse_key(be->var.key, arg) != 0)
+            error("The key should be %d bytes in hex", KEY_LEN);
+        if (uuid_parse(uuidText, be->var.uuid) != 0)
+            error("Invalid service uuid %s", uuidText);
+        if (sscanf(version, "%d.%d", &be->var.major, &be->var.minor) != 2)
+            error("Invalid version %s", version);
+        be->outfile = strdup(out);
+        vec_add(entries, be);
+    }
+    fclose(fp);
+    if (vec_size(entries) == 0)
+        error("No variants in manifest");
+    return entries;
+}
+
 int
 main(int argc, char **argv) {
-    memblock *m1;
+    bgf_context *ctx, *old = NULL;
+    unsigned long addr;
+    unsigned length, i;
     char *arg;
     bool sawError = false;
+    bgf_transfer est;
 
     if (argc < 2) {
         fprintf(stderr,
-                "Usage: firmware -o <outfile> -b <address_base> -n <major.minor> -k <aeskey> -s <service_uuid> <infile>.hex ...\n");
+                "Usage: firmware -o <outfile> -b <address_base> -n <major.minor> -k <aeskey> -s <service_uuid> [-j <threads>] [-c <block_cost>[,<us_per_byte>]] [-a <page_size>] [-e] [-z] [-d <old>.hex|.elf] [-p] [-t] [-g] [--stats[=<file>]] <infile>.hex|.elf ...\n"
+                "       firmware -m <manifest> -b <address_base> [-j <threads>] [-c <block_cost>[,<us_per_byte>]] [-a <page_size>] [-e] [-z] [-d <old>.hex|.elf] [-p] [-t] [-g] [--stats[=<file>]] <infile>.hex|.elf ...\n");
         exit(1);
     }
-    ERR_load_crypto_strings();
-    OpenSSL_add_all_algorithms();
-    OPENSSL_config(NULL);
-
-    assembledBlocks = vec_new();
-    memblocks = vec_new();
-    offset = 0x1000;
+    startWall = clockUs(CLOCK_MONOTONIC);
+    startCpu = clockUs(CLOCK_PROCESS_CPUTIME_ID);
     while (argv[1][0] == '-') {
         switch (argv[1][1]) {
 
+            case '-':
+                if (strcmp(argv[1], "--stats") == 0) {
+                    stats = true;
+                } else if (strncmp(argv[1], "--stats=", 8) == 0) {
+                    stats = true;
+                    statsFile = argv[1] + 8;
+                } else {
+                    fprintf(stderr, "Unknown arg %s\n", argv[1]);
+                    sawError = true;
+                }
+                break;
+
             case 'O':
             case 'o':
                 arg = argv[1] + 2;
@@ -415,12 +347,10 @@ main(int argc, char **argv) {
                 }
                 if (strlen(arg) != KEY_LEN*2 && file_exists(arg))
                     arg = readKey(arg);
-                if (strlen(arg) != KEY_LEN*2) {
+                if (bgf_parse_key(keybuf, arg) != 0) {
                     fprintf(stderr, "The key should be %d bytes in hex\n", KEY_LEN);
                     sawError = true;
-                } else
-                    for (int i = 0; i != 32; i++)
-                        keybuf[i] = getx(&arg);
+                }
                 break;
 
             case 's':
@@ -459,6 +389,122 @@ main(int argc, char **argv) {
             case 'V':
                 verbose = 1;
                 break;
+
+            case 'e':
+            case 'E':
+                skipErased = true;
+                break;
+
+            case 'z':
+            case 'Z':
+                compress = true;
+                break;
+
+            case 'p':
+            case 'P':
+                pageManifest = true;
+                break;
+
+            case 't':
+            case 'T':
+                ctr = true;
+                break;
+
+            case 'g':
+            case 'G':
+                pageTags = true;
+                break;
+
+            case 'd':
+            case 'D':
+                arg = argv[1] + 2;
+                if (*arg == 0) {
+                    if (argc < 1) {
+                        fprintf(stderr, "missing old firmware arg to -D\n");
+                        sawError = true;
+                        continue;
+                    }
+                    argv++;
+                    argc--;
+                    arg = argv[1];
+                }
+                oldFile = arg;
+                break;
+
+            case 'm':
+            case 'M':
+                arg = argv[1] + 2;
+                if (*arg == 0) {
+                    if (argc < 1) {
+                        fprintf(stderr, "missing manifest arg to -M\n");
+                        sawError = true;
+                        continue;
+                    }
+                    argv++;
+                    argc--;
+                    arg = argv[1];
+                }
+                manifest = arg;
+                break;
+
+            case 'j':
+            case 'J':
+                arg = argv[1] + 2;
+                if (*arg == 0) {
+                    if (argc < 1) {
+                        fprintf(stderr, "missing thread count arg to -J\n");
+                        sawError = true;
+                        continue;
+                    }
+                    argv++;
+                    argc--;
+                    arg = argv[1];
+                }
+                numThreads = (unsigned) strtoul(arg, NULL, 0);
+                if (numThreads == 0) {
+                    fprintf(stderr, "Thread count must be at least 1\n");
+                    sawError = true;
+                }
+                break;
+
+            case 'c':
+            case 'C':
+                arg = argv[1] + 2;
+                if (*arg == 0) {
+                    if (argc < 1) {
+                        fprintf(stderr, "missing cost arg to -C\n");
+                        sawError = true;
+                        continue;
+                    }
+                    argv++;
+                    argc--;
+                    arg = argv[1];
+                }
+                blockCost = strtoul(arg, &arg, 0);
+                if (*arg == ',')
+                    byteCost = strtod(arg + 1, &arg);
+                if (*arg != 0 || byteCost <= 0) {
+                    fprintf(stderr, "The cost should be <block_cost>[,<us_per_byte>]\n");
+                    sawError = true;
+                }
+                break;
+
+            case 'a':
+            case 'A':
+                arg = argv[1] + 2;
+                if (*arg == 0) {
+                    if (argc < 1) {
+                        fprintf(stderr, "missing page size arg to -A\n");
+                        sawError = true;
+                        continue;
+                    }
+                    argv++;
+                    argc--;
+                    arg = argv[1];
+                }
+                pageSize = strtoul(arg, NULL, 0);
+                break;
+
             default:
                 fprintf(stderr, "Unknown arg %s\n", argv[1]);
                 sawError = true;
@@ -472,37 +518,72 @@ main(int argc, char **argv) {
     argv++;
     if (sawError)
         exit(1);
+    if ((ctx = bgf_new()) == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    if (numThreads != 0)
+        bgf_set_threads(ctx, numThreads);
+    bgf_set_stats(ctx, stats);
+    bgf_set_cost(ctx, blockCost, byteCost);
+    if (bgf_set_page_size(ctx, pageSize) != 0)
+        fatal(ctx);
+    bgf_set_skip_erased(ctx, skipErased);
+    bgf_set_compress(ctx, compress);
+    bgf_set_ctr(ctx, ctr);
+    bgf_set_page_tags(ctx, pageTags);
     while (*argv) {
-        if (!freopen(argv[0], "r", stdin)) {
-            fprintf(stderr, "Can't open %s\n", *argv);
+        if (bgf_load_file(ctx, *argv) != 0)
+            fatal(ctx);
+        argv++;
+    }
+    if (oldFile != NULL) {
+        if ((old = bgf_new()) == NULL) {
+            fprintf(stderr, "Out of memory\n");
             exit(1);
         }
-        base = 0;
-        lineno = 0;
-        filename = *argv;
-        while (readHexLine())
-            continue;
-        argv++;
+        if (bgf_load_file(old, oldFile) != 0)
+            fatal(old);
+        bgf_set_base(ctx, old);
     }
-    assembleBlocks();
-    if (verbose != 0)
-        VEC_ITERATE(assembledBlocks, m1, memblock *)fprintf(stderr, "Block: %lX len %X\n", m1->addr, m1->length);
-    memblock *mp = vec_first(assembledBlocks);
-    if (baseAddress != 0 && mp->addr != baseAddress) {
-        fprintf(stderr, "Lowest address %lX does not match specified base address of %lX\n", mp->addr, baseAddress);
+    if (bgf_assemble(ctx) != 0)
+        fatal(ctx);
+    if (old != NULL) {
+        bgf_set_base(ctx, NULL);
+        bgf_free(old);
+    }
+    if (verbose != 0) {
+        for (i = 0; bgf_block_info(ctx, i, &addr, &length) == 0; i++)
+            fprintf(stderr, "%s: %lX len %X\n",
+                    bgf_block_erase_only(ctx, i) ? "Erase" : bgf_block_base_check(ctx, i) ? "Check" : "Block",
+                    addr, length);
+        bgf_estimate(ctx, &est);
+        fprintf(stderr, "Estimated transfer: %lu bytes, %lu round trips, %.1fs\n", est.bytes, est.round_trips,
+                est.seconds);
+    }
+    for (i = 0; bgf_block_base_check(ctx, i); i++)
+        ;
+    bgf_block_info(ctx, i, &addr, &length);
+    if (baseAddress != 0 && addr != (unsigned long) baseAddress) {
+        fprintf(stderr, "Lowest address %lX does not match specified base address of %lX\n", addr, baseAddress);
         exit(1);
     }
+    if (manifest != NULL) {
+        writeBatch(ctx, readManifest(manifest));
+        finish(ctx);
+    }
     if (outfile == NULL) {
         fprintf(stderr, "No output file specified, skipping write\n");
-        exit(0);
+        finish(ctx);
     }
-    // create outfile if not specified as "-"
-    if (strcmp(outfile, "-") != 0 && !freopen(outfile, "wb", stdout)) {
-        fprintf(stderr, "Can't create output file %s\n", outfile);
-        exit(1);
-    }
-    writeData();
-    exit(0);
+    bgf_set_key(ctx, keybuf);
+    bgf_set_uuid(ctx, uuid);
+    bgf_set_version(ctx, major, minor);
+    if (bgf_write_file(ctx, outfile) != 0)
+        fatal(ctx);
+    if (pageManifest)
+        writePages(ctx, outfile);
+    finish(ctx);
 }
 
 
@@ -0,0 +1,162 @@
+//
+// ASCII hex decoding for the firmware utility.
+//
+// The scalar decoder uses a nibble table. On x86 there are SSE2 and AVX2 kernels which decode
+// 16 or 32 bytes per step, validating every character and summing the bytes for the record checksum
+// in the same pass. The kernel is chosen once, on first use, from the features of the running CPU.
+//
+
+#include <stddef.h>
+#include "hexdecode.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define HEX_X86     1
+#include <immintrin.h>
+#endif
+
+/**
+ * Nibble decode table. Valid hex digits map to their value with bit 4 set, everything else maps to zero,
+ * so a pair of digits is valid iff the AND of their entries has bit 4 set.
+ */
+#define HEX_VALID   0x10
+
+static const unsigned char hexval[256] = {
+        ['0'] = 0x10, ['1'] = 0x11, ['2'] = 0x12, ['3'] = 0x13, ['4'] = 0x14,
+        ['5'] = 0x15, ['6'] = 0x16, ['7'] = 0x17, ['8'] = 0x18, ['9'] = 0x19,
+        ['A'] = 0x1A, ['B'] = 0x1B, ['C'] = 0x1C, ['D'] = 0x1D, ['E'] = 0x1E, ['F'] = 0x1F,
+        ['a'] = 0x1A, ['b'] = 0x1B, ['c'] = 0x1C, ['d'] = 0x1D, ['e'] = 0x1E, ['f'] = 0x1F,
+};
+
+int hex_decode_scalar(unsigned char *dst, const char *src, unsigned n, unsigned *sum) {
+    const unsigned char *s = (const unsigned char *) src;
+    unsigned char valid = HEX_VALID;
+    unsigned total = 0;
+
+    while (n-- != 0) {
+        unsigned char hi = hexval[*s++];
+        unsigned char lo = hexval[*s++];
+        unsigned char c = (unsigned char) ((hi << 4) | (lo & 0xF));
+        valid &= hi & lo;
+        *dst++ = c;
+        total += c;
+    }
+    *sum += total;
+    return valid != 0;
+}
+
+#if defined(HEX_X86)
+
+/*
+ * Convert 16 hex characters to nibble values, and accumulate a mask of invalid characters.
+ * Digits are c - '0' in 0..9, letters are (c | 0x20) - 'a' in 0..5. SSE2 has no unsigned
+ * compare so x <= lim is tested as min(x, lim) == x.
+ */
+__attribute__((target("sse2")))
+static inline __m128i nibbles_sse2(__m128i c, __m128i *bad) {
+    __m128i d = _mm_sub_epi8(c, _mm_set1_epi8('0'));
+    __m128i l = _mm_sub_epi8(_mm_or_si128(c, _mm_set1_epi8(0x20)), _mm_set1_epi8('a'));
+    __m128i isd = _mm_cmpeq_epi8(_mm_min_epu8(d, _mm_set1_epi8(9)), d);
+    __m128i isl = _mm_cmpeq_epi8(_mm_min_epu8(l, _mm_set1_epi8(5)), l);
+
+    *bad = _mm_or_si128(*bad, _mm_xor_si128(_mm_or_si128(isd, isl), _mm_set1_epi8(-1)));
+    return _mm_or_si128(_mm_and_si128(isd, d), _mm_and_si128(isl, _mm_add_epi8(l, _mm_set1_epi8(10))));
+}
+
+// combine nibble pairs: each 16 bit lane holds the high nibble in its low byte, so this yields one byte per lane
+__attribute__((target("sse2")))
+static inline __m128i pairs_sse2(__m128i v) {
+    return _mm_or_si128(_mm_slli_epi16(_mm_and_si128(v, _mm_set1_epi16(0xFF)), 4), _mm_srli_epi16(v, 8));
+}
+
+__attribute__((target("sse2")))
+static int hex_decode_sse2(unsigned char *dst, const char *src, unsigned n, unsigned *sum) {
+    __m128i bad = _mm_setzero_si128();
+    __m128i acc = _mm_setzero_si128();
+    int valid;
+
+    for (; n >= 16; n -= 16, src += 32, dst += 16) {
+        __m128i w0 = pairs_sse2(nibbles_sse2(_mm_loadu_si128((const __m128i *) src), &bad));
+        __m128i w1 = pairs_sse2(nibbles_sse2(_mm_loadu_si128((const __m128i *) (src + 16)), &bad));
+        __m128i b = _mm_packus_epi16(w0, w1);
+        _mm_storeu_si128((__m128i *) dst, b);
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(b, _mm_setzero_si128()));
+    }
+    *sum += (unsigned) (_mm_cvtsi128_si32(acc) + _mm_cvtsi128_si32(_mm_srli_si128(acc, 8)));
+    valid = _mm_movemask_epi8(bad) == 0;
+    return hex_decode_scalar(dst, src, n, sum) && valid;
+}
+
+__attribute__((target("avx2")))
+static inline __m256i nibbles_avx2(__m256i c, __m256i *bad) {
+    __m256i d = _mm256_sub_epi8(c, _mm256_set1_epi8('0'));
+    __m256i l = _mm256_sub_epi8(_mm256_or_si256(c, _mm256_set1_epi8(0x20)), _mm256_set1_epi8('a'));
+    __m256i isd = _mm256_cmpeq_epi8(_mm256_min_epu8(d, _mm256_set1_epi8(9)), d);
+    __m256i isl = _mm256_cmpeq_epi8(_mm256_min_epu8(l, _mm256_set1_epi8(5)), l);
+
+    *bad = _mm256_or_si256(*bad, _mm256_xor_si256(_mm256_or_si256(isd, isl), _mm256_set1_epi8(-1)));
+    return _mm256_or_si256(_mm256_and_si256(isd, d),
+                           _mm256_and_si256(isl, _mm256_add_epi8(l, _mm256_set1_epi8(10))));
+}
+
+__attribute__((target("avx2")))
+static inline __m256i pairs_avx2(__m256i v) {
+    return _mm256_or_si256(_mm256_slli_epi16(_mm256_and_si256(v, _mm256_set1_epi16(0xFF)), 4),
+                           _mm256_srli_epi16(v, 8));
+}
+
+__attribute__((target("avx2")))
+static int hex_decode_avx2(unsigned char *dst, const char *src, unsigned n, unsigned *sum) {
+    __m256i bad = _mm256_setzero_si256();
+    __m256i acc = _mm256_setzero_si256();
+    __m128i acc2;
+    int valid;
+
+    for (; n >= 32; n -= 32, src += 64, dst += 32) {
+        __m256i w0 = pairs_avx2(nibbles_avx2(_mm256_loadu_si256((const __m256i *) src), &bad));
+        __m256i w1 = pairs_avx2(nibbles_avx2(_mm256_loadu_si256((const __m256i *) (src + 32)), &bad));
+        // packus works within 128 bit lanes, so restore the byte order afterwards
+        __m256i b = _mm256_permute4x64_epi64(_mm256_packus_epi16(w0, w1), 0xD8);
+        _mm256_storeu_si256((__m256i *) dst, b);
+        acc = _mm256_add_epi64(acc, _mm256_sad_epu8(b, _mm256_setzero_si256()));
+    }
+    acc2 = _mm_add_epi64(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+    *sum += (unsigned) (_mm_cvtsi128_si32(acc2) + _mm_cvtsi128_si32(_mm_srli_si128(acc2, 8)));
+    valid = _mm256_movemask_epi8(bad) == 0;
+    return hex_decode_sse2(dst, src, n, sum) && valid;
+}
+
+#endif
+
+static int hex_decode_select(unsigned char *dst, const char *src, unsigned n, unsigned *sum);
+
+static int (*decoder)(unsigned char *, const char *, unsigned, unsigned *) = hex_decode_select;
+static const char *decoderName = "scalar";
+
+// choose the decoder on first use
+static int hex_decode_select(unsigned char *dst, const char *src, unsigned n, unsigned *sum) {
+    decoder = hex_decode_scalar;
+#if defined(HEX_X86)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        decoder = hex_decode_avx2;
+        decoderName = "avx2";
+    } else if (__builtin_cpu_supports("sse2")) {
+        decoder = hex_decode_sse2;
+        decoderName = "sse2";
+    }
+#endif
+    return decoder(dst, src, n, sum);
+}
+
+int hex_decode(unsigned char *dst, const char *src, unsigned n, unsigned *sum) {
+    return decoder(dst, src, n, sum);
+}
+
+const char *hex_decode_impl(void) {
+    if (decoder == hex_decode_select) {
+        unsigned char c;
+        unsigned sum = 0;
+        hex_decode_select(&c, "00", 1, &sum);
+    }
+    return decoderName;
+}
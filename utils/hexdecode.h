@@ -0,0 +1,31 @@
+//
+// ASCII hex decoding for the firmware utility.
+//
+
+#ifndef UTILS_HEXDECODE_H
+#define UTILS_HEXDECODE_H
+
+/**
+ * Decode a run of ASCII hex digit pairs into bytes.
+ * Uses a vector kernel where the CPU supports one, otherwise a table driven scalar loop. All
+ * implementations produce identical output, and read exactly 2 * n characters.
+ *
+ * @param dst   Where to put the decoded bytes
+ * @param src   The hex characters, two per byte, most significant nibble first
+ * @param n     The number of bytes to decode
+ * @param sum   Each decoded byte is added to this, for record checksums
+ * @return      1 if all characters were valid hex digits, 0 otherwise
+ */
+extern int hex_decode(unsigned char *dst, const char *src, unsigned n, unsigned *sum);
+
+/**
+ * The scalar implementation, exposed so results can be compared against the vector kernels.
+ */
+extern int hex_decode_scalar(unsigned char *dst, const char *src, unsigned n, unsigned *sum);
+
+/**
+ * The name of the implementation hex_decode() has selected for this CPU.
+ */
+extern const char *hex_decode_impl(void);
+
+#endif //UTILS_HEXDECODE_H
@@ -0,0 +1,169 @@
+//
+// Round trip tests of the LZSS compressor against the bootloader's streaming decoder.
+//
+// Each case is compressed, then decoded with the input fed in pieces of various sizes, as packets
+// arrive on the device, into output pieces of various sizes, as pages are filled.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "compress.h"
+
+#define PAGE_SIZE       0x800
+
+static const uint32_t inPieces[] = {1, 3, 20, 64, 0xFFFFFFFF};
+static const uint32_t outPieces[] = {1, 7, 64, PAGE_SIZE, 0xFFFFFFFF};
+
+static int failures;
+
+static void
+check(const char *name, int ok, const char *what) {
+    if (!ok) {
+        fprintf(stderr, "%s: %s\n", name, what);
+        failures++;
+    }
+}
+
+// xorshift32, so the data is the same every run
+static unsigned char
+nextByte(uint32_t *state) {
+    uint32_t x = *state;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return (unsigned char) x;
+}
+
+/*
+ * Decode a stream feeding at most inPiece bytes and taking at most outPiece bytes per call.
+ * Returns the decoded length, or -1 if the decoder stalls or overruns out.
+ */
+static long
+decode(const unsigned char *in, size_t inLen, unsigned char *out, size_t outLen, uint32_t inPiece,
+       uint32_t outPiece) {
+    lzss_state s;
+    size_t done = 0;
+    uint32_t used, n;
+
+    lzss_init(&s);
+    while (!lzss_done(&s)) {
+        uint32_t inN = inLen > inPiece ? inPiece : (uint32_t) inLen;
+        uint32_t outN = outLen - done > outPiece ? outPiece : (uint32_t) (outLen - done);
+
+        n = lzss_decode(&s, in, inN, &used, out + done, outN);
+        if (n == 0 && used == 0)
+            return -1;
+        in += used;
+        inLen -= used;
+        done += n;
+    }
+    return (long) done;
+}
+
+// the largest match distance in a stream, to check the compressor reaches the end of the window
+static unsigned
+maxDistance(const unsigned char *in, size_t inLen) {
+    size_t pos = LZSS_HEADER_LEN;
+    unsigned maxDist = 0, i;
+
+    while (pos < inLen) {
+        unsigned flags = in[pos++];
+
+        for (i = 0; i != 8 && pos < inLen; i++) {
+            if (flags & (1 << i)) {
+                pos++;
+            } else {
+                unsigned dist = 1 + (in[pos] | (in[pos + 1] >> 6) << 8);
+
+                if (dist > maxDist)
+                    maxDist = dist;
+                pos += 2;
+            }
+        }
+    }
+    return maxDist;
+}
+
+/*
+ * Compress data and check every split of the stream decodes to it. Returns the compressed length.
+ */
+static size_t
+roundTrip(const char *name, const unsigned char *data, size_t len, unsigned char **stream) {
+    size_t maxLen = LZSS_HEADER_LEN + len + len / 8 + 1;
+    unsigned char *comp = malloc(maxLen);
+    unsigned char *out = malloc(len + LZSS_MAX_MATCH);
+    size_t compLen, i, j;
+    char what[80];
+
+    if (comp == NULL || out == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    compLen = lzss_compress(data, len, comp, maxLen);
+    check(name, compLen != 0, "compression failed");
+    for (i = 0; compLen != 0 && i != sizeof inPieces / sizeof *inPieces; i++) {
+        for (j = 0; j != sizeof outPieces / sizeof *outPieces; j++) {
+            long n = decode(comp, compLen, out, len + LZSS_MAX_MATCH, inPieces[i], outPieces[j]);
+
+            snprintf(what, sizeof what, "mismatch with input pieces of %u, output pieces of %u",
+                     inPieces[i], outPieces[j]);
+            check(name, n == (long) len && memcmp(out, data, len) == 0, what);
+        }
+    }
+    check(name, compLen == 0 || lzss_verify(comp, compLen, data, len) == 0, "lzss_verify failed");
+    free(out);
+    if (stream != NULL)
+        *stream = comp;
+    else
+        free(comp);
+    return compLen;
+}
+
+int
+main(void) {
+    unsigned char *data = calloc(5 * PAGE_SIZE + 123, 1), *stream;
+    uint32_t seed = 0x12345678;
+    size_t len, i;
+
+    if (data == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+
+    len = roundTrip("empty", data, 0, NULL);
+    check("empty", len == LZSS_HEADER_LEN, "stream is more than the header");
+
+    len = 3 * PAGE_SIZE + 17;
+    for (i = 0; i != len; i++)
+        data[i] = nextByte(&seed);
+    roundTrip("incompressible", data, len, NULL);
+
+    len = 5 * PAGE_SIZE + 123;
+    memset(data, 0xFF, len);
+    check("long run", roundTrip("long run", data, len, NULL) < len / 16, "run not compressed");
+
+    // a copy of the whole window, which can only be matched from exactly LZSS_WINDOW back
+    for (i = 0; i != LZSS_WINDOW; i++)
+        data[i] = nextByte(&seed);
+    memcpy(data + LZSS_WINDOW, data, LZSS_WINDOW);
+    len = roundTrip("window", data, 2 * LZSS_WINDOW, &stream);
+    check("window", len != 0 && maxDistance(stream, len) == LZSS_WINDOW, "no match at the window size");
+    free(stream);
+
+    // pages of repeated words, so matches and groups straddle packet and page boundaries
+    len = 4 * PAGE_SIZE + 5;
+    for (i = 0; i != len; i++)
+        data[i] = i % 67 < 40 ? (unsigned char) (i % 13) : nextByte(&seed);
+    roundTrip("mixed", data, len, NULL);
+
+    free(data);
+    if (failures != 0) {
+        fprintf(stderr, "%d failures\n", failures);
+        return 1;
+    }
+    printf("lzss tests passed\n");
+    return 0;
+}
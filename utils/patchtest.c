@@ -0,0 +1,228 @@
+//
+// Round trip tests of the delta encoder against the bootloader's patch applier.
+//
+// Each block is encoded against the old firmware, then applied to a simulated flash with the patch
+// fed in pieces of various sizes, as packets arrive on the device, into output pieces of various
+// sizes, each ending at or before a page boundary. Each page is written to flash when the output
+// reaches its end, as the device does, and the applier must never read a page once it is written.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "delta.h"
+
+#define PAGE_SIZE       0x800
+#define FLASH_BASE      0x10000
+#define FLASH_PAGES     24
+#define FLASH_SIZE      (FLASH_PAGES * PAGE_SIZE)
+
+static const uint32_t inPieces[] = {1, 3, 20, 64, 0xFFFFFFFF};
+static const uint32_t outPieces[] = {1, 7, 64, PAGE_SIZE};
+
+static int failures;
+
+static void
+check(const char *name, int ok, const char *what) {
+    if (!ok) {
+        fprintf(stderr, "%s: %s\n", name, what);
+        failures++;
+    }
+}
+
+// xorshift32, so the data is the same every run
+static unsigned char
+nextByte(uint32_t *state) {
+    uint32_t x = *state;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return (unsigned char) x;
+}
+
+/*
+ * The device's flash, and which pages of it have been written since the old firmware was read.
+ */
+typedef struct {
+    unsigned char data[FLASH_SIZE];
+    unsigned char written[FLASH_PAGES];
+    int bad;                        // something outside the flash or in a written page was read
+} flash;
+
+static void
+readFlash(void *arg, uint32_t addr, uint8_t *buf, uint32_t len) {
+    flash *fp = arg;
+    uint32_t i;
+
+    if (addr < FLASH_BASE || addr - FLASH_BASE > FLASH_SIZE || len > FLASH_SIZE - (addr - FLASH_BASE)) {
+        fp->bad = 1;
+        memset(buf, 0, len);
+        return;
+    }
+    for (i = 0; i != len; i++)
+        fp->bad |= fp->written[(addr - FLASH_BASE + i) / PAGE_SIZE];
+    memcpy(buf, fp->data + (addr - FLASH_BASE), len);
+}
+
+// write the output for addr up to end into flash, marking its pages written
+static void
+writeFlash(flash *fp, unsigned long addr, const unsigned char *data, unsigned long end) {
+    memcpy(fp->data + (addr - FLASH_BASE), data, end - addr);
+    for (; addr < end; addr = (addr & ~(PAGE_SIZE - 1UL)) + PAGE_SIZE)
+        fp->written[(addr - FLASH_BASE) / PAGE_SIZE] = 1;
+}
+
+/*
+ * Apply a patch for a block at addr to the flash, feeding at most inPiece bytes and taking at most
+ * outPiece bytes per call. Returns the output length, or -1 if the applier stalls or overruns.
+ */
+static long
+apply(flash *fp, unsigned long addr, const unsigned char *in, size_t inLen, unsigned char *out,
+      size_t outLen, uint32_t inPiece, uint32_t outPiece) {
+    patch_state s;
+    size_t done = 0, written = 0;
+    uint32_t used, n;
+
+    patch_init(&s, readFlash, fp);
+    while (!patch_done(&s)) {
+        unsigned long dst = addr + done, pageEnd = (dst & ~(PAGE_SIZE - 1UL)) + PAGE_SIZE;
+        uint32_t inN = inLen > inPiece ? inPiece : (uint32_t) inLen;
+        uint32_t outN = outLen - done > outPiece ? outPiece : (uint32_t) (outLen - done);
+
+        if (outN > pageEnd - dst)
+            outN = (uint32_t) (pageEnd - dst);
+        n = patch_apply(&s, in, inN, &used, out + done, outN);
+        if (n == 0 && used == 0)
+            return -1;
+        in += used;
+        inLen -= used;
+        done += n;
+        // the page buffer is written once it is full
+        if (addr + done == pageEnd) {
+            writeFlash(fp, addr + written, out + written, pageEnd);
+            written = done;
+        }
+    }
+    if (written != done)
+        writeFlash(fp, addr + written, out + written, addr + done);
+    return (long) done;
+}
+
+/*
+ * Encode a block against the base and check every split of the patch rebuilds it from the flash.
+ * The flash is then updated with the block and the base told it is overwritten. Returns the patch
+ * length.
+ */
+static size_t
+roundTrip(const char *name, delta_base *base, flash *fp, unsigned long addr, const unsigned char *data,
+          size_t len) {
+    size_t maxLen = PATCH_HEADER_LEN + len + len / PATCH_MAX_LITERAL + 1;
+    unsigned char *patch = malloc(maxLen);
+    unsigned char *out = malloc(len + 1);
+    flash *copy = malloc(sizeof *copy);
+    size_t patchLen, i, j;
+    char what[80];
+
+    if (patch == NULL || out == NULL || copy == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    patchLen = delta_encode(base, addr, data, len, patch, maxLen);
+    check(name, patchLen != 0, "encoding failed");
+    for (i = 0; patchLen != 0 && i != sizeof inPieces / sizeof *inPieces; i++) {
+        for (j = 0; j != sizeof outPieces / sizeof *outPieces; j++) {
+            long n;
+
+            memcpy(copy, fp, sizeof *copy);
+            n = apply(copy, addr, patch, patchLen, out, len + 1, inPieces[i], outPieces[j]);
+            snprintf(what, sizeof what, "mismatch with input pieces of %u, output pieces of %u",
+                     inPieces[i], outPieces[j]);
+            check(name, n == (long) len && memcmp(out, data, len) == 0, what);
+            snprintf(what, sizeof what, "read written flash with input pieces of %u, output pieces of %u",
+                     inPieces[i], outPieces[j]);
+            check(name, !copy->bad, what);
+        }
+    }
+    check(name, patchLen == 0 || delta_verify(base, patch, patchLen, data, len) == 0, "delta_verify failed");
+    writeFlash(fp, addr, data, addr + len);
+    delta_exclude(base, addr, addr + len);
+    free(copy);
+    free(out);
+    free(patch);
+    return patchLen;
+}
+
+int
+main(void) {
+    unsigned char *old = malloc(FLASH_SIZE), *data = malloc(FLASH_SIZE), *patch = malloc(FLASH_SIZE);
+    flash *fp = calloc(1, sizeof *fp);
+    delta_base *base;
+    uint32_t seed = 0x12345678;
+    size_t len, i;
+    long n;
+
+    if (old == NULL || data == NULL || patch == NULL || fp == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    for (i = 0; i != FLASH_SIZE; i++)
+        old[i] = nextByte(&seed);
+    memcpy(fp->data, old, FLASH_SIZE);
+    base = delta_new();
+    delta_add(base, FLASH_BASE, old, FLASH_SIZE);
+
+    // the block as it already is, which is all copies
+    len = 2 * PAGE_SIZE;
+    check("unchanged", roundTrip("unchanged", base, fp, FLASH_BASE, old, len) < 64, "patch not all copies");
+
+    // a few bytes changed and some inserted, so the rest copies from just below where it goes,
+    // which near the start of each page is one this block has already written
+    memcpy(data, old + 2 * PAGE_SIZE, 3 * PAGE_SIZE);
+    for (i = 100; i < 3 * PAGE_SIZE; i += 700)
+        data[i] ^= 0x5A;
+    memmove(data + 0x300, data + 0x2C0, 3 * PAGE_SIZE - 0x300);
+    memset(data + 0x2C0, 0, 0x40);
+    len = roundTrip("edited", base, fp, FLASH_BASE + 2 * PAGE_SIZE, data, 3 * PAGE_SIZE);
+    check("edited", len < PAGE_SIZE, "patch mostly literals");
+
+    // old pages moved up over themselves, so later copies come from pages this block has written
+    memcpy(data, old + 6 * PAGE_SIZE, 4 * PAGE_SIZE);
+    roundTrip("moved", base, fp, FLASH_BASE + 7 * PAGE_SIZE, data, 4 * PAGE_SIZE);
+
+    // the old contents of pages earlier blocks have overwritten, which can't be copied from
+    memcpy(data, old + 2 * PAGE_SIZE, 2 * PAGE_SIZE);
+    check("excluded", roundTrip("excluded", base, fp, FLASH_BASE + 12 * PAGE_SIZE, data, 2 * PAGE_SIZE) >
+                      2 * PAGE_SIZE, "copied from overwritten flash");
+
+    // a block starting and ending part way through pages, copying from the pages either side
+    memcpy(data, old + 15 * PAGE_SIZE + 0x123, 2 * PAGE_SIZE);
+    memcpy(data + 2 * PAGE_SIZE, old + 18 * PAGE_SIZE, PAGE_SIZE);
+    roundTrip("unaligned", base, fp, FLASH_BASE + 16 * PAGE_SIZE + 0x10, data, 3 * PAGE_SIZE - 0x21);
+    delta_free(base);
+
+    // a base that doesn't match what is in flash gives a block that doesn't match either
+    base = delta_new();
+    delta_add(base, FLASH_BASE, old, FLASH_SIZE);
+    memcpy(data, old + 20 * PAGE_SIZE, PAGE_SIZE);
+    len = delta_encode(base, FLASH_BASE + 22 * PAGE_SIZE, data, PAGE_SIZE, patch, FLASH_SIZE);
+    check("mismatched base", len != 0 && delta_verify(base, patch, len, data, PAGE_SIZE) == 0,
+          "patch doesn't match its own base");
+    fp->data[20 * PAGE_SIZE + 0x400] ^= 1;
+    n = apply(fp, FLASH_BASE + 22 * PAGE_SIZE, patch, len, data + PAGE_SIZE, PAGE_SIZE, 64, PAGE_SIZE);
+    check("mismatched base", n == PAGE_SIZE && !fp->bad, "patch not applied");
+    check("mismatched base", memcmp(data + PAGE_SIZE, data, PAGE_SIZE) != 0, "change in flash not seen");
+    delta_free(base);
+
+    free(fp);
+    free(patch);
+    free(data);
+    free(old);
+    if (failures != 0) {
+        fprintf(stderr, "%d failures\n", failures);
+        return 1;
+    }
+    printf("patch tests passed\n");
+    return 0;
+}
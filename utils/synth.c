@@ -0,0 +1,230 @@
+//
+// Synthetic firmware images for benchmarking the packaging pipeline.
+//
+// Data is drawn from a small dictionary of 32 bit words with some random words mixed in, which is
+// closer to real code than uniform noise. Sparse images are split into regions of 256 bytes to 8K,
+// separated by gaps of 1 byte to 4K, so some gaps are small enough to be coalesced and some are not.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "synth.h"
+#include "elf.h"
+
+#define DICT_SIZE       256
+#define MIN_REGION      256
+#define MAX_REGION      8192
+#define MAX_GAP         4096
+
+typedef struct {
+    unsigned char *data;
+    size_t length;
+    size_t capacity;
+} outbuf;
+
+typedef struct {
+    unsigned long addr;
+    unsigned long length;
+} region;
+
+// xorshift64, so results are the same everywhere for a given seed
+static unsigned long long
+nextRandom(unsigned long long *state) {
+    unsigned long long x = *state;
+
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+static unsigned long
+randomRange(unsigned long long *state, unsigned long lo, unsigned long hi) {
+    return lo + (unsigned long) (nextRandom(state) % (hi - lo + 1));
+}
+
+static unsigned char *
+reserve(outbuf *ob, size_t len) {
+    if (ob->length + len > ob->capacity) {
+        while (ob->length + len > ob->capacity)
+            ob->capacity = ob->capacity == 0 ? 65536 : ob->capacity * 2;
+        ob->data = realloc(ob->data, ob->capacity);
+        if (ob->data == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+    }
+    ob->length += len;
+    return ob->data + ob->length - len;
+}
+
+static void
+put2(unsigned char *addr, unsigned int val) {
+    addr[0] = (unsigned char) (val & 0xFF);
+    addr[1] = (unsigned char) ((val >> 8) & 0xFF);
+}
+
+static void
+put4(unsigned char *addr, unsigned long val) {
+    put2(addr, (unsigned int) (val & 0xFFFF));
+    put2(addr + 2, (unsigned int) ((val >> 16) & 0xFFFF));
+}
+
+/**
+ * Fill a buffer with code-like data.
+ */
+static void
+fillData(unsigned char *dst, unsigned long len, unsigned long long *state) {
+    unsigned char dict[DICT_SIZE][4];
+    unsigned long i;
+    unsigned j;
+
+    for (i = 0; i != DICT_SIZE; i++)
+        for (j = 0; j != 4; j++)
+            dict[i][j] = (unsigned char) nextRandom(state);
+    for (i = 0; i < len; i += 4) {
+        unsigned long long r = nextRandom(state);
+        const unsigned char *word = dict[(r >> 8) % DICT_SIZE];
+        unsigned char rnd[4];
+
+        if ((r & 3) == 0) {
+            put4(rnd, (unsigned long) (r >> 32));
+            word = rnd;
+        }
+        for (j = 0; j != 4 && i + j != len; j++)
+            dst[i + j] = word[j];
+    }
+}
+
+/**
+ * Lay out the regions of the image.
+ * @return  The number of regions
+ */
+static unsigned
+layout(const synth_params *params, region **regions, unsigned long long *state) {
+    unsigned n = 0, cap = 16;
+    unsigned long addr = SYNTH_BASE, left = params->size;
+
+    *regions = malloc(cap * sizeof **regions);
+    while (left != 0) {
+        unsigned long len = params->sparse ? randomRange(state, MIN_REGION, MAX_REGION) : left;
+
+        if (len > left)
+            len = left;
+        if (n == cap)
+            *regions = realloc(*regions, (cap *= 2) * sizeof **regions);
+        (*regions)[n].addr = addr;
+        (*regions)[n].length = len;
+        n++;
+        addr += len + randomRange(state, 1, MAX_GAP);
+        left -= len;
+    }
+    return n;
+}
+
+static void
+hexRecord(outbuf *ob, unsigned type, unsigned addr, const unsigned char *data, unsigned cnt) {
+    char *p = (char *) reserve(ob, 12 + cnt * 2);
+    unsigned sum = cnt + (addr >> 8) + (addr & 0xFF) + type;
+    unsigned i;
+
+    p += sprintf(p, ":%02X%04X%02X", cnt, addr & 0xFFFF, type);
+    for (i = 0; i != cnt; i++) {
+        p += sprintf(p, "%02X", data[i]);
+        sum += data[i];
+    }
+    // sprintf leaves a terminator in the last byte, which the newline overwrites
+    sprintf(p, "%02X", -sum & 0xFF);
+    p[2] = '\n';
+}
+
+static void
+writeHex(outbuf *ob, const synth_params *params, const region *regions, unsigned n,
+         const unsigned char *data, unsigned long long *state) {
+    unsigned long upper = 0;
+    unsigned char ext[2];
+    unsigned i;
+
+    for (i = 0; i != n; i++) {
+        unsigned long pos = 0;
+
+        while (pos != regions[i].length) {
+            unsigned long addr = regions[i].addr + pos;
+            unsigned cnt = params->recordLength != 0 ? params->recordLength : (unsigned) randomRange(state, 1, 255);
+
+            if (cnt > regions[i].length - pos)
+                cnt = (unsigned) (regions[i].length - pos);
+            // records don't cross a 64K boundary
+            if ((addr & 0xFFFF) + cnt > 0x10000)
+                cnt = (unsigned) (0x10000 - (addr & 0xFFFF));
+            if ((addr >> 16) != upper) {
+                upper = addr >> 16;
+                ext[0] = (unsigned char) (upper >> 8);
+                ext[1] = (unsigned char) upper;
+                hexRecord(ob, 4, 0, ext, 2);
+            }
+            hexRecord(ob, 0, (unsigned) (addr & 0xFFFF), data + pos, cnt);
+            pos += cnt;
+        }
+        data += regions[i].length;
+    }
+    hexRecord(ob, 1, 0, NULL, 0);
+}
+
+static void
+writeElf(outbuf *ob, const region *regions, unsigned n, const unsigned char *data) {
+    elf_file_header *fh;
+    size_t phoff = sizeof *fh;
+    unsigned long offset = (unsigned long) (phoff + n * sizeof(elf_program_header));
+    unsigned i;
+
+    reserve(ob, offset);
+    memset(ob->data, 0, offset);
+    fh = (elf_file_header *) ob->data;
+    memcpy(fh->magic, ELF_MAGIC, 4);
+    fh->wordsize = ELF_CLASS32;
+    fh->endianness = ELF_LITTLE;
+    fh->elfVer = 1;
+    put2(fh->type, 2);
+    put2(fh->isa, 0x28);
+    put4(fh->elfVer2, 1);
+    put4(fh->entry, SYNTH_BASE);
+    put4(fh->phoff, phoff);
+    put2(fh->ehsize, sizeof *fh);
+    put2(fh->phentsize, sizeof(elf_program_header));
+    put2(fh->phnum, n);
+    for (i = 0; i != n; i++) {
+        elf_program_header *ph = (elf_program_header *) (ob->data + phoff + i * sizeof *ph);
+        put4(ph->type, ELF_PT_LOAD);
+        put4(ph->offset, offset);
+        put4(ph->vaddr, regions[i].addr);
+        put4(ph->paddr, regions[i].addr);
+        put4(ph->filesz, regions[i].length);
+        put4(ph->memsz, regions[i].length);
+        put4(ph->flags, 5);
+        put4(ph->align, 4);
+        offset += regions[i].length;
+    }
+    memcpy(reserve(ob, offset - ob->length), data, offset - (phoff + n * sizeof(elf_program_header)));
+}
+
+unsigned char *
+synth_image(const synth_params *params, size_t *len) {
+    unsigned long long state = params->seed * 0x9E3779B97F4A7C15ULL + 1;
+    region *regions;
+    unsigned char *data = malloc(params->size + 4);
+    outbuf ob = {NULL, 0, 0};
+    unsigned n;
+
+    n = layout(params, &regions, &state);
+    fillData(data, params->size, &state);
+    if (params->elf)
+        writeElf(&ob, regions, n, data);
+    else
+        writeHex(&ob, params, regions, n, data, &state);
+    free(regions);
+    free(data);
+    *len = ob.length;
+    return ob.data;
+}
@@ -0,0 +1,29 @@
+//
+// Synthetic firmware images for benchmarking the packaging pipeline.
+//
+
+#ifndef UTILS_SYNTH_H
+#define UTILS_SYNTH_H
+
+#include <stddef.h>
+
+#define SYNTH_BASE      0x21000     // load address of the first byte, as for a real application
+
+/*
+ * What to generate. The same parameters always produce the same file.
+ */
+typedef struct {
+    unsigned long size;         // bytes of data in the image
+    int sparse;                 // scatter the data over regions separated by gaps, else one run
+    int elf;                    // produce an ELF file with one segment per region, else Intel hex
+    unsigned recordLength;      // data bytes per hex record, 0 for a random length per record
+    unsigned long seed;
+} synth_params;
+
+/*
+ * Generate an input file in memory. The caller frees the result.
+ * @param len   Set to the length of the file
+ */
+extern unsigned char *synth_image(const synth_params *, size_t *len);
+
+#endif //UTILS_SYNTH_H
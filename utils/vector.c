@@ -4,14 +4,30 @@
 
 #include	<string.h>
 #include	<stdlib.h>
+#include	<stdint.h>
 #include	<assert.h>
 #include	"vector.h"
+#include	"arena.h"
 
 #define	DEFAULT_VEC_INCR	10	/* default increment of vector size */
+#define	MIN_INDEX_SIZE		16	/* smallest hash index */
+#define	AUTO_INDEX		64	/* vec_addAllNotPresent() indexes unions this big */
+#define	MIN_RUN			16	/* vec_sort() extends shorter runs by insertion */
+
+/*
+ * One slot in the hash index. Empty slots have a NULL key; NULL
+ * elements are not indexed, and are found by a linear scan.
+ */
+struct vec_slot
+{
+	const void *	key;
+	unsigned	pos;
+};
 
 
 // ensure we have the capacity to store element num. So the capacity must be > num
-static void
+// Returns 0, or -1 if the storage could not be allocated, leaving the vector as it was.
+static int
 ensure_capacity(vector_t p, unsigned size)
 {
 	void *		d;
@@ -25,14 +41,88 @@ ensure_capacity(vector_t p, unsigned size)
 	while(newsize <= size)
 		newsize *= 2;
 	if(p->capacity < newsize) {
-		d = calloc(newsize,sizeof *p->data);
+		if(p->arena != NULL) {
+			if(arena_extend(p->arena, p->data, newsize * sizeof *p->data)) {
+				p->capacity = newsize;
+				return 0;
+			}
+			d = arena_alloc(p->arena, newsize * sizeof *p->data);
+		} else
+			d = calloc(newsize,sizeof *p->data);
+		if(d == NULL)
+			return -1;
 		if(p->capacity) {
 			memcpy(d, p->data, p->count*sizeof *p->data);
-			free(p->data);
+			if(p->arena == NULL)
+				free(p->data);
 		}
 		p->data = d;
 		p->capacity = newsize;
 	}
+	return 0;
+}
+
+static unsigned
+hash_ptr(const void * e)
+{
+	uintptr_t	v = (uintptr_t)e;
+
+	// the low bits of a pointer are mostly alignment
+	v ^= v >> 16;
+	return (unsigned)((v >> 3) * 2654435761u);
+}
+
+// record the position of an element, unless an earlier one is already there
+static void
+index_put(vector_t p, const void * e, unsigned pos)
+{
+	unsigned	mask = p->indexSize - 1;
+	unsigned	i;
+
+	if(e == NULL)
+		return;
+	for(i = hash_ptr(e) & mask ; p->index[i].key != NULL ; i = (i+1) & mask)
+		if(p->index[i].key == e)
+			return;
+	p->index[i].key = e;
+	p->index[i].pos = pos;
+}
+
+// rebuild the index from scratch, keeping it at most half full
+// Returns -1, leaving no index, if it could not be allocated.
+static int
+index_rebuild(vector_t p)
+{
+	unsigned	size = MIN_INDEX_SIZE;
+	unsigned	i;
+
+	while(size < p->count * 2)
+		size *= 2;
+	if(size != p->indexSize) {
+		if(p->arena == NULL)
+			free(p->index);
+		if(p->arena != NULL)
+			p->index = arena_alloc(p->arena, size * sizeof *p->index);
+		else
+			p->index = calloc(size, sizeof *p->index);
+		if(p->index == NULL) {
+			p->indexSize = 0;
+			return -1;
+		}
+		p->indexSize = size;
+	} else
+		memset(p->index, 0, size * sizeof *p->index);
+	for(i = 0 ; i != p->count ; i++)
+		index_put(p, p->data[i], i);
+	p->indexDirty = 0;
+	return 0;
+}
+
+// note that positions have changed
+static void
+index_invalidate(vector_t p)
+{
+	p->indexDirty = 1;
 }
 
 vector_t
@@ -48,18 +138,47 @@ vec_new_incr(unsigned incr)
 	vector_t	p;
 
 	p = calloc(1, sizeof *p);
+	if(p == NULL)
+		return NULL;
 	p->increment = incr;
 	p->unique = unique++;
 	return p;
 }
 
+vector_t
+vec_new_arena(struct arena *arena)
+{
+	vector_t	p;
+
+	p = arena_alloc(arena, sizeof *p);
+	if(p == NULL)
+		return NULL;
+	p->increment = DEFAULT_VEC_INCR;
+	p->arena = arena;
+	return p;
+}
+
+void
+vec_setIndexed(vector_t p, unsigned on)
+{
+	assert(p);
+	if(!on && p->arena == NULL) {
+		free(p->index);
+		p->index = NULL;
+		p->indexSize = 0;
+	}
+	p->indexed = on;
+	p->indexDirty = 1;
+}
+
 void
 vec_destroy(vector_t p)
 {
-	if(p == NULL)
+	if(p == NULL || p->arena != NULL)
 		return;
 	if(p->data != NULL)
 		free(p->data);
+	free(p->index);
 	free(p);
 }
 
@@ -72,6 +191,10 @@ vec_copy(const vector_t p)
 		return NULL;
 	t = calloc(1, sizeof *t);
 	memcpy(t, p, sizeof *t);
+	t->arena = NULL;
+	t->index = NULL;
+	t->indexSize = 0;
+	t->indexDirty = 1;
 	t->data = calloc(t->capacity, sizeof *t->data);
 	memcpy(t->data, p->data, t->count * sizeof *t->data);
 	return t;
@@ -81,8 +204,15 @@ unsigned
 vec_add(vector_t p, const void * e)
 {
 	assert(p);
-	ensure_capacity(p, 0);
+	if(ensure_capacity(p, 0) != 0)
+		return VEC_NOMEM;
 	p->data[p->count] = e;
+	if(p->indexed && !p->indexDirty) {
+		if((p->count+1) * 2 > p->indexSize)
+			index_invalidate(p);
+		else
+			index_put(p, e, p->count);
+	}
 	return p->count++;
 }
 
@@ -103,6 +233,7 @@ vec_pop(vector_t p)
 	assert(p);
 	if(p->count == 0)
 		return NULL;
+	index_invalidate(p);
 	return (void *) p->data[--p->count];
 }
 
@@ -142,6 +273,8 @@ vec_addAllNotPresent(vector_t p, vector_t n)
 
 	assert(p);
 	assert(n);
+	if(!p->indexed && p->count + n->count >= AUTO_INDEX)
+		vec_setIndexed(p, 1);
 	VEC_ITERATE(n, vp, void *)
 		vec_addNotPresent(p, vp);
 	return vec_size(n);
@@ -153,7 +286,9 @@ vec_insert(vector_t p, const void * e, unsigned pos)
 {
 	unsigned	i;
 
-	ensure_capacity(p, 0);
+	if(ensure_capacity(p, 0) != 0)
+		return VEC_NOMEM;
+	index_invalidate(p);
 	if(pos > p->count)
 		pos = p->count;
 	if(pos <= p->marker)
@@ -174,9 +309,9 @@ vec_move(vector_t p, unsigned from, unsigned to)
 {
 	const void *	e;
 
-	if(from >= p->count)
+	if(from >= p->count || ensure_capacity(p, to) != 0)
 		return;
-	ensure_capacity(p, to);
+	index_invalidate(p);
 	e = p->data[from];
 	if(from < to) {
 		do
@@ -194,7 +329,9 @@ vec_move(vector_t p, unsigned from, unsigned to)
 void
 vec_setAt(vector_t p, const void * e, unsigned pos)
 {
-	ensure_capacity(p, pos);
+	if(ensure_capacity(p, pos) != 0)
+		return;
+	index_invalidate(p);
 	if (pos >= p->count) {
 		p->count = pos+1;
 	}
@@ -217,6 +354,7 @@ vec_removeAt(vector_t p, unsigned pos)
 {
 	if(pos >= p->count)
 		return 0;
+	index_invalidate(p);
 	p->count--;
 	if(pos < p->marker)
 		p->marker--;
@@ -231,11 +369,12 @@ vec_removeAt(vector_t p, unsigned pos)
 void
 vec_removeAll(vector_t p)
 {
+	index_invalidate(p);
 	p->count = 0;
 }
 
 void *
-vec_elementAt(const vector_t p, unsigned pos)
+vec_elementAt(const struct vector_t * p, unsigned pos)
 {
 	if(pos < p->count)
 		return (void *) p->data[pos];
@@ -246,7 +385,16 @@ int
 vec_indexOf(const vector_t p, const void * e)
 {
 	unsigned int	i;
-	
+	unsigned	mask;
+
+	// without room for an index, fall back to a scan
+	if(p->indexed && e != NULL && (!p->indexDirty || index_rebuild(p) == 0)) {
+		mask = p->indexSize - 1;
+		for(i = hash_ptr(e) & mask ; p->index[i].key != NULL ; i = (i+1) & mask)
+			if(p->index[i].key == e)
+				return p->index[i].pos;
+		return -1;
+	}
 	for(i = 0 ; i != p->count ; i++)
 		if(p->data[i] == e)
 			return i;
@@ -254,13 +402,40 @@ vec_indexOf(const vector_t p, const void * e)
 }
 
 unsigned
-vec_size(const vector_t p)
+vec_size(const struct vector_t * p)
 {
 	if(p == NULL)
 		return 0;
 	return p->count;
 }
 
+void
+vec_cursor_init(vec_cursor * c, const struct vector_t * p)
+{
+	c->vec = p;
+	c->pos = 0;
+}
+
+unsigned
+vec_cursor_hasNext(const vec_cursor * c)
+{
+	return c->pos < vec_size(c->vec);
+}
+
+void *
+vec_cursor_next(vec_cursor * c)
+{
+	if(c->pos < vec_size(c->vec))
+		return (void *) c->vec->data[c->pos++];
+	return NULL;
+}
+
+unsigned
+vec_cursor_index(const vec_cursor * c)
+{
+	return c->pos - 1;
+}
+
 void *
 vec_first(vector_t p)
 {
@@ -323,10 +498,110 @@ vec_hasNext(vector_t p)
 	return p->marker < p->count;
 }
 
+/*
+ * Find the run starting at lo: the longest stretch in ascending order, or
+ * in strictly descending order, which is reversed. Runs shorter than
+ * MIN_RUN are extended by insertion. Returns the end of the run.
+ */
+static unsigned
+sort_run(const void ** d, unsigned lo, unsigned n, int (*cmpfunc)(const void *, const void *))
+{
+	unsigned	hi = lo + 1;
+	unsigned	i, j, end;
+	const void *	e;
+
+	if(hi == n)
+		return hi;
+	if(cmpfunc(&d[hi], &d[lo]) < 0) {
+		while(++hi != n && cmpfunc(&d[hi], &d[hi-1]) < 0)
+			;
+		for(i = lo, j = hi-1 ; i < j ; i++, j--) {
+			e = d[i];
+			d[i] = d[j];
+			d[j] = e;
+		}
+	} else
+		while(++hi != n && cmpfunc(&d[hi], &d[hi-1]) >= 0)
+			;
+	end = n - lo < MIN_RUN ? n : lo + MIN_RUN;
+	for( ; hi < end ; hi++) {
+		e = d[hi];
+		for(j = hi ; j != lo && cmpfunc(&d[j-1], &e) > 0 ; j--)
+			d[j] = d[j-1];
+		d[j] = e;
+	}
+	return hi;
+}
+
+/*
+ * Merge the adjacent runs [lo, mid) and [mid, hi), using tmp to hold
+ * the first one.
+ */
+static void
+sort_merge(const void ** d, unsigned lo, unsigned mid, unsigned hi, const void ** tmp,
+	int (*cmpfunc)(const void *, const void *))
+{
+	unsigned	i = 0, j = mid, k = lo;
+	unsigned	n = mid - lo;
+
+	// already in order
+	if(cmpfunc(&d[mid-1], &d[mid]) <= 0)
+		return;
+	memcpy(tmp, d + lo, n * sizeof *d);
+	while(i != n && j != hi) {
+		if(cmpfunc(&d[j], &tmp[i]) < 0)
+			d[k++] = d[j++];
+		else
+			d[k++] = tmp[i++];
+	}
+	memcpy(d + k, tmp + i, (n - i) * sizeof *d);
+}
+
+/*
+ * A natural merge sort. The ordered runs in the input are found
+ * and merged pairwise, so sorted or nearly sorted data costs
+ * little more than one pass of comparisons.
+ */
 void
 vec_sort(vector_t p, int (*cmpfunc)(const void *, const void *))
 {
-	if(p->count == 0)
+	unsigned *	runs;
+	unsigned	numRuns = 0;
+	unsigned	lo, i, j;
+	const void **	tmp;
+
+	if(p->count < 2)
+		return;
+	index_invalidate(p);
+	runs = malloc((p->count / MIN_RUN + 2) * sizeof *runs);
+	if(runs == NULL) {
+		qsort(p->data, p->count, sizeof *p->data, cmpfunc);
+		return;
+	}
+	for(lo = 0 ; lo != p->count ; lo = sort_run(p->data, lo, p->count, cmpfunc))
+		runs[numRuns++] = lo;
+	runs[numRuns] = p->count;
+	if(numRuns == 1) {
+		free(runs);
+		return;
+	}
+	tmp = malloc(p->count * sizeof *tmp);
+	if(tmp == NULL) {
+		// no room to merge into, so sort in place
+		free(runs);
+		qsort(p->data, p->count, sizeof *p->data, cmpfunc);
 		return;
-	qsort(p->data, p->count, sizeof *p->data, cmpfunc);
+	}
+	while(numRuns > 1) {
+		for(i = 0, j = 0 ; i + 1 < numRuns ; i += 2, j++) {
+			sort_merge(p->data, runs[i], runs[i+1], runs[i+2], tmp, cmpfunc);
+			runs[j] = runs[i];
+		}
+		if(i < numRuns)
+			runs[j++] = runs[i];
+		runs[j] = p->count;
+		numRuns = j;
+	}
+	free(tmp);
+	free(runs);
 }
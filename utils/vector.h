@@ -5,6 +5,9 @@
 #ifndef _VECTOR_H_
 #define _VECTOR_H_
 
+struct arena;
+struct vec_slot;
+
 /*
  * This structure should be considered private.
  */
@@ -17,8 +20,24 @@ typedef struct vector_t
 	unsigned	marker_nest;	/* next one to return from vec_next_nest() */
 	const void **	data;		/* the list of data */
 	unsigned	unique;		/* a unique number */
+	struct arena *	arena;		/* where storage comes from, NULL for the heap */
+	unsigned	indexed;	/* keep a hash index of the elements */
+	unsigned	indexDirty;	/* the index must be rebuilt before use */
+	unsigned	indexSize;	/* slots in the index, a power of 2 */
+	struct vec_slot * index;	/* element -> position, built on demand */
 } *	vector_t;
 
+/*
+ * An iteration position kept outside the vector. Any number of cursors
+ * may walk the same vector at once, from any thread, provided the vector
+ * is not modified meanwhile.
+ */
+typedef struct
+{
+	const struct vector_t *	vec;
+	unsigned		pos;	/* index of the next element */
+} vec_cursor;
+
 /*
  * Constructor. Uses default increment.
  */
@@ -29,6 +48,21 @@ extern vector_t	vec_new();
  */
 extern vector_t	vec_new_incr(unsigned);
 
+/*
+ * Constructor. The vector and its storage are allocated from an arena,
+ * and released with it; vec_destroy() does nothing. Returns NULL if the
+ * arena is out of memory.
+ */
+extern vector_t	vec_new_arena(struct arena *);
+
+/*
+ * Turn the hash index on or off. With the index on, vec_indexOf() and
+ * everything built on it take constant time; the index is kept up to
+ * date by vec_add() and rebuilt after any other change the next time it
+ * is needed. vec_addAllNotPresent() turns it on for large vectors.
+ */
+extern void	vec_setIndexed(vector_t, unsigned);
+
 /*
  * Destructor.
  */
@@ -40,7 +74,12 @@ extern void	vec_destroy(vector_t);
 extern vector_t	vec_copy(const vector_t);
 
 /*
- * Add an element to the end.
+ * Returned in place of an index when the vector could not grow.
+ */
+#define	VEC_NOMEM	((unsigned) -1)
+
+/*
+ * Add an element to the end. Returns its index, or VEC_NOMEM.
  */
 extern unsigned	vec_add(vector_t, const void *);
 
@@ -68,7 +107,7 @@ extern unsigned vec_addNotPresent(vector_t p, const void * e);
 extern unsigned vec_addAllNotPresent(vector_t p, vector_t);
 
 /*
- * Insert an element at a particular place.
+ * Insert an element at a particular place. Returns its index, or VEC_NOMEM.
  */
 extern unsigned	vec_insert(vector_t, const void *, unsigned);
 
@@ -101,20 +140,47 @@ extern void		vec_removeAll(vector_t);
  * Retrieve element at the given index.
  * Returns NULL if not found.
  */
-extern void *		vec_elementAt(const vector_t, unsigned);
+extern void *		vec_elementAt(const struct vector_t *, unsigned);
 
 /*
  * Retrieve the index of the given element.
  * Returns -1 if not found.
+ * If the vector is indexed this may rebuild the index, so it is not
+ * safe alongside other readers; use a cursor to search instead.
  */
 extern int		vec_indexOf(const vector_t, const void *);
 
 /*
  * Return the number of elements.
  */
-extern unsigned	vec_size(const vector_t);
+extern unsigned	vec_size(const struct vector_t *);
 
 /*
+ * Start a cursor at the first element. The vector is not touched.
+ */
+extern void		vec_cursor_init(vec_cursor *, const struct vector_t *);
+
+/*
+ * Are there more elements to get with vec_cursor_next() ?
+ */
+extern unsigned		vec_cursor_hasNext(const vec_cursor *);
+
+/*
+ * Get the next element and advance the cursor.
+ * Returns NULL at the end.
+ */
+extern void *		vec_cursor_next(vec_cursor *);
+
+/*
+ * The index of the element most recently returned by vec_cursor_next().
+ */
+extern unsigned		vec_cursor_index(const vec_cursor *);
+
+/*
+ * The marker functions below keep their state in the vector, so only
+ * one loop (or two with the nested versions) can use them at a time.
+ * Prefer a cursor.
+ *
  * Get the first element, and initialize the marker. And nested version.
  */
 extern void *		vec_first(vector_t);
@@ -147,7 +213,8 @@ extern void			vec_reset(vector_t);
 extern unsigned		vec_hasNext(vector_t);
 
 /*
- * Sort the vector, as in qsort().
+ * Sort the vector, as in qsort(). Input that is already in order, or
+ * made up of a few ordered runs, is sorted in linear time.
  */
 extern void		vec_sort(vector_t, int (*)(const void *, const void *));
 
@@ -180,6 +247,15 @@ extern void *	vec_top(vector_t);
 	    marker!=vec_size(vec) && ((el = (eltype)vec_elementAt(vec, marker)), 1); \
 	    marker++)
 
+/*
+ * Iterate through a vector with a cursor, which the caller declares.
+ * Nothing in the vector is changed, so loops may be nested and
+ * threads may share the vector. Do NOT modify the vector during the loop.
+ */
+#define	VEC_FOREACH(vec, el, eltype, cur)	\
+	for(vec_cursor_init(&(cur), vec) ; \
+	    vec_cursor_hasNext(&(cur)) && ((el = (eltype)vec_cursor_next(&(cur))), 1) ; )
+
 #define	vec_contains(v, p)	(vec_indexOf(v, p) != -1)
 
 #endif